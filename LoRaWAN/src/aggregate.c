@@ -0,0 +1,78 @@
+
+/*
+ * Windowed aggregation of sensor readings
+ *
+ * Keeps the minimum, maximum, mean and standard deviation of each sensor
+ * field over a window using the fixed point Welford code in welford.c, so
+ * no samples need to be stored. Deltas are exact up to a few tens of
+ * thousands of counts, and lose half of the fraction bits above that.
+ * tools/welford_check.c checks the results against double precision.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+
+#include "schema.h"
+#include "sensors.h"
+#include "aggregate.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(aggregate);
+
+static struct welford fields[SENSOR_FIELD_COUNT];
+static uint16_t samples;
+
+void agg_reset(void)
+{
+	for (int i = 0; i < SENSOR_FIELD_COUNT; i++) {
+		welford_reset(&fields[i]);
+	}
+	samples = 0;
+}
+
+void agg_add(const int32_t values[SENSOR_FIELD_COUNT], uint32_t valid)
+{
+	if (samples == UINT16_MAX) {
+		return;
+	}
+	samples++;
+
+	// Each field keeps its own count, so a failed read doesn't drag the mean towards 0.
+	for (int i = 0; i < SENSOR_FIELD_COUNT; i++) {
+		if (valid & BIT(i)) {
+			welford_add(&fields[i], values[i]);
+		}
+	}
+}
+
+uint16_t agg_samples(void)
+{
+	return samples;
+}
+
+void agg_summarise(struct agg_summary *summary)
+{
+	summary->samples = samples;
+	summary->valid = 0;
+
+	for (int i = 0; i < SENSOR_FIELD_COUNT; i++) {
+		welford_summarise(&fields[i], summary->stats[i]);
+		if (fields[i].samples > 0) {
+			summary->valid |= BIT(i);
+		}
+		if (fields[i].samples < samples) {
+			LOG_WRN("Field %d: %d of %d readings valid", i, fields[i].samples, samples);
+		}
+	}
+
+	LOG_DBG("%d samples, temperature mean %d stddev %d", samples,
+		summary->stats[SENSOR_FIELD_TEMPERATURE][AGG_MEAN],
+		summary->stats[SENSOR_FIELD_TEMPERATURE][AGG_STDDEV]);
+}
@@ -0,0 +1,26 @@
+
+/*
+ * Windowed aggregation of sensor readings
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Sensors are sampled this often, and summarised once per reporting period.
+#define AGG_SAMPLE_PERIOD       K_SECONDS(60)
+
+#include "welford.h"
+
+// Statistics in the same fixed point units as the sensor fields. A field
+// with no valid reading in the window has all statistics 0 and no bit in valid.
+struct agg_summary {
+	uint16_t samples;
+	uint32_t valid;
+	int32_t stats[SENSOR_FIELD_COUNT][AGG_STAT_COUNT];
+};
+
+void agg_reset(void);
+void agg_add(const int32_t values[SENSOR_FIELD_COUNT], uint32_t valid);
+uint16_t agg_samples(void);
+void agg_summarise(struct agg_summary *summary);
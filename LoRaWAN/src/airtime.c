@@ -0,0 +1,81 @@
+
+/*
+ * LoRa time on air
+ *
+ * Time on air from Semtech AN1200.13, with explicit header, CRC on and
+ * coding rate 4/5 as used for LoRaWAN uplinks. This file has no Zephyr
+ * dependencies so it can be built into host tools.
+ *
+ * Only the LoRa datarates are covered (not FSK or LR-FHSS), and maximum
+ * payloads are those without a dwell time limit (AS923, AU915).
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdint.h>
+
+#include "airtime.h"
+
+struct airtime_dr {
+	uint8_t sf;
+	uint16_t bw_khz;
+	uint8_t max_payload;    // Application payload without FOpts, no dwell time limit
+};
+
+// Uplink LoRa datarates for the configured region (LoRaWAN Regional Parameters)
+static const struct airtime_dr airtime_drs[] = {
+#if defined(CONFIG_LORAMAC_REGION_US915)
+	{ 10, 125, 11 }, { 9, 125, 53 }, { 8, 125, 125 }, { 7, 125, 242 }, { 8, 500, 242 },
+#elif defined(CONFIG_LORAMAC_REGION_AU915)
+	{ 12, 125, 51 }, { 11, 125, 51 }, { 10, 125, 51 }, { 9, 125, 115 }, { 8, 125, 242 },
+	{ 7, 125, 242 }, { 8, 500, 242 },
+#elif defined(CONFIG_LORAMAC_REGION_KR920) || defined(CONFIG_LORAMAC_REGION_IN865) || \
+	defined(CONFIG_LORAMAC_REGION_CN470)
+	{ 12, 125, 51 }, { 11, 125, 51 }, { 10, 125, 51 }, { 9, 125, 115 }, { 8, 125, 222 },
+	{ 7, 125, 222 },
+#else
+	// EU868, EU433, CN779, AS923 and RU864
+	{ 12, 125, 51 }, { 11, 125, 51 }, { 10, 125, 51 }, { 9, 125, 115 }, { 8, 125, 222 },
+	{ 7, 125, 222 }, { 7, 250, 222 },
+#endif
+};
+
+#define AIRTIME_DR_COUNT (sizeof(airtime_drs) / sizeof(airtime_drs[0]))
+
+uint32_t airtime_us(uint8_t sf, uint16_t bw_khz, uint8_t phy_len)
+{
+	uint32_t symbol_us = ((1UL << sf) * 1000UL) / bw_khz;
+	uint8_t de = (sf >= 11 && bw_khz == 125) ? 1 : 0;
+	int32_t num, den, payload_symbols;
+
+	// ceil((8PL - 4SF + 28 + 16CRC - 20IH) / 4(SF - 2DE)) * (CR + 4)
+	num = 8 * phy_len - 4 * sf + 28 + 16;
+	den = 4 * (sf - 2 * de);
+	payload_symbols = 8;
+	if (num > 0) {
+		payload_symbols += ((num + den - 1) / den) * (1 + 4);
+	}
+
+	// Preamble is npreamble + 4.25 symbols
+	return (AIRTIME_PREAMBLE_LEN * 4 + 17) * symbol_us / 4 + payload_symbols * symbol_us;
+}
+
+uint32_t airtime_dr_us(uint8_t dr, uint8_t app_len)
+{
+	if (dr >= AIRTIME_DR_COUNT) {
+		dr = 0;
+	}
+	return airtime_us(airtime_drs[dr].sf, airtime_drs[dr].bw_khz, app_len + AIRTIME_LORAWAN_OVERHEAD);
+}
+
+uint8_t airtime_dr_count(void)
+{
+	return AIRTIME_DR_COUNT;
+}
+
+uint8_t airtime_dr_max_payload(uint8_t dr)
+{
+	return dr < AIRTIME_DR_COUNT ? airtime_drs[dr].max_payload : 0;
+}
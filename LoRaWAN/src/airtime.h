@@ -0,0 +1,17 @@
+
+/*
+ * LoRa time on air
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// LoRaWAN MHDR, FHDR (no FOpts), FPort and MIC
+#define AIRTIME_LORAWAN_OVERHEAD    13
+#define AIRTIME_PREAMBLE_LEN        8
+
+uint32_t airtime_us(uint8_t sf, uint16_t bw_khz, uint8_t phy_len);
+uint32_t airtime_dr_us(uint8_t dr, uint8_t app_len);
+uint8_t airtime_dr_count(void);
+uint8_t airtime_dr_max_payload(uint8_t dr);
@@ -0,0 +1,134 @@
+
+/*
+ * Application configuration, adjustable by downlink and kept in NVS
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/fs/nvs.h>
+
+#include "nvs.h"
+#include "config.h"
+#include "workq.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(config);
+
+static struct nvs_fs *config_fs;
+
+static struct app_config config;
+
+static const struct app_config config_defaults = {
+	.version = APP_CONFIG_VERSION,
+	.confirmed_ratio = 0,
+	.report_period = APP_CONFIG_REPORT_PERIOD_DEFAULT,
+	.temp_deadband = 0,
+	.humd_deadband = 0,
+	.dr_min = 0,
+	.dr_max = APP_CONFIG_DR_MAX,
+};
+
+// -1 until the stack reports a datarate
+static int current_dr = -1;
+static bool adr_disabled;
+
+static void config_dr_work_handler(struct k_work *work)
+{
+	int dr = CLAMP(current_dr, config.dr_min, config.dr_max);
+	int ret;
+
+	if (!config_dr_limited()) {
+		if (adr_disabled) {
+			// Limits cleared, hand the datarate back to ADR.
+			LOG_INF("DR limits cleared, enabling ADR");
+			lorawan_enable_adr(true);
+			adr_disabled = false;
+		}
+		return;
+	}
+
+	if (current_dr < 0 || dr == current_dr) {
+		return;
+	}
+
+	// The stack rejects a fixed datarate while ADR is on, so ADR stays off
+	// until the limits are cleared.
+	LOG_INF("DR_%d outside limits DR_%d-DR_%d, using DR_%d", current_dr, config.dr_min, config.dr_max, dr);
+	lorawan_enable_adr(false);
+	adr_disabled = true;
+	ret = lorawan_set_datarate(dr);
+	if (ret < 0) {
+		LOG_ERR("lorawan_set_datarate failed: %d", ret);
+	}
+}
+
+static K_WORK_DEFINE(config_dr_work, config_dr_work_handler);
+
+void config_init(struct nvs_fs *fs)
+{
+	int ret;
+
+	config_fs = fs;
+
+	ret = nvs_read(fs, NVS_APP_CONFIG_ID, &config, sizeof(config));
+	if (ret != sizeof(config) || config.version != APP_CONFIG_VERSION) {
+		LOG_INF("NVS ID %d AppConfig: Not found, using defaults.", NVS_APP_CONFIG_ID);
+		config = config_defaults;
+		return;
+	}
+
+	LOG_INF("NVS ID %d AppConfig: Period %ds, Deadband %d/%d, Confirmed 1/%d, DR_%d-DR_%d",
+		NVS_APP_CONFIG_ID, config.report_period, config.temp_deadband, config.humd_deadband,
+		config.confirmed_ratio, config.dr_min, config.dr_max);
+}
+
+struct app_config *config_get(void)
+{
+	return &config;
+}
+
+int config_save(void)
+{
+	ssize_t bytes_written;
+
+	// NVS only writes if the contents have changed.
+	bytes_written = nvs_write(config_fs, NVS_APP_CONFIG_ID, &config, sizeof(config));
+	if (bytes_written < 0) {
+		LOG_ERR("NVS: Failed to write id %d (%d)", NVS_APP_CONFIG_ID, bytes_written);
+		return bytes_written;
+	}
+
+	// Apply DR limits straight away rather than waiting for the next ADR change.
+	k_work_submit_to_queue(&app_workq, &config_dr_work);
+	return 0;
+}
+
+bool config_dr_limited(void)
+{
+	return config.dr_min != config_defaults.dr_min || config.dr_max != config_defaults.dr_max;
+}
+
+void config_datarate_changed(enum lorawan_datarate dr)
+{
+	// Called from the LoRaWAN stack, defer any change to the work queue.
+	current_dr = dr;
+	if (dr < config.dr_min || dr > config.dr_max) {
+		k_work_submit_to_queue(&app_workq, &config_dr_work);
+	}
+}
+
+uint8_t config_get_datarate(void)
+{
+	// Assume the slowest datarate until the stack tells us otherwise.
+	return current_dr < 0 ? 0 : current_dr;
+}
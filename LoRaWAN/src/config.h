@@ -0,0 +1,39 @@
+
+/*
+ * Application configuration, adjustable by downlink and kept in NVS
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define APP_CONFIG_VERSION                  1
+
+#define APP_CONFIG_REPORT_PERIOD_DEFAULT    (10 * 60)
+#define APP_CONFIG_REPORT_PERIOD_MIN        60
+
+// Deadbands in 0.01 degC and 0.1 %RH, 0 to send every reading
+#define APP_CONFIG_TEMP_DEADBAND_MAX        1000
+#define APP_CONFIG_HUMD_DEADBAND_MAX        500
+
+// Send a reading at least this often regardless of deadband
+#define APP_CONFIG_DEADBAND_MAX_SKIP        6
+
+#define APP_CONFIG_DR_MAX                   15
+
+struct app_config {
+	uint8_t version;
+	uint8_t confirmed_ratio;        // Every Nth uplink is confirmed, 0 for never
+	uint16_t report_period;         // Seconds
+	uint16_t temp_deadband;
+	uint16_t humd_deadband;
+	uint8_t dr_min;
+	uint8_t dr_max;
+} __attribute__((packed));
+
+void config_init(struct nvs_fs *fs);
+struct app_config *config_get(void);
+int config_save(void);
+bool config_dr_limited(void);
+void config_datarate_changed(enum lorawan_datarate dr);
+uint8_t config_get_datarate(void);
@@ -0,0 +1,273 @@
+
+/*
+ * Downlink command dispatcher
+ *
+ * The LoRaWAN downlink callback runs in the stack's context, so it only copies
+ * the frame into a small queue. A work item then looks each command up in a
+ * table keyed by port and opcode, validates it, applies it and saves the
+ * resulting configuration to NVS.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <zephyr/fs/nvs.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/reboot.h>
+
+#include "config.h"
+#include "slot.h"
+#include "downlink.h"
+#include "workq.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(downlink);
+
+struct downlink_frame {
+	uint32_t timestamp;         // Cycle count when received
+	uint8_t port;
+	uint8_t len;
+	uint8_t data[DOWNLINK_MAX_LEN];
+};
+
+struct downlink_cmd {
+	uint8_t port;
+	uint8_t opcode;
+	uint8_t len;                // Argument bytes following the opcode
+	const char *name;
+	int (*handler)(const uint8_t *args);
+};
+
+K_MSGQ_DEFINE(downlink_msgq, sizeof(struct downlink_frame), DOWNLINK_QUEUE_DEPTH, 4);
+
+static struct downlink_stats stats;
+static atomic_t diagnostics_requested;
+
+static void downlink_reboot_handler(struct k_work *work)
+{
+	LOG_WRN("Rebooting by downlink request");
+	sys_reboot(SYS_REBOOT_COLD);
+}
+
+static K_WORK_DELAYABLE_DEFINE(reboot_work, downlink_reboot_handler);
+
+static int cmd_report_period(const uint8_t *args)
+{
+	uint16_t period = sys_get_le16(args);
+
+	if (period < APP_CONFIG_REPORT_PERIOD_MIN) {
+		return -EINVAL;
+	}
+	config_get()->report_period = period;
+	slot_set_period(period);
+	return config_save();
+}
+
+static int cmd_deadband(const uint8_t *args)
+{
+	uint16_t temp = sys_get_le16(&args[0]);
+	uint16_t humd = sys_get_le16(&args[2]);
+
+	if (temp > APP_CONFIG_TEMP_DEADBAND_MAX || humd > APP_CONFIG_HUMD_DEADBAND_MAX) {
+		return -EINVAL;
+	}
+	config_get()->temp_deadband = temp;
+	config_get()->humd_deadband = humd;
+	return config_save();
+}
+
+static int cmd_confirmed(const uint8_t *args)
+{
+	config_get()->confirmed_ratio = args[0];
+	return config_save();
+}
+
+static int cmd_dr_limits(const uint8_t *args)
+{
+	if (args[0] > args[1] || args[1] > APP_CONFIG_DR_MAX) {
+		return -EINVAL;
+	}
+	config_get()->dr_min = args[0];
+	config_get()->dr_max = args[1];
+	return config_save();
+}
+
+static int cmd_reboot(const uint8_t *args)
+{
+	if (args[0] != DOWNLINK_REBOOT_MAGIC) {
+		return -EINVAL;
+	}
+	// Give the log and NVS a moment before going down.
+	k_work_reschedule_for_queue(&app_workq, &reboot_work, DOWNLINK_REBOOT_DELAY);
+	return 0;
+}
+
+static int cmd_diagnostics(const uint8_t *args)
+{
+	atomic_set(&diagnostics_requested, 1);
+	return 0;
+}
+
+static const struct downlink_cmd downlink_cmds[] = {
+	{ DOWNLINK_CMD_PORT, DOWNLINK_OP_REPORT_PERIOD, 2, "report period", cmd_report_period },
+	{ DOWNLINK_CMD_PORT, DOWNLINK_OP_DEADBAND,      4, "deadband",      cmd_deadband },
+	{ DOWNLINK_CMD_PORT, DOWNLINK_OP_CONFIRMED,     1, "confirmed",     cmd_confirmed },
+	{ DOWNLINK_CMD_PORT, DOWNLINK_OP_DR_LIMITS,     2, "DR limits",     cmd_dr_limits },
+	{ DOWNLINK_CMD_PORT, DOWNLINK_OP_REBOOT,        1, "reboot",        cmd_reboot },
+	{ DOWNLINK_CMD_PORT, DOWNLINK_OP_DIAGNOSTICS,   0, "diagnostics",   cmd_diagnostics },
+};
+
+static const struct downlink_cmd *downlink_find(uint8_t port, uint8_t opcode)
+{
+	for (int i = 0; i < ARRAY_SIZE(downlink_cmds); i++) {
+		if (downlink_cmds[i].port == port && downlink_cmds[i].opcode == opcode) {
+			return &downlink_cmds[i];
+		}
+	}
+	return NULL;
+}
+
+static bool downlink_port_handled(uint8_t port)
+{
+	for (int i = 0; i < ARRAY_SIZE(downlink_cmds); i++) {
+		if (downlink_cmds[i].port == port) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void downlink_dispatch(const struct downlink_frame *frame)
+{
+	const struct downlink_cmd *cmd;
+	uint8_t pos = 0;
+	uint32_t latency_us;
+	int ret;
+
+	while (pos < frame->len) {
+		cmd = downlink_find(frame->port, frame->data[pos]);
+		if (cmd == NULL) {
+			LOG_WRN("Port %d: unknown opcode 0x%02X", frame->port, frame->data[pos]);
+			stats.rejected++;
+			break;
+		}
+		if (pos + 1 + cmd->len > frame->len) {
+			LOG_WRN("Port %d: %s truncated", frame->port, cmd->name);
+			stats.rejected++;
+			break;
+		}
+
+		ret = cmd->handler(&frame->data[pos + 1]);
+		if (ret < 0) {
+			LOG_WRN("Port %d: %s rejected (%d)", frame->port, cmd->name, ret);
+			stats.rejected++;
+			break;
+		}
+
+		LOG_INF("Port %d: applied %s", frame->port, cmd->name);
+		stats.commands++;
+		pos += 1 + cmd->len;
+	}
+
+	latency_us = k_cyc_to_us_floor32(k_cycle_get_32() - frame->timestamp);
+	stats.latency_last_us = latency_us;
+	stats.latency_max_us = MAX(stats.latency_max_us, latency_us);
+}
+
+static void downlink_work_handler(struct k_work *work)
+{
+	struct downlink_frame frame;
+
+	while (k_msgq_get(&downlink_msgq, &frame, K_NO_WAIT) == 0) {
+		downlink_dispatch(&frame);
+	}
+}
+
+static K_WORK_DEFINE(downlink_work, downlink_work_handler);
+
+void downlink_init(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+void downlink_callback(uint8_t port, bool data_pending, int16_t rssi, int8_t snr, uint8_t len, const uint8_t *data)
+{
+	struct downlink_frame frame;
+
+	LOG_INF("Port %d, Pending %d, RSSI %ddB, SNR %ddBm", port, data_pending, rssi, snr);
+	if (data) {
+		LOG_HEXDUMP_INF(data, len, "Payload: ");
+	}
+
+	if (data == NULL || len == 0 || !downlink_port_handled(port)) {
+		return;
+	}
+
+	stats.received++;
+	if (len > DOWNLINK_MAX_LEN) {
+		stats.oversize++;
+		return;
+	}
+
+	frame.timestamp = k_cycle_get_32();
+	frame.port = port;
+	frame.len = len;
+	memcpy(frame.data, data, len);
+
+	if (k_msgq_put(&downlink_msgq, &frame, K_NO_WAIT) != 0) {
+		stats.overflows++;
+		return;
+	}
+	k_work_submit_to_queue(&app_workq, &downlink_work);
+}
+
+const struct downlink_stats *downlink_get_stats(void)
+{
+	return &stats;
+}
+
+bool downlink_diagnostics_requested(void)
+{
+	return atomic_get(&diagnostics_requested) != 0;
+}
+
+void downlink_diagnostics_sent(void)
+{
+	// Only cleared once sent, so a failed send is retried after the next uplink.
+	atomic_set(&diagnostics_requested, 0);
+}
+
+int downlink_encode_diagnostics(uint8_t *buf, uint8_t max_len)
+{
+	const struct app_config *cfg = config_get();
+
+	/*
+	 * Diagnostics frame (DOWNLINK_DIAG_PORT), little endian:
+	 *   u32 uptime (s), u16 report period, u8 confirmed ratio, u8 DR min, u8 DR max,
+	 *   u16 downlinks received, u16 commands applied, u16 rejected,
+	 *   u16 queue overflows, u16 oversize, u32 max dispatch latency (us)
+	 */
+	if (max_len < 23) {
+		return -ENOSPC;
+	}
+
+	sys_put_le32(k_uptime_get() / MSEC_PER_SEC, &buf[0]);
+	sys_put_le16(cfg->report_period, &buf[4]);
+	buf[6] = cfg->confirmed_ratio;
+	buf[7] = cfg->dr_min;
+	buf[8] = cfg->dr_max;
+	sys_put_le16(MIN(stats.received, UINT16_MAX), &buf[9]);
+	sys_put_le16(MIN(stats.commands, UINT16_MAX), &buf[11]);
+	sys_put_le16(MIN(stats.rejected, UINT16_MAX), &buf[13]);
+	sys_put_le16(MIN(stats.overflows, UINT16_MAX), &buf[15]);
+	sys_put_le16(MIN(stats.oversize, UINT16_MAX), &buf[17]);
+	sys_put_le32(stats.latency_max_us, &buf[19]);
+	return 23;
+}
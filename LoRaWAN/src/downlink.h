@@ -0,0 +1,55 @@
+
+/*
+ * Downlink command dispatcher
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Command frames on DOWNLINK_CMD_PORT hold one or more commands, each an
+ * opcode followed by its arguments (multi-byte values little endian):
+ *
+ *   0x01 Set report period     u16 seconds (60 - 65535)
+ *   0x02 Set deadband          u16 temperature (0.01 degC), u16 humidity (0.1 %RH)
+ *   0x03 Set confirmed ratio   u8 every Nth uplink confirmed, 0 for never
+ *   0x04 Set DR limits         u8 minimum DR, u8 maximum DR
+ *   0x05 Reboot                u8 must be DOWNLINK_REBOOT_MAGIC
+ *   0x06 Request diagnostics   (no arguments)
+ *
+ * Processing stops at the first unknown or invalid command.
+ */
+
+#define DOWNLINK_CMD_PORT           10
+#define DOWNLINK_DIAG_PORT          4
+
+#define DOWNLINK_MAX_LEN            32
+#define DOWNLINK_QUEUE_DEPTH        4
+
+#define DOWNLINK_OP_REPORT_PERIOD   0x01
+#define DOWNLINK_OP_DEADBAND        0x02
+#define DOWNLINK_OP_CONFIRMED       0x03
+#define DOWNLINK_OP_DR_LIMITS       0x04
+#define DOWNLINK_OP_REBOOT          0x05
+#define DOWNLINK_OP_DIAGNOSTICS     0x06
+
+#define DOWNLINK_REBOOT_MAGIC       0xB0
+#define DOWNLINK_REBOOT_DELAY       K_SECONDS(5)
+
+struct downlink_stats {
+	uint32_t received;
+	uint32_t overflows;         // Queue full, frame dropped
+	uint32_t oversize;          // Frame larger than DOWNLINK_MAX_LEN
+	uint32_t commands;
+	uint32_t rejected;          // Unknown opcode or failed validation
+	uint32_t latency_last_us;   // Callback to command applied
+	uint32_t latency_max_us;
+};
+
+void downlink_init(void);
+void downlink_callback(uint8_t port, bool data_pending, int16_t rssi, int8_t snr, uint8_t len, const uint8_t *data);
+const struct downlink_stats *downlink_get_stats(void);
+bool downlink_diagnostics_requested(void);
+void downlink_diagnostics_sent(void);
+int downlink_encode_diagnostics(uint8_t *buf, uint8_t max_len);
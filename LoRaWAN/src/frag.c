@@ -0,0 +1,192 @@
+
+/*
+ * Fragmented bulk data uplink transport
+ *
+ * Splits a buffer larger than one frame into fragments sized from the current
+ * maximum payload, adds XOR parity fragments so the server can recover lost
+ * fragments without a retransmission, and paces the fragments so the average
+ * transmit time stays within the duty cycle budget. Pacing takes minutes at
+ * SF12, so each fragment is sent by a delayable work item that reschedules
+ * itself, leaving the work queue free for other work in between.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <zephyr/fs/nvs.h>
+
+#include "airtime.h"
+#include "config.h"
+#include "frag.h"
+#include "workq.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(frag);
+
+static uint8_t session;
+
+// Transfer in progress. Each run of frag_work sends one fragment, then
+// reschedules itself once the duty cycle allows the next.
+static struct {
+	bool active;
+	uint8_t port;
+	const uint8_t *data;
+	uint8_t frag_len;
+	uint8_t last_len;
+	uint8_t count;
+	uint8_t next;               // Next data fragment
+	bool parity_due;            // Parity fragment of the group just closed goes first
+	uint8_t retries;
+	frag_done_cb_t done;
+	uint8_t frame[FRAG_MAX_PAYLOAD];
+	uint8_t frame_len;          // 0 until the next fragment is built
+	uint8_t parity[FRAG_MAX_PAYLOAD];
+} tx;
+
+static void frag_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(frag_work, frag_work_handler);
+
+static void frag_build_next(void)
+{
+	uint8_t this_len;
+	size_t offset;
+
+	if (tx.parity_due) {
+		tx.frame[0] = FRAG_TYPE_PARITY | session;
+		tx.frame[1] = (tx.next - 1) / FRAG_PARITY_GROUP;
+		tx.frame[2] = tx.count;
+		tx.frame[3] = tx.last_len;
+		memcpy(&tx.frame[FRAG_HDR_LEN], tx.parity, tx.frag_len);
+		tx.frame_len = FRAG_HDR_LEN + tx.frag_len;
+		memset(tx.parity, 0, sizeof(tx.parity));
+		tx.parity_due = false;
+		return;
+	}
+
+	this_len = (tx.next == tx.count - 1) ? tx.last_len : tx.frag_len;
+	offset = (size_t)tx.next * tx.frag_len;
+	tx.frame[0] = FRAG_TYPE_DATA | session;
+	tx.frame[1] = tx.next;
+	tx.frame[2] = tx.count;
+	tx.frame[3] = tx.last_len;
+	memcpy(&tx.frame[FRAG_HDR_LEN], &tx.data[offset], this_len);
+	tx.frame_len = FRAG_HDR_LEN + this_len;
+
+	if (FRAG_PARITY_GROUP != 0) {
+		for (int j = 0; j < this_len; j++)
+			tx.parity[j] ^= tx.data[offset + j];
+
+		// Close the group after its last data fragment.
+		if ((tx.next % FRAG_PARITY_GROUP) == FRAG_PARITY_GROUP - 1 || tx.next == tx.count - 1) {
+			tx.parity_due = true;
+		}
+	}
+	tx.next++;
+}
+
+static void frag_finish(int result)
+{
+	frag_done_cb_t done = tx.done;
+
+	tx.active = false;
+	if (done) {
+		done(result);
+	}
+}
+
+static void frag_work_handler(struct k_work *work)
+{
+	uint8_t max_next, max_size;
+	uint32_t airtime;
+	int ret;
+
+	if (tx.frame_len == 0) {
+		frag_build_next();
+		tx.retries = FRAG_RETRIES;
+	}
+
+	// If the datarate has dropped (ADR or a link check) since the fragment
+	// size was chosen, lorawan_send() would send an empty frame and return
+	// -EAGAIN on every retry. The receiver needs equal sized fragments, so
+	// end the transfer and let the caller send it again from the start.
+	lorawan_get_payload_sizes(&max_next, &max_size);
+	if (tx.frame_len > max_size) {
+		LOG_ERR("Fragment of %d bytes no longer fits the %d byte payload, abandoning session %d",
+			tx.frame_len, max_size, session);
+		frag_finish(-EMSGSIZE);
+		return;
+	}
+
+	ret = lorawan_send(tx.port, tx.frame, tx.frame_len, LORAWAN_MSG_UNCONFIRMED);
+	if (ret == -EAGAIN && --tx.retries > 0) {
+		// Stack is busy (e.g. duty cycle restricted), or pending MAC commands
+		// left no room (max_next) and were flushed in an empty frame. Try again shortly.
+		k_work_reschedule_for_queue(&app_workq, &frag_work, FRAG_RETRY_DELAY);
+		return;
+	}
+	if (ret < 0) {
+		LOG_ERR("%s fragment %d of %d failed: %d",
+			(tx.frame[0] & FRAG_TYPE_MASK) == FRAG_TYPE_PARITY ? "Parity" : "Data",
+			tx.frame[1], tx.count, ret);
+		frag_finish(ret);
+		return;
+	}
+
+	airtime = airtime_dr_us(config_get_datarate(), tx.frame_len);
+	tx.frame_len = 0;
+	if (tx.next == tx.count && !tx.parity_due) {
+		LOG_INF("Session %d sent", session);
+		frag_finish(0);
+		return;
+	}
+
+	// Stay off air long enough to keep within the duty cycle budget.
+	k_work_reschedule_for_queue(&app_workq, &frag_work,
+		K_USEC((uint64_t)airtime * (100 - FRAG_DUTY_CYCLE_PERCENT) / FRAG_DUTY_CYCLE_PERCENT));
+}
+
+int frag_send(uint8_t port, const uint8_t *data, size_t len, frag_done_cb_t done)
+{
+	uint8_t unused, max_size, frag_len;
+
+	if (tx.active) {
+		return -EBUSY;
+	}
+
+	lorawan_get_payload_sizes(&unused, &max_size);
+	if (max_size <= FRAG_HDR_LEN) {
+		return -EMSGSIZE;
+	}
+
+	frag_len = MIN(max_size, FRAG_MAX_PAYLOAD) - FRAG_HDR_LEN;
+	if (len == 0 || len > (size_t)frag_len * FRAG_MAX_FRAGMENTS) {
+		return -EMSGSIZE;
+	}
+
+	session = (session + 1) & FRAG_SESSION_MASK;
+	memset(&tx, 0, sizeof(tx));
+	tx.active = true;
+	tx.port = port;
+	tx.data = data;
+	tx.frag_len = frag_len;
+	tx.count = DIV_ROUND_UP(len, frag_len);
+	tx.last_len = len - (size_t)(tx.count - 1) * frag_len;
+	tx.done = done;
+
+	LOG_INF("Sending %d bytes as %d fragments of %d bytes, session %d", len, tx.count, frag_len, session);
+
+	k_work_reschedule_for_queue(&app_workq, &frag_work, K_NO_WAIT);
+	return 0;
+}
+
+bool frag_busy(void)
+{
+	return tx.active;
+}
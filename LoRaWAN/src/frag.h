@@ -0,0 +1,54 @@
+
+/*
+ * Fragmented bulk data uplink transport
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Every fragment starts with a 4 byte header:
+ *
+ *   [0]     Bits 6-7: FRAG_TYPE_DATA or FRAG_TYPE_PARITY, bits 0-5: session
+ *   [1]     Data fragment index, or parity group index
+ *   [2]     Number of data fragments in the transfer
+ *   [3]     Length of the last data fragment
+ *
+ * All data fragments other than the last have the same length, which is also
+ * the length of every parity fragment. Parity fragment g is the XOR of data
+ * fragments g * FRAG_PARITY_GROUP to g * FRAG_PARITY_GROUP + FRAG_PARITY_GROUP - 1
+ * (zero padded), so one lost fragment per group can be rebuilt by the receiver.
+ *
+ * The header format is shared with the host reassembler in tools/.
+ */
+
+#define FRAG_HDR_LEN            4
+#define FRAG_TYPE_DATA          0x00
+#define FRAG_TYPE_PARITY        0x40
+#define FRAG_TYPE_MASK          0xC0
+#define FRAG_SESSION_MASK       0x3F
+
+#define FRAG_MAX_FRAGMENTS      255
+#define FRAG_MAX_PAYLOAD        242
+
+// Data fragments per parity fragment, 0 to disable parity
+#define FRAG_PARITY_GROUP       4
+
+// Duty cycle budget for pacing fragments
+#define FRAG_DUTY_CYCLE_PERCENT 1
+
+// Attempts per fragment while the stack reports busy, and the delay between them
+#define FRAG_RETRIES            30
+#define FRAG_RETRY_DELAY        K_SECONDS(1)
+
+// Called from the work queue when a transfer ends, 0 or a negative error
+typedef void (*frag_done_cb_t)(int result);
+
+/*
+ * Starts sending len bytes and returns straight away. The data is read as
+ * each fragment is sent, so it must stay unchanged until done is called.
+ * Returns -EBUSY while a previous transfer is still in progress.
+ */
+int frag_send(uint8_t port, const uint8_t *data, size_t len, frag_done_cb_t done);
+bool frag_busy(void);
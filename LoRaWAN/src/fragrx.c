@@ -0,0 +1,303 @@
+
+/*
+ * Fragmented data block receive (LoRaWAN Fragmented Data Block Transport)
+ *
+ * Receives data blocks (configuration tables, images) pushed by the network
+ * to this device, typically in Class C. Fragments are handled straight from
+ * the downlink callback by fragrx_session.c, which gathers them into a small
+ * pool of block buffers. As soon as every fragment of a block has arrived,
+ * the block is written to flash from the work queue and its buffer returned
+ * to the pool, so the data is never held whole in RAM.
+ *
+ * Every command in a downlink is handled, and their answers are sent
+ * together in one uplink. Only uncoded fragments are handled; coded (FEC)
+ * fragments are counted and ignored, so any lost fragment has to be sent
+ * again by the server. Sessions fed by a multicast group are refused until
+ * the Remote Multicast Setup package (McGroupSetup) is supported.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+
+#include "fragrx.h"
+#include "workq.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(fragrx);
+
+#if FIXED_PARTITION_EXISTS(FRAGRX_PARTITION)
+
+// Session state and buffers are shared by the downlink callback and the work queue.
+static struct k_spinlock lock;
+static const struct flash_area *fa;
+
+static struct k_work_delayable timeout_work;
+
+// Frames with other commands need flash erase and an uplink, so are handled
+// from the work queue.
+static uint8_t cmd_buf[UINT8_MAX];
+static uint8_t cmd_len;
+static uint8_t answer[FRAGRX_ANSWER_MAX];
+
+static void fragrx_send_answer(const uint8_t *data, uint8_t len)
+{
+	int ret;
+
+	ret = lorawan_send(FRAGRX_PORT, (uint8_t *)data, len, LORAWAN_MSG_UNCONFIRMED);
+	if (ret < 0) {
+		LOG_ERR("Answer send failed: %d", ret);
+	}
+}
+
+static void fragrx_timeout_work_handler(struct k_work *work)
+{
+	const struct fragrx_session *session = fragrx_session_get();
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint8_t freed = fragrx_session_timeout(k_uptime_get());
+
+	k_spin_unlock(&lock, key);
+
+	if (freed) {
+		LOG_WRN("Session %d timed out, %u of %u fragments, freed %d buffers",
+			session->index, session->received, session->nb_frag, freed);
+	}
+}
+
+static uint8_t fragrx_setup(const uint8_t *req, uint8_t *ans)
+{
+	struct fragrx_session setup;
+	struct flash_pages_info info;
+	k_spinlock_key_t key;
+	int ret;
+
+	ans[0] = FRAGRX_CMD_SESSION_SETUP;
+	ans[1] = fragrx_session_check(req, fa->fa_size, &setup);
+	if (ans[1] & (FRAGRX_STATUS_ENCODING | FRAGRX_STATUS_MEMORY | FRAGRX_STATUS_INDEX)) {
+		LOG_WRN("Rejecting session: %d fragments of %d bytes, groups 0x%X, status 0x%02X",
+			setup.nb_frag, setup.frag_size, req[0] & 0x0F, ans[1]);
+		return FRAGRX_SETUP_ANS_LEN;
+	}
+
+	// Erase up front so blocks can be written as soon as they complete.
+	ret = flash_get_page_info_by_offs(flash_area_get_device(fa), fa->fa_off, &info);
+	if (ret == 0) {
+		ret = flash_area_erase(fa, 0, MIN(ROUND_UP(setup.size, info.size), fa->fa_size));
+	}
+	if (ret < 0) {
+		LOG_ERR("Flash erase failed: %d", ret);
+		ans[1] |= FRAGRX_STATUS_MEMORY;
+		return FRAGRX_SETUP_ANS_LEN;
+	}
+
+	// Blocks of a previous session still waiting to be written are dropped.
+	key = k_spin_lock(&lock);
+	fragrx_session_start(&setup, k_uptime_get());
+	k_spin_unlock(&lock, key);
+	k_work_reschedule_for_queue(&app_workq, &timeout_work, K_MSEC(FRAGRX_SESSION_TIMEOUT_MS));
+
+	LOG_INF("Session %d: %d fragments of %d bytes (%u bytes), %d per block, descriptor 0x%08X",
+		setup.index, setup.nb_frag, setup.frag_size, setup.size, setup.frags_per_block,
+		setup.descriptor);
+	return FRAGRX_SETUP_ANS_LEN;
+}
+
+static void fragrx_write_work_handler(struct k_work *work)
+{
+	struct fragrx_write write;
+	k_spinlock_key_t key;
+	bool complete = false;
+	bool more;
+	int ret;
+
+	key = k_spin_lock(&lock);
+	more = fragrx_session_next_write(&write);
+	k_spin_unlock(&lock, key);
+
+	while (more) {
+		// The buffer is ours until it is handed back.
+		ret = flash_area_write(fa, write.offset, write.buf, ROUND_UP(write.len, FRAGRX_WRITE_ALIGN));
+		if (ret < 0) {
+			LOG_ERR("Block %d write failed: %d", write.number, ret);
+		}
+
+		key = k_spin_lock(&lock);
+		complete |= fragrx_session_written(&write, ret);
+		more = fragrx_session_next_write(&write);
+		k_spin_unlock(&lock, key);
+	}
+
+	if (complete) {
+		k_work_cancel_delayable(&timeout_work);
+		LOG_INF("Session %d complete, %u bytes written", fragrx_session_get()->index,
+			fragrx_get_stats()->bytes_written);
+		fragrx_print_stats();
+	}
+}
+
+static K_WORK_DEFINE(write_work, fragrx_write_work_handler);
+
+static void fragrx_data_fragment(const uint8_t *data, uint8_t len)
+{
+	enum fragrx_frag_result result;
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&lock);
+	result = fragrx_session_fragment(data, len, k_uptime_get());
+	k_spin_unlock(&lock, key);
+
+	if (result == FRAGRX_FRAG_IGNORED) {
+		return;
+	}
+
+	k_work_reschedule_for_queue(&app_workq, &timeout_work, K_MSEC(FRAGRX_SESSION_TIMEOUT_MS));
+	if (result == FRAGRX_FRAG_BLOCK_DONE) {
+		k_work_submit_to_queue(&app_workq, &write_work);
+	}
+}
+
+static void fragrx_cmd_work_handler(struct k_work *work)
+{
+	const uint8_t *params;
+	k_spinlock_key_t key;
+	uint8_t answer_len = 0;
+	uint8_t freed;
+	int len;
+
+	for (int offset = 0; offset < cmd_len; offset += len) {
+		len = fragrx_command_len(&cmd_buf[offset], cmd_len - offset);
+		if (len < 0) {
+			LOG_WRN("%s command 0x%02X, ignoring the rest of the frame",
+				len == -ENOTSUP ? "Unknown" : "Truncated", cmd_buf[offset]);
+			break;
+		}
+
+		// Status is the longest answer. The server asks again for any dropped.
+		if (answer_len + FRAGRX_STATUS_ANS_LEN > sizeof(answer)) {
+			LOG_WRN("Too many commands in one frame, ignoring the rest");
+			break;
+		}
+
+		params = &cmd_buf[offset + 1];
+		switch (cmd_buf[offset]) {
+		case FRAGRX_CMD_PACKAGE_VERSION:
+			answer[answer_len++] = FRAGRX_CMD_PACKAGE_VERSION;
+			answer[answer_len++] = FRAGRX_PACKAGE_ID;
+			answer[answer_len++] = FRAGRX_PACKAGE_VERSION;
+			break;
+
+		case FRAGRX_CMD_SESSION_STATUS:
+			key = k_spin_lock(&lock);
+			answer_len += fragrx_session_status(params, &answer[answer_len]);
+			k_spin_unlock(&lock, key);
+			break;
+
+		case FRAGRX_CMD_SESSION_SETUP:
+			answer_len += fragrx_setup(params, &answer[answer_len]);
+			break;
+
+		case FRAGRX_CMD_SESSION_DELETE:
+			key = k_spin_lock(&lock);
+			answer_len += fragrx_session_delete(params, &answer[answer_len], &freed);
+			k_spin_unlock(&lock, key);
+			LOG_INF("Session %d delete, status 0x%02X, freed %d buffers",
+				params[0] & 0x03, answer[answer_len - 1], freed);
+			break;
+
+		case FRAGRX_CMD_DATA_FRAGMENT:
+			fragrx_data_fragment(params, len - 1);
+			break;
+		}
+	}
+
+	cmd_len = 0;
+	if (answer_len) {
+		fragrx_send_answer(answer, answer_len);
+	}
+}
+
+static K_WORK_DEFINE(cmd_work, fragrx_cmd_work_handler);
+
+static void fragrx_callback(uint8_t port, bool data_pending, int16_t rssi, int8_t snr, uint8_t len, const uint8_t *data)
+{
+	if (data == NULL || len == 0) {
+		return;
+	}
+
+	// A DataFragment takes the rest of the frame, so one on its own is
+	// handled here without waiting for the work queue.
+	if (data[0] == FRAGRX_CMD_DATA_FRAGMENT) {
+		fragrx_data_fragment(&data[1], len - 1);
+		return;
+	}
+
+	if (cmd_len != 0) {
+		LOG_WRN("Previous commands still being handled, dropping %d bytes", len);
+		return;
+	}
+	memcpy(cmd_buf, data, len);
+	cmd_len = len;
+	k_work_submit_to_queue(&app_workq, &cmd_work);
+}
+
+static struct lorawan_downlink_cb fragrx_downlink_cb = {
+	.port = FRAGRX_PORT,
+	.cb = fragrx_callback
+};
+
+int fragrx_init(void)
+{
+	int ret;
+
+	if (fa != NULL) {
+		return 0;
+	}
+
+	ret = flash_area_open(FIXED_PARTITION_ID(FRAGRX_PARTITION), &fa);
+	if (ret < 0) {
+		LOG_ERR("Unable to open flash partition: %d", ret);
+		return ret;
+	}
+
+	k_work_init_delayable(&timeout_work, fragrx_timeout_work_handler);
+	lorawan_register_downlink_callback(&fragrx_downlink_cb);
+	LOG_INF("Block receive ready, %d bytes of buffers, %d byte partition",
+		FRAGRX_BLOCK_SIZE * FRAGRX_BLOCK_COUNT, fa->fa_size);
+	return 0;
+}
+
+void fragrx_print_stats(void)
+{
+	const struct fragrx_stats *stats = fragrx_get_stats();
+	int64_t elapsed = stats->last_fragment - stats->first_fragment;
+
+	LOG_INF("Fragments %u, duplicates %u, dropped %u, evicted %u, coded %u, blocks %u (%u bytes), errors %u",
+		stats->fragments, stats->duplicates, stats->dropped, stats->evicted, stats->coded,
+		stats->blocks_written, stats->bytes_written, stats->write_errors);
+	LOG_INF("Throughput %lld bytes/s, peak buffers %d of %d (%d bytes)",
+		elapsed > 0 ? ((int64_t)stats->bytes_written * MSEC_PER_SEC) / elapsed : 0,
+		stats->blocks_in_use_max, FRAGRX_BLOCK_COUNT, stats->blocks_in_use_max * FRAGRX_BLOCK_SIZE);
+}
+
+#else
+
+int fragrx_init(void)
+{
+	LOG_WRN("No flash partition for block receive");
+	return -ENODEV;
+}
+
+void fragrx_print_stats(void)
+{
+}
+
+#endif
@@ -0,0 +1,20 @@
+
+/*
+ * Fragmented data block receive (LoRaWAN Fragmented Data Block Transport)
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "fragrx_session.h"
+
+#define FRAGRX_PORT                 201
+
+#define FRAGRX_PARTITION            slot1_partition
+
+// Answers to the commands of one downlink, sent together
+#define FRAGRX_ANSWER_MAX           16
+
+int fragrx_init(void);
+void fragrx_print_stats(void);
@@ -0,0 +1,426 @@
+/*
+ * Fragmented data block receive, session and reassembly state
+ *
+ * Fragments are copied into a small pool of block buffers, tracked with a
+ * bitmap so they can arrive out of order. A block whose fragments have all
+ * arrived is handed to fragrx.c to write to flash, then its buffer returns
+ * to the pool. When every buffer holds an incomplete block, the least
+ * recently used one is discarded, and its fragments are collected again
+ * when the server repeats them.
+ *
+ * Nothing here locks; fragrx.c holds its spinlock around each call. This
+ * file has no Zephyr dependencies, so host tools can build it too.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fragrx_session.h"
+
+#define FRAGRX_BIT(n)           (1UL << (n))
+#define FRAGRX_MIN(a, b)        (((a) < (b)) ? (a) : (b))
+#define FRAGRX_MAX(a, b)        (((a) > (b)) ? (a) : (b))
+
+enum fragrx_block_state {
+	FRAGRX_BLOCK_FREE,
+	FRAGRX_BLOCK_OPEN,          // Collecting fragments
+	FRAGRX_BLOCK_FULL,          // Waiting to be written
+	FRAGRX_BLOCK_WRITING,
+};
+
+struct fragrx_block {
+	uint8_t state;
+	uint16_t number;
+	uint16_t len;               // Data bytes in this block
+	uint32_t pending;           // Bit set for each fragment still to arrive
+	uint32_t used;              // Value of stats.fragments when last added to
+};
+
+static struct fragrx_session session;
+static struct fragrx_stats stats;
+static struct fragrx_block blocks[FRAGRX_BLOCK_COUNT];
+static _Alignas(8) uint8_t block_buf[FRAGRX_BLOCK_COUNT][FRAGRX_BLOCK_SIZE];
+static uint32_t received_map[(FRAGRX_MAX_FRAGS + 31) / 32];
+
+static uint16_t fragrx_get_le16(const uint8_t *src)
+{
+	return src[0] | (src[1] << 8);
+}
+
+static void fragrx_put_le16(uint16_t val, uint8_t *dst)
+{
+	dst[0] = val & 0xFF;
+	dst[1] = val >> 8;
+}
+
+static bool fragrx_received(uint16_t frag)
+{
+	return (received_map[frag / 32] & FRAGRX_BIT(frag % 32)) != 0;
+}
+
+/*
+ * Length of the command at data, including the command byte. A
+ * DataFragment takes the rest of the frame. Returns -EINVAL if the
+ * command is truncated, or -ENOTSUP if it isn't known (so the rest of the
+ * frame can't be parsed).
+ */
+int fragrx_command_len(const uint8_t *data, uint8_t len)
+{
+	int need;
+
+	if (len == 0) {
+		return -EINVAL;
+	}
+
+	switch (data[0]) {
+	case FRAGRX_CMD_PACKAGE_VERSION:
+		need = 1;
+		break;
+	case FRAGRX_CMD_SESSION_STATUS:
+		need = 1 + FRAGRX_STATUS_REQ_LEN;
+		break;
+	case FRAGRX_CMD_SESSION_SETUP:
+		need = 1 + FRAGRX_SETUP_REQ_LEN;
+		break;
+	case FRAGRX_CMD_SESSION_DELETE:
+		need = 1 + FRAGRX_DELETE_REQ_LEN;
+		break;
+	case FRAGRX_CMD_DATA_FRAGMENT:
+		return len >= 1 + 2 ? len : -EINVAL;
+	default:
+		return -ENOTSUP;
+	}
+
+	return len >= need ? need : -EINVAL;
+}
+
+// Discard an incomplete block, so its fragments are accepted again.
+static void fragrx_drop_block(struct fragrx_block *block)
+{
+	uint16_t first = block->number * session.frags_per_block;
+
+	for (int i = 0; i < session.frags_per_block; i++) {
+		if (first + i < session.nb_frag && !(block->pending & FRAGRX_BIT(i))) {
+			received_map[(first + i) / 32] &= ~FRAGRX_BIT((first + i) % 32);
+			session.received--;
+		}
+	}
+	block->state = FRAGRX_BLOCK_FREE;
+}
+
+// Free every buffer not being written. Returns the number freed.
+static uint8_t fragrx_free_blocks(void)
+{
+	uint8_t freed = 0;
+
+	for (int i = 0; i < FRAGRX_BLOCK_COUNT; i++) {
+		if (blocks[i].state == FRAGRX_BLOCK_OPEN) {
+			fragrx_drop_block(&blocks[i]);
+			freed++;
+		} else if (blocks[i].state == FRAGRX_BLOCK_FULL) {
+			blocks[i].state = FRAGRX_BLOCK_FREE;
+			freed++;
+		}
+	}
+	return freed;
+}
+
+/*
+ * Parses a FragSessionSetupReq (parameters only) into setup. Returns the
+ * FragSessionSetupAns status byte, with FragIndex in bits 6-7. Sessions
+ * fed by a multicast group are refused, as there is no McGroupSetup to
+ * define the groups; the answer has no bit for that, so they are refused
+ * as an unsupported session (FRAGRX_STATUS_INDEX).
+ */
+uint8_t fragrx_session_check(const uint8_t *req, uint32_t partition_size, struct fragrx_session *setup)
+{
+	uint8_t mc_groups = req[0] & 0x0F;
+	uint8_t frag_algo = (req[4] >> 3) & 0x07;
+	uint8_t status;
+
+	memset(setup, 0, sizeof(*setup));
+	setup->index = (req[0] >> 4) & 0x03;
+	setup->nb_frag = fragrx_get_le16(&req[1]);
+	setup->frag_size = req[3];
+	setup->padding = req[5];
+	setup->descriptor = req[6] | (req[7] << 8) | (req[8] << 16) | ((uint32_t)req[9] << 24);
+
+	status = setup->index << 6;
+
+	if (frag_algo != 0) {
+		status |= FRAGRX_STATUS_ENCODING;
+	}
+	if (setup->index != 0 || mc_groups != 0) {
+		status |= FRAGRX_STATUS_INDEX;
+	}
+
+	// Largest number of fragments per block keeping flash writes aligned.
+	if (setup->frag_size != 0) {
+		setup->frags_per_block = FRAGRX_MIN(FRAGRX_BLOCK_SIZE / setup->frag_size,
+						    FRAGRX_FRAGS_PER_BLOCK_MAX);
+	}
+	while (setup->frags_per_block > 0 &&
+	       ((setup->frags_per_block * setup->frag_size) % FRAGRX_WRITE_ALIGN) != 0) {
+		setup->frags_per_block--;
+	}
+
+	setup->size = (uint32_t)setup->nb_frag * setup->frag_size;
+	if (setup->nb_frag == 0 || setup->nb_frag > FRAGRX_MAX_FRAGS || setup->frags_per_block == 0 ||
+	    setup->padding >= setup->frag_size || setup->size > partition_size) {
+		status |= FRAGRX_STATUS_MEMORY;
+	} else {
+		setup->size -= setup->padding;
+	}
+
+	return status;
+}
+
+// Starts a session checked by fragrx_session_check(), replacing any other.
+void fragrx_session_start(const struct fragrx_session *setup, int64_t now)
+{
+	fragrx_free_blocks();
+	memset(blocks, 0, sizeof(blocks));
+	memset(received_map, 0, sizeof(received_map));
+	memset(&stats, 0, sizeof(stats));
+
+	session = *setup;
+	session.defined = true;
+	session.active = true;
+	session.received = 0;
+	session.last_activity = now;
+}
+
+// Find or allocate the buffer for a block.
+static struct fragrx_block *fragrx_open_block(uint16_t number)
+{
+	struct fragrx_block *free_slot = NULL;
+	struct fragrx_block *oldest = NULL;
+	uint16_t first = number * session.frags_per_block;
+	uint8_t frags;
+	uint8_t in_use = 0;
+
+	for (int i = 0; i < FRAGRX_BLOCK_COUNT; i++) {
+		if (blocks[i].state == FRAGRX_BLOCK_FREE) {
+			free_slot = free_slot ? free_slot : &blocks[i];
+		} else if (blocks[i].state != FRAGRX_BLOCK_OPEN) {
+			continue;
+		} else if (blocks[i].number == number) {
+			return &blocks[i];
+		} else if (oldest == NULL || (int32_t)(blocks[i].used - oldest->used) < 0) {
+			oldest = &blocks[i];
+		}
+	}
+
+	// Buffers are shared with completed blocks waiting to be written.
+	if (free_slot == NULL) {
+		if (oldest == NULL) {
+			return NULL;
+		}
+		fragrx_drop_block(oldest);
+		stats.evicted++;
+		free_slot = oldest;
+	}
+
+	// Pad with erased flash value so the tail of the last block writes cleanly.
+	memset(block_buf[free_slot - blocks], 0xFF, FRAGRX_BLOCK_SIZE);
+
+	frags = FRAGRX_MIN(session.frags_per_block, session.nb_frag - first);
+	free_slot->state = FRAGRX_BLOCK_OPEN;
+	free_slot->number = number;
+	free_slot->len = frags * session.frag_size;
+	free_slot->pending = (frags == 32) ? UINT32_MAX : (FRAGRX_BIT(frags) - 1);
+
+	// Padding in the last fragment isn't data, and isn't written.
+	if (first + frags == session.nb_frag) {
+		free_slot->len -= session.padding;
+	}
+
+	for (int i = 0; i < FRAGRX_BLOCK_COUNT; i++)
+		in_use += (blocks[i].state != FRAGRX_BLOCK_FREE) ? 1 : 0;
+	stats.blocks_in_use_max = FRAGRX_MAX(stats.blocks_in_use_max, in_use);
+
+	return free_slot;
+}
+
+/*
+ * Adds a DataFragment (parameters only: IndexAndN then the payload).
+ * On FRAGRX_FRAG_BLOCK_DONE, collect the block with fragrx_session_next_write().
+ */
+enum fragrx_frag_result fragrx_session_fragment(const uint8_t *data, uint8_t len, int64_t now)
+{
+	uint16_t index_and_n, n, frag, offset;
+	struct fragrx_block *block;
+	uint8_t *buf;
+
+	if (len < 2) {
+		return FRAGRX_FRAG_IGNORED;
+	}
+	index_and_n = fragrx_get_le16(data);
+	n = index_and_n & 0x3FFF;
+
+	if (!session.active || (index_and_n >> 14) != session.index ||
+	    len < 2 + session.frag_size || n == 0) {
+		return FRAGRX_FRAG_IGNORED;
+	}
+
+	session.last_activity = now;
+	stats.last_fragment = now;
+	if (stats.fragments++ == 0) {
+		stats.first_fragment = now;
+	}
+
+	if (n > session.nb_frag) {
+		stats.coded++;
+		return FRAGRX_FRAG_CODED;
+	}
+
+	// N counts from 1.
+	frag = n - 1;
+	if (fragrx_received(frag)) {
+		stats.duplicates++;
+		return FRAGRX_FRAG_DUPLICATE;
+	}
+
+	block = fragrx_open_block(frag / session.frags_per_block);
+	if (block == NULL) {
+		// All buffers waiting to be written, the server will have to repeat this one.
+		stats.dropped++;
+		return FRAGRX_FRAG_DROPPED;
+	}
+
+	buf = block_buf[block - blocks];
+	offset = (frag % session.frags_per_block) * session.frag_size;
+	memcpy(&buf[offset], &data[2], FRAGRX_MIN(session.frag_size, block->len - offset));
+	block->pending &= ~FRAGRX_BIT(frag % session.frags_per_block);
+	block->used = stats.fragments;
+	received_map[frag / 32] |= FRAGRX_BIT(frag % 32);
+	session.received++;
+
+	if (block->pending != 0) {
+		return FRAGRX_FRAG_ACCEPTED;
+	}
+	block->state = FRAGRX_BLOCK_FULL;
+	return FRAGRX_FRAG_BLOCK_DONE;
+}
+
+/*
+ * Answers a FragSessionStatusReq (parameter only) into ans. Returns the
+ * answer length, 0 if this device shouldn't answer: the session doesn't
+ * exist, or only devices still missing fragments were asked.
+ */
+uint8_t fragrx_session_status(const uint8_t *req, uint8_t *ans)
+{
+	bool all = req[0] & 0x01;
+	uint8_t index = (req[0] >> 1) & 0x03;
+
+	if (!session.defined || index != session.index ||
+	    (!all && session.received == session.nb_frag)) {
+		return 0;
+	}
+
+	ans[0] = FRAGRX_CMD_SESSION_STATUS;
+	fragrx_put_le16((session.index << 14) | (session.received & 0x3FFF), &ans[1]);
+	ans[3] = FRAGRX_MIN(session.nb_frag - session.received, UINT8_MAX);
+	ans[4] = stats.dropped ? FRAGRX_STATUS_NO_BUFFER : 0;
+	return FRAGRX_STATUS_ANS_LEN;
+}
+
+/*
+ * Answers a FragSessionDeleteReq (parameter only) into ans, deleting the
+ * session if it exists. Returns the answer length, and the number of
+ * buffers freed in freed.
+ */
+uint8_t fragrx_session_delete(const uint8_t *req, uint8_t *ans, uint8_t *freed)
+{
+	uint8_t index = req[0] & 0x03;
+
+	*freed = 0;
+	ans[0] = FRAGRX_CMD_SESSION_DELETE;
+	ans[1] = index;
+
+	if (!session.defined || index != session.index) {
+		ans[1] |= FRAGRX_STATUS_NO_SESSION;
+		return FRAGRX_DELETE_ANS_LEN;
+	}
+
+	*freed = fragrx_free_blocks();
+	session.defined = false;
+	session.active = false;
+	return FRAGRX_DELETE_ANS_LEN;
+}
+
+/*
+ * Abandons the session if nothing has arrived for FRAGRX_SESSION_TIMEOUT_MS.
+ * Returns the number of buffers freed.
+ */
+uint8_t fragrx_session_timeout(int64_t now)
+{
+	if (!session.active || now - session.last_activity < FRAGRX_SESSION_TIMEOUT_MS) {
+		return 0;
+	}
+
+	session.active = false;
+	return fragrx_free_blocks();
+}
+
+// Takes the next completed block to write, false if there are none.
+bool fragrx_session_next_write(struct fragrx_write *write)
+{
+	for (int i = 0; i < FRAGRX_BLOCK_COUNT; i++) {
+		if (blocks[i].state != FRAGRX_BLOCK_FULL) {
+			continue;
+		}
+		blocks[i].state = FRAGRX_BLOCK_WRITING;
+		write->slot = i;
+		write->number = blocks[i].number;
+		write->offset = (uint32_t)blocks[i].number * session.frags_per_block * session.frag_size;
+		write->len = blocks[i].len;
+		write->buf = block_buf[i];
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Returns the buffer of a block taken by fragrx_session_next_write(), with
+ * the result of the flash write. Returns true when this completes the session.
+ */
+bool fragrx_session_written(const struct fragrx_write *write, int result)
+{
+	blocks[write->slot].state = FRAGRX_BLOCK_FREE;
+
+	if (result < 0) {
+		stats.write_errors++;
+	} else {
+		stats.blocks_written++;
+		stats.bytes_written += write->len;
+	}
+
+	if (!session.active || session.received != session.nb_frag) {
+		return false;
+	}
+	for (int i = 0; i < FRAGRX_BLOCK_COUNT; i++) {
+		if (blocks[i].state != FRAGRX_BLOCK_FREE) {
+			return false;
+		}
+	}
+
+	session.active = false;
+	return true;
+}
+
+const struct fragrx_session *fragrx_session_get(void)
+{
+	return &session;
+}
+
+const struct fragrx_stats *fragrx_get_stats(void)
+{
+	return &stats;
+}
@@ -0,0 +1,111 @@
+
+/*
+ * Fragmented data block receive, session and reassembly state
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define FRAGRX_PACKAGE_ID           3
+#define FRAGRX_PACKAGE_VERSION      1
+
+#define FRAGRX_CMD_PACKAGE_VERSION  0x00
+#define FRAGRX_CMD_SESSION_STATUS   0x01
+#define FRAGRX_CMD_SESSION_SETUP    0x02
+#define FRAGRX_CMD_SESSION_DELETE   0x03
+#define FRAGRX_CMD_DATA_FRAGMENT    0x08
+
+// Request parameter lengths, after the command byte
+#define FRAGRX_STATUS_REQ_LEN       1
+#define FRAGRX_SETUP_REQ_LEN        10
+#define FRAGRX_DELETE_REQ_LEN       1
+
+// Answer lengths, including the command byte
+#define FRAGRX_VERSION_ANS_LEN      3
+#define FRAGRX_STATUS_ANS_LEN       5
+#define FRAGRX_SETUP_ANS_LEN        2
+#define FRAGRX_DELETE_ANS_LEN       2
+
+// FragSessionSetupAns status bits
+#define FRAGRX_STATUS_ENCODING      0x01
+#define FRAGRX_STATUS_MEMORY        0x02
+#define FRAGRX_STATUS_INDEX         0x04
+
+// FragSessionStatusAns status bit, fragments lost for want of a buffer
+#define FRAGRX_STATUS_NO_BUFFER     0x01
+
+// FragSessionDeleteAns status bit
+#define FRAGRX_STATUS_NO_SESSION    0x04
+
+// Reassembly buffers, each holds up to 32 consecutive fragments
+#define FRAGRX_BLOCK_SIZE           512
+#define FRAGRX_BLOCK_COUNT          4
+#define FRAGRX_FRAGS_PER_BLOCK_MAX  32
+
+#define FRAGRX_MAX_FRAGS            2048
+
+// Flash writes are a multiple of this (covers STM32WL double word writes)
+#define FRAGRX_WRITE_ALIGN          8
+
+// A session with no fragments for this long is abandoned and its buffers freed
+#define FRAGRX_SESSION_TIMEOUT_MS   (30 * 60 * 1000)
+
+// Results of fragrx_session_fragment()
+enum fragrx_frag_result {
+	FRAGRX_FRAG_IGNORED,        // No session, another index or malformed
+	FRAGRX_FRAG_ACCEPTED,
+	FRAGRX_FRAG_BLOCK_DONE,     // Accepted and completed its block, ready to write
+	FRAGRX_FRAG_DUPLICATE,
+	FRAGRX_FRAG_CODED,
+	FRAGRX_FRAG_DROPPED,
+};
+
+struct fragrx_session {
+	bool defined;               // Set up and not deleted
+	bool active;                // Still collecting fragments
+	uint8_t index;              // FragIndex of the session
+	uint16_t nb_frag;
+	uint8_t frag_size;
+	uint8_t padding;            // Bytes of padding in the last fragment
+	uint8_t frags_per_block;
+	uint32_t descriptor;
+	uint32_t size;              // Data bytes, without padding
+	uint16_t received;
+	int64_t last_activity;      // Uptime (ms) of setup or the last fragment
+};
+
+// A completed block, to be written at offset in the partition
+struct fragrx_write {
+	uint8_t slot;
+	uint16_t number;
+	uint32_t offset;
+	uint16_t len;               // Data bytes, buf is padded with 0xFF to FRAGRX_WRITE_ALIGN
+	const uint8_t *buf;
+};
+
+struct fragrx_stats {
+	uint32_t fragments;
+	uint32_t duplicates;
+	uint32_t dropped;           // No free block buffer
+	uint32_t evicted;           // Incomplete blocks discarded to free a buffer
+	uint32_t coded;             // Coded (FEC) fragments, not supported
+	uint32_t blocks_written;
+	uint32_t bytes_written;
+	uint32_t write_errors;
+	uint8_t blocks_in_use_max;
+	int64_t first_fragment;     // Uptime (ms)
+	int64_t last_fragment;
+};
+
+int fragrx_command_len(const uint8_t *data, uint8_t len);
+uint8_t fragrx_session_check(const uint8_t *req, uint32_t partition_size, struct fragrx_session *setup);
+void fragrx_session_start(const struct fragrx_session *setup, int64_t now);
+enum fragrx_frag_result fragrx_session_fragment(const uint8_t *data, uint8_t len, int64_t now);
+uint8_t fragrx_session_status(const uint8_t *req, uint8_t *ans);
+uint8_t fragrx_session_delete(const uint8_t *req, uint8_t *ans, uint8_t *freed);
+uint8_t fragrx_session_timeout(int64_t now);
+bool fragrx_session_next_write(struct fragrx_write *write);
+bool fragrx_session_written(const struct fragrx_write *write, int result);
+const struct fragrx_session *fragrx_session_get(void);
+const struct fragrx_stats *fragrx_get_stats(void);
@@ -0,0 +1,236 @@
+
+/*
+ * Link health monitoring and confirmed uplink policy
+ *
+ * Unconfirmed uplinks give no indication that anyone is listening. While the
+ * link is healthy, a LinkCheckReq is piggybacked on an uplink every
+ * LINK_CHECK_INTERVAL uplinks, plus confirmed uplinks at the configured ratio.
+ * Each answer or acknowledgement counts as an ack, and each unanswered check
+ * or unacknowledged confirmed uplink counts as a miss. Misses escalate the
+ * policy: check every uplink, then confirm every uplink and step down the
+ * datarate, and finally stop sending and rejoin, leaving readings queued to
+ * be forwarded once the link is back.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <zephyr/fs/nvs.h>
+#include <zephyr/sys/util.h>
+#ifdef CONFIG_SHELL
+#include <zephyr/shell/shell.h>
+#endif
+
+#include "config.h"
+#include "link.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(link);
+
+static const char *const link_state_name[] = { "healthy", "suspect", "degraded", "lost" };
+
+static struct link_stats stats;
+static uint32_t uplinks_since_check;
+static bool check_pending;
+static volatile bool check_answered;
+
+static void link_check_ans_callback(uint8_t demod_margin, uint8_t nb_gateways, int16_t rssi, int8_t snr)
+{
+	// LoRaWAN stack context, evaluated on the next uplink result.
+	stats.last_margin = demod_margin;
+	stats.last_gateways = nb_gateways;
+	check_answered = true;
+}
+
+static void link_set_state(enum link_state state)
+{
+	if (state == stats.state) {
+		return;
+	}
+
+	LOG_INF("Link %s -> %s", link_state_name[stats.state], link_state_name[state]);
+
+	if (stats.state >= LINK_DEGRADED && state < LINK_DEGRADED) {
+		// Recovered, let ADR optimise the datarate again, unless DR limits
+		// are configured, which keep ADR off (the stepped down DR is within them).
+		if (!config_dr_limited()) {
+			lorawan_enable_adr(true);
+		}
+	}
+	stats.state = state;
+}
+
+static void link_escalate_datarate(void)
+{
+	uint8_t dr = config_get_datarate();
+	int ret;
+
+	if (dr <= config_get()->dr_min) {
+		return;
+	}
+
+	// A fixed datarate can only be set with ADR off.
+	lorawan_enable_adr(false);
+	ret = lorawan_set_datarate(dr - 1);
+	if (ret < 0) {
+		LOG_ERR("lorawan_set_datarate failed: %d", ret);
+		return;
+	}
+	stats.dr_escalations++;
+	LOG_INF("Stepped down to DR_%d", dr - 1);
+}
+
+static void link_observe(bool ack)
+{
+	stats.history <<= 1;
+
+	if (ack) {
+		stats.acks++;
+		stats.consecutive_misses = 0;
+		stats.last_ack = k_uptime_get();
+		link_set_state(stats.last_margin < LINK_MARGIN_LOW ? LINK_SUSPECT : LINK_HEALTHY);
+		return;
+	}
+
+	stats.misses++;
+	stats.history |= BIT(0);
+	stats.consecutive_misses = MIN(stats.consecutive_misses + 1, UINT8_MAX);
+
+	if (stats.consecutive_misses >= LINK_MISS_LOST) {
+		link_set_state(LINK_LOST);
+	} else if (stats.consecutive_misses >= LINK_MISS_DEGRADED) {
+		link_set_state(LINK_DEGRADED);
+		link_escalate_datarate();
+	} else {
+		link_set_state(LINK_SUSPECT);
+	}
+}
+
+void link_init(void)
+{
+	memset(&stats, 0, sizeof(stats));
+	lorawan_register_link_check_ans_callback(link_check_ans_callback);
+}
+
+enum lorawan_message_type link_prepare_uplink(void)
+{
+	uint8_t ratio = config_get()->confirmed_ratio;
+	uint32_t interval = (stats.state == LINK_HEALTHY) ? LINK_CHECK_INTERVAL : 1;
+
+	stats.uplinks++;
+	uplinks_since_check++;
+
+	if (stats.state == LINK_DEGRADED || (ratio && (stats.uplinks % ratio) == 0)) {
+		stats.confirmed++;
+		return LORAWAN_MSG_CONFIRMED;
+	}
+
+	if (uplinks_since_check >= interval && lorawan_request_link_check(false) == 0) {
+		check_pending = true;
+		check_answered = false;
+		uplinks_since_check = 0;
+		stats.link_checks++;
+	}
+
+	return LORAWAN_MSG_UNCONFIRMED;
+}
+
+bool link_uplink_result(enum lorawan_message_type type, int ret)
+{
+	bool observed = false;
+	bool acked = false;
+
+	if (ret == -EAGAIN) {
+		// Not sent, so tells us nothing about the link.
+		return false;
+	}
+
+	if (type == LORAWAN_MSG_CONFIRMED) {
+		acked = (ret == 0);
+		link_observe(acked);
+		observed = true;
+	}
+
+	// Link check answers arrive in the receive windows of the same uplink.
+	if (check_pending) {
+		check_pending = false;
+		acked |= (ret == 0 && check_answered);
+		link_observe(ret == 0 && check_answered);
+		observed = true;
+	}
+
+	// Without an ack, only trust an unconfirmed uplink while the link is healthy.
+	return observed ? acked : (ret == 0 && stats.state == LINK_HEALTHY);
+}
+
+bool link_is_lost(void)
+{
+	return stats.state == LINK_LOST;
+}
+
+void link_rejoined(bool success)
+{
+	stats.rejoins++;
+	if (success) {
+		stats.consecutive_misses = 0;
+		uplinks_since_check = 0;
+		link_set_state(LINK_HEALTHY);
+	}
+}
+
+const struct link_stats *link_get_stats(void)
+{
+	return &stats;
+}
+
+void link_print_stats(void)
+{
+	LOG_INF("Link %s: uplinks %u, confirmed %u, checks %u, acks %u, misses %u (last 32: %u), margin %ddB, gateways %d",
+		link_state_name[stats.state], stats.uplinks, stats.confirmed, stats.link_checks,
+		stats.acks, stats.misses, __builtin_popcount(stats.history), stats.last_margin,
+		stats.last_gateways);
+}
+
+#ifdef CONFIG_SHELL
+
+static int cmd_link_stats(const struct shell *sh, size_t argc, char **argv)
+{
+	shell_print(sh, "State:              %s", link_state_name[stats.state]);
+	shell_print(sh, "Uplinks:            %u (%u confirmed)", stats.uplinks, stats.confirmed);
+	shell_print(sh, "Link checks:        %u", stats.link_checks);
+	shell_print(sh, "Acks / misses:      %u / %u", stats.acks, stats.misses);
+	shell_print(sh, "Misses in last 32:  %u", __builtin_popcount(stats.history));
+	shell_print(sh, "Consecutive misses: %u", stats.consecutive_misses);
+	shell_print(sh, "Margin / gateways:  %ddB / %d", stats.last_margin, stats.last_gateways);
+	shell_print(sh, "DR escalations:     %u", stats.dr_escalations);
+	shell_print(sh, "Rejoins:            %u", stats.rejoins);
+	if (stats.last_ack) {
+		shell_print(sh, "Last ack:           %llds ago", (k_uptime_get() - stats.last_ack) / MSEC_PER_SEC);
+	}
+	return 0;
+}
+
+static int cmd_link_check(const struct shell *sh, size_t argc, char **argv)
+{
+	// Force a check on the next uplink.
+	uplinks_since_check = LINK_CHECK_INTERVAL;
+	shell_print(sh, "Link check requested on next uplink");
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(link_cmds,
+	SHELL_CMD(stats, NULL, "Show link statistics", cmd_link_stats),
+	SHELL_CMD(check, NULL, "Request a link check on the next uplink", cmd_link_check),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(link, &link_cmds, "LoRaWAN link health", NULL);
+
+#endif
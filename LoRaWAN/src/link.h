@@ -0,0 +1,52 @@
+
+/*
+ * Link health monitoring and confirmed uplink policy
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Uplinks between link checks while the link is healthy
+#define LINK_CHECK_INTERVAL     12
+
+// Demodulation margin (dB) below which the link is treated as suspect
+#define LINK_MARGIN_LOW         3
+
+// Consecutive missed acknowledgements before each escalation
+#define LINK_MISS_DEGRADED      2
+#define LINK_MISS_LOST          5
+
+// Join attempts each cycle while the link is lost
+#define LINK_REJOIN_ATTEMPTS    3
+
+enum link_state {
+	LINK_HEALTHY,
+	LINK_SUSPECT,           // Single miss or low margin, check every uplink
+	LINK_DEGRADED,          // Confirm every uplink and step down datarate
+	LINK_LOST,              // Stop sending, queue records and rejoin
+};
+
+struct link_stats {
+	enum link_state state;
+	uint32_t uplinks;
+	uint32_t confirmed;
+	uint32_t link_checks;
+	uint32_t acks;          // Confirmed uplinks acknowledged and link checks answered
+	uint32_t misses;
+	uint32_t history;       // Bit set for each miss, most recent in bit 0
+	uint8_t consecutive_misses;
+	uint32_t dr_escalations;
+	uint32_t rejoins;
+	uint8_t last_margin;
+	uint8_t last_gateways;
+	int64_t last_ack;       // Uptime (ms)
+};
+
+void link_init(void);
+enum lorawan_message_type link_prepare_uplink(void);
+bool link_uplink_result(enum lorawan_message_type type, int ret);
+bool link_is_lost(void);
+void link_rejoined(bool success);
+const struct link_stats *link_get_stats(void);
+void link_print_stats(void);
@@ -10,10 +10,10 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <zephyr/device.h>
 #include <zephyr/kernel.h>
 #include <zephyr/lorawan/lorawan.h>
-#include <zephyr/drivers/i2c.h>
 
 #include <zephyr/drivers/flash.h>
 #include <zephyr/storage/flash_map.h>
@@ -21,22 +21,69 @@
 
 #include "nvs.h"
 
-#include "shtc3.h"
 #include "lorawan.h"
-
-#define DELAY K_MINUTES(10)
+#include "schema.h"
+#include "sensors.h"
+#include "aggregate.h"
+#include "clock.h"
+#include "slot.h"
+#include "record.h"
+#include "config.h"
+#include "downlink.h"
+#include "frag.h"
+#include "fragrx.h"
+#include "link.h"
+#include "power.h"
+#include "workq.h"
 
 #define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(main);
 
-static void dl_callback(uint8_t port, bool data_pending, int16_t rssi, int8_t snr, uint8_t len, const uint8_t *data)
-{
-	LOG_INF("Port %d, Pending %d, RSSI %ddB, SNR %ddBm", port, data_pending, rssi, snr);
-	if (data) {
-		LOG_HEXDUMP_INF(data, len, "Payload: ");
-	}
-}
+// Delay before retrying a failed join, or a send refused while the stack is busy
+#define JOIN_RETRY_DELAY        K_MSEC(5000)
+#define SEND_RETRY_DELAY        K_SECONDS(30)
+#define SEND_RETRIES            3
+
+K_THREAD_STACK_DEFINE(app_workq_stack, APP_WORKQ_STACK_SIZE);
+struct k_work_q app_workq;
+
+static struct k_work init_work;
+static struct k_work_delayable join_work;
+static struct k_work_delayable sample_work;
+static struct k_work_delayable report_work;
+static struct k_work encode_work;
+static struct k_work send_work;
+static struct k_work_delayable retry_work;
+
+static struct nvs_fs fs;
+static struct lorawan_join_config join_cfg;
+static int join_attempts;
+static int join_max_attempts;
+static bool joined;
+
+#ifdef LORAWAN_USE_NVS 
+static uint8_t dev_eui[8];
+static uint8_t join_eui[8];
+static uint8_t app_key[16];
+#else
+static uint8_t dev_eui[] = LORAWAN_DEV_EUI;
+static uint8_t join_eui[] = LORAWAN_JOIN_EUI;
+static uint8_t app_key[] = LORAWAN_APP_KEY;
+#endif
+
+static struct agg_summary summary;
+static uint8_t payload[255];
+// Read by the fragmented transport until it has sent every fragment
+static uint8_t diag_payload[255];
+static uint8_t payload_records;
+static int payload_len;
+static int send_retries;
+
+static struct lorawan_downlink_cb downlink_cb = {
+	.port = LW_RECV_PORT_ANY,
+	.cb = downlink_callback
+};
 
 static void lorwan_datarate_changed(enum lorawan_datarate dr)
 {
@@ -44,34 +91,273 @@ static void lorwan_datarate_changed(enum lorawan_datarate dr)
 
 	lorawan_get_payload_sizes(&unused, &max_size);
 	LOG_INF("New Datarate: DR_%d, Max Payload %d", dr, max_size);
+	config_datarate_changed(dr);
 }
 
-int main(void)
+static bool outside_deadband(const struct agg_summary *summary)
 {
-	const struct device *lora_dev;
-	const struct device *i2c_dev;
-	static struct nvs_fs fs;
-	
-	struct lorawan_join_config join_cfg;
-	uint16_t dev_nonce = 0;
-	uint16_t payload[2];
+	static int32_t last_temp, last_humd;
+	static uint8_t skipped = APP_CONFIG_DEADBAND_MAX_SKIP;
+	const struct app_config *cfg = config_get();
+	int32_t temp = summary->stats[SENSOR_FIELD_TEMPERATURE][AGG_MEAN];
+	int32_t humd = summary->stats[SENSOR_FIELD_HUMIDITY][AGG_MEAN];
 
-#ifdef LORAWAN_USE_NVS 
-	uint8_t dev_eui[8];
-	uint8_t join_eui[8];
-	uint8_t app_key[16];
-	
-#else
-	uint8_t dev_eui[] = LORAWAN_DEV_EUI;
-	uint8_t join_eui[] = LORAWAN_JOIN_EUI;
-	uint8_t app_key[] = LORAWAN_APP_KEY;
-#endif
+	// Deadbands are in the same units as the fields, 0.01 degC and 0.1 %RH
+	if (skipped < APP_CONFIG_DEADBAND_MAX_SKIP &&
+	    abs(temp - last_temp) < cfg->temp_deadband &&
+	    abs(humd - last_humd) < cfg->humd_deadband) {
+		skipped++;
+		return false;
+	}
+
+	last_temp = temp;
+	last_humd = humd;
+	skipped = 0;
+	return true;
+}
+
+static void schedule_next_cycle(void)
+{
+	k_work_reschedule_for_queue(&app_workq, &report_work, slot_next_wakeup());
+}
+
+/*
+ * Join using OTAA, making up to max_attempts attempts (0 to keep trying).
+ * The DevNonce is advanced and saved to NVS after each attempt.
+ */
+static void join_start(int max_attempts)
+{
+	join_attempts = 0;
+	join_max_attempts = max_attempts;
+	k_work_reschedule_for_queue(&app_workq, &join_work, K_NO_WAIT);
+}
 
-	
+static void joined_first_time(void)
+{
+	joined = true;
+
+#ifdef LORAWAN_CLASS_C
 	int ret;
+
+	LOG_INF("Setting device to Class C");
+	ret = lorawan_set_class(LORAWAN_CLASS_C);
+	if (ret != 0) {
+		LOG_ERR("Failed to set LoRaWAN class: %d", ret);
+	} else {
+		// Receiving continuously, so the radio is never suspended.
+		power_resume(POWER_DOMAIN_RADIO);
+	}
+#endif
+
+	// Receive data blocks pushed by the network (most useful in Class C).
+	fragrx_init();
+
+	// Request network time so uplinks can be aligned to our slot.
+	clock_init();
+	slot_init(dev_eui, config_get()->report_period);
+
+	agg_reset();
+	k_work_reschedule_for_queue(&app_workq, &sample_work, K_NO_WAIT);
+	schedule_next_cycle();
+}
+
+static void join_work_handler(struct k_work *work)
+{
+	uint16_t dev_nonce = join_cfg.otaa.dev_nonce;
 	ssize_t bytes_written;
+	int ret;
 
-	LOG_INF("Zephyr LoRaWAN Node Example, Board: %s", CONFIG_BOARD);
+	// Counted even when retrying forever, so the log shows how long it has been trying.
+	join_attempts++;
+	if (join_max_attempts) {
+		LOG_INF("Joining network using OTAA, dev nonce %d, attempt %d of %d",
+			join_cfg.otaa.dev_nonce, join_attempts, join_max_attempts);
+	} else {
+		LOG_INF("Joining network using OTAA, dev nonce %d, attempt %d", join_cfg.otaa.dev_nonce, join_attempts);
+	}
+	power_resume(POWER_DOMAIN_RADIO);
+	ret = lorawan_join(&join_cfg);
+	power_suspend(POWER_DOMAIN_RADIO);
+	if (ret < 0) {
+		if (ret == -ETIMEDOUT) {
+			LOG_WRN("Timed-out waiting for response.");
+		} else {
+			LOG_ERR("Join failed (%d)", ret);
+		}
+	} else {
+		LOG_INF("Join successful.");
+	}
+
+	// Increment DevNonce as per LoRaWAN 1.0.4 Spec.
+	dev_nonce++;
+	join_cfg.otaa.dev_nonce = dev_nonce;
+	// Save value away in Non-Volatile Storage.
+	bytes_written = nvs_write(&fs, NVS_DEVNONCE_ID, &dev_nonce, sizeof(dev_nonce));
+	if (bytes_written < 0) {
+		LOG_ERR("NVS: Failed to write id %d (%d)", NVS_DEVNONCE_ID, bytes_written);
+	} else {
+		//LOG_INF("NVS: Wrote %d bytes to id %d",bytes_written, NVS_DEVNONCE_ID);
+	}
+
+	if (ret < 0 && (join_max_attempts == 0 || join_attempts < join_max_attempts)) {
+		// If failed, wait before re-trying.
+		k_work_reschedule_for_queue(&app_workq, &join_work, JOIN_RETRY_DELAY);
+		return;
+	}
+
+	if (!joined) {
+		joined_first_time();
+	} else {
+		// Rejoin after the link was lost, readings stayed queued meanwhile.
+		link_rejoined(ret == 0);
+		schedule_next_cycle();
+	}
+}
+
+static void sample_work_handler(struct k_work *work)
+{
+	int32_t values[SENSOR_FIELD_COUNT];
+	uint32_t valid;
+
+	// Fields that failed to read are left out of the window rather than counted as zero.
+	valid = sensors_acquire(values);
+	if (valid) {
+		agg_add(values, valid);
+	}
+
+	k_work_reschedule_for_queue(&app_workq, &sample_work, AGG_SAMPLE_PERIOD);
+}
+
+static void report_work_handler(struct k_work *work)
+{
+	power_cycle_done();
+
+	// Summarise the window, which ends now. Take a sample if it has none.
+	if (agg_samples() == 0) {
+		sample_work_handler(NULL);
+	}
+
+	if (agg_samples() == 0) {
+		LOG_WRN("No sensor readings this window");
+		if (record_pending() == 0) {
+			schedule_next_cycle();
+			return;
+		}
+	} else {
+		agg_summarise(&summary);
+		agg_reset();
+
+		// Windows within the deadband are dropped, unless a backlog needs sending.
+		if (outside_deadband(&summary)) {
+			record_add(&summary);
+		} else if (record_pending() == 0) {
+			LOG_INF("Temp %.02f RH %.01f within deadband",
+				summary.stats[SENSOR_FIELD_TEMPERATURE][AGG_MEAN] / 100.0,
+				summary.stats[SENSOR_FIELD_HUMIDITY][AGG_MEAN] / 10.0);
+			schedule_next_cycle();
+			return;
+		}
+	}
+
+	// Keep readings queued while the link is down and try to rejoin.
+	if (link_is_lost()) {
+		LOG_WRN("Link lost, %d records queued", record_pending());
+		link_print_stats();
+		join_start(LINK_REJOIN_ATTEMPTS);
+		return;
+	}
+
+	send_retries = 0;
+	k_work_submit_to_queue(&app_workq, &encode_work);
+}
+
+static void encode_work_handler(struct k_work *work)
+{
+	uint8_t unused, max_size;
+
+	// Send as many queued records as fit, oldest first. Encoded at each
+	// attempt, as the base time is relative to transmission.
+	lorawan_get_payload_sizes(&unused, &max_size);
+	payload_len = record_encode(payload, max_size, &payload_records);
+	if (payload_len < 0) {
+		LOG_ERR("Payload of %d bytes too small for a record", max_size);
+		schedule_next_cycle();
+		return;
+	}
+	LOG_INF("Sending Temp %.02f RH %.01f (%d samples, %d of %d records)",
+		summary.stats[SENSOR_FIELD_TEMPERATURE][AGG_MEAN] / 100.0,
+		summary.stats[SENSOR_FIELD_HUMIDITY][AGG_MEAN] / 10.0, summary.samples,
+		payload_records, record_pending());
+
+	k_work_submit_to_queue(&app_workq, &send_work);
+}
+
+static void diagnostics_done(int result)
+{
+	if (result < 0) {
+		LOG_ERR("Diagnostics send failed: %d", result);
+		return;
+	}
+	downlink_diagnostics_sent();
+}
+
+static void send_work_handler(struct k_work *work)
+{
+	enum lorawan_message_type msg_type;
+	bool delivered;
+	int len;
+	int ret;
+
+	msg_type = link_prepare_uplink();
+	ret = lorawan_send(RECORD_PORT, payload, payload_len, msg_type);
+	delivered = link_uplink_result(msg_type, ret);
+	if (ret == -EAGAIN && send_retries++ < SEND_RETRIES) {
+		// Stack is busy (e.g. duty cycle restricted), re-encode and try again.
+		LOG_WRN("lorawan_send busy, retry %d of %d", send_retries, SEND_RETRIES);
+		k_work_reschedule_for_queue(&app_workq, &retry_work, SEND_RETRY_DELAY);
+		return;
+	} else if (ret == -EAGAIN) {
+		LOG_ERR("lorawan_send failed: %d. Continuing...", ret);
+		schedule_next_cycle();
+		return;
+	} else if (ret < 0 && msg_type == LORAWAN_MSG_CONFIRMED) {
+		// Not acknowledged, keep the records for the next attempt.
+		LOG_WRN("Confirmed uplink failed: %d", ret);
+		schedule_next_cycle();
+		return;
+	} else if (ret < 0) {
+		LOG_ERR("lorawan_send failed: %d", ret);
+		schedule_next_cycle();
+		return;
+	}
+
+	// Unless the link is healthy, only drop records the network has acknowledged.
+	if (delivered) {
+		record_consume(payload_records);
+	} else {
+		LOG_WRN("Uplink not acknowledged, keeping %d records", record_pending());
+	}
+
+	if (downlink_diagnostics_requested() && !frag_busy()) {
+		// May not fit a single frame at low datarates, so always fragment.
+		len = downlink_encode_diagnostics(diag_payload, sizeof(diag_payload));
+		if (len > 0) {
+			ret = frag_send(DOWNLINK_DIAG_PORT, diag_payload, len, diagnostics_done);
+			if (ret < 0) {
+				LOG_ERR("Diagnostics send failed: %d", ret);
+			}
+		}
+	}
+
+	LOG_INF("Data sent");
+	schedule_next_cycle();
+}
+
+static void init_work_handler(struct k_work *work)
+{
+	const struct device *lora_dev;
+	uint16_t dev_nonce = 0;
+	int ret;
 
 	nvs_initialise(&fs);
 	nvs_read_init_parameter(&fs, NVS_DEVNONCE_ID, &dev_nonce);
@@ -80,36 +366,36 @@ int main(void)
 	nvs_read_init_parameter(&fs, NVS_LORAWAN_JOIN_EUI_ID, join_eui);
 	nvs_read_init_parameter(&fs, NVS_LORAWAN_APP_KEY_ID, app_key);
 #endif
+	config_init(&fs);
+	downlink_init();
 
-	i2c_dev = DEVICE_DT_GET(DT_ALIAS(sensorbus));
-	if (!i2c_dev) {
-		LOG_ERR("I2C: Device driver not found.");
-		return(-1);
-	} else {
-		//i2c_configure(i2c_dev, I2C_SPEED_SET(I2C_SPEED_STANDARD));
+	// Buses stay suspended except when a sensor read or LoRaWAN activity needs them.
+	power_init();
+
+	ret = sensors_init();
+	if (ret < 0) {
+		return;
 	}
 
 	lora_dev = DEVICE_DT_GET(DT_ALIAS(lora0));
 	if (!device_is_ready(lora_dev)) {
 		LOG_ERR("%s: device not ready.", lora_dev->name);
-		return(-1);
+		return;
 	}
 
 	LOG_INF("Starting LoRaWAN stack.");
+	power_resume(POWER_DOMAIN_RADIO);
 	ret = lorawan_start();
+	power_suspend(POWER_DOMAIN_RADIO);
 	if (ret < 0) {
 		LOG_ERR("lorawan_start failed: %d", ret);
-		return(-1);
+		return;
 	}
 
 	// Enable callbacks
-	struct lorawan_downlink_cb downlink_cb = {
-		.port = LW_RECV_PORT_ANY,
-		.cb = dl_callback
-	};
-
 	lorawan_register_downlink_callback(&downlink_cb);
 	lorawan_register_dr_changed_callback(lorwan_datarate_changed);
+	link_init();
 
 	join_cfg.mode = LORAWAN_ACT_OTAA;
 	join_cfg.dev_eui = dev_eui;
@@ -118,70 +404,31 @@ int main(void)
 	join_cfg.otaa.nwk_key = app_key;
 	join_cfg.otaa.dev_nonce = dev_nonce;
 
-	int i = 1;
-
-	do {
-		LOG_INF("Joining network using OTAA, dev nonce %d, attempt %d", join_cfg.otaa.dev_nonce, i++);
-		ret = lorawan_join(&join_cfg);
-		if (ret < 0) {
-			if ((ret =-ETIMEDOUT)) {
-				LOG_WRN("Timed-out waiting for response.");
-			} else {
-				LOG_ERR("Join failed (%d)", ret);
-			}
-		} else {
-			LOG_INF("Join successful.");
-		}
-
-		// Increment DevNonce as per LoRaWAN 1.0.4 Spec.
-		dev_nonce++;
-		join_cfg.otaa.dev_nonce = dev_nonce;
-		// Save value away in Non-Volatile Storage.
-		bytes_written = nvs_write(&fs, NVS_DEVNONCE_ID, &dev_nonce, sizeof(dev_nonce));
-		if (bytes_written < 0) {
-			LOG_ERR("NVS: Failed to write id %d (%d)", NVS_DEVNONCE_ID, bytes_written);
-		} else {
-			//LOG_INF("NVS: Wrote %d bytes to id %d",bytes_written, NVS_DEVNONCE_ID);
-		}
+	join_start(0);
+}
 
-		if (ret < 0) {
-			// If failed, wait before re-trying.
-			k_sleep(K_MSEC(5000));
-		}
+int main(void)
+{
+	const struct k_work_queue_config cfg = {
+		.name = "app_workq",
+	};
 
-	} while (ret != 0);
+	LOG_INF("Zephyr LoRaWAN Node Example, Board: %s", CONFIG_BOARD);
 
-#ifdef LORAWAN_CLASS_C
-	LOG_INF("Setting device to Class C");
-	ret = lorawan_set_class(LORAWAN_CLASS_C);
-	if (ret != 0) {
-		LOG_ERR("Failed to set LoRaWAN class: %d", ret);
-	}
-#endif
+	k_work_init(&init_work, init_work_handler);
+	k_work_init_delayable(&join_work, join_work_handler);
+	k_work_init_delayable(&sample_work, sample_work_handler);
+	k_work_init_delayable(&report_work, report_work_handler);
+	k_work_init(&encode_work, encode_work_handler);
+	k_work_init(&send_work, send_work_handler);
+	k_work_init_delayable(&retry_work, encode_work_handler);
 
-	while (1) {
+	k_work_queue_start(&app_workq, app_workq_stack, K_THREAD_STACK_SIZEOF(app_workq_stack),
+			   APP_WORKQ_PRIORITY, &cfg);
 
-		shtc3_wakeup(i2c_dev);
-		k_msleep(1);
-		ret = shtc3_GetTempAndHumidity(i2c_dev, &payload[0], &payload[1]);
-		if (ret != SHTC3_NO_ERROR) {
-			payload[0] = 0x0000;
-			payload[1] = 0x0000;
-		}
-		shtc3_sleep(i2c_dev);
-		LOG_INF("Sending Temp %.02f RH %.01f", shtc3_convert_temp(payload[0]), shtc3_convert_humd(payload[1])); 
-	
-		ret = lorawan_send(2, (uint8_t *)&payload, sizeof(payload), LORAWAN_MSG_UNCONFIRMED);
-		if (ret == -EAGAIN) {
-			LOG_ERR("lorawan_send failed: %d. Continuing...", ret);
-			k_sleep(DELAY);
-			continue;
-		} else if (ret < 0) {
-			LOG_ERR("lorawan_send failed: %d", ret);
-			return(-1);
-		}
+	// Everything from here on runs as work items, so the main thread can exit
+	// and its stack be kept small.
+	k_work_submit_to_queue(&app_workq, &init_work);
 
-		LOG_INF("Data sent");
-		k_sleep(DELAY);
-	}
+	return 0;
 }
@@ -13,6 +13,7 @@
 #define NVS_LORAWAN_DEV_EUI_ID      1
 #define NVS_LORAWAN_JOIN_EUI_ID     2
 #define NVS_LORAWAN_APP_KEY_ID      3
+#define NVS_APP_CONFIG_ID           4
 
 void nvs_initialise(struct nvs_fs *fs);
 void nvs_read_init_parameter(struct nvs_fs *fs, uint16_t id, void *data);
@@ -0,0 +1,243 @@
+
+/*
+ * Bit-packed uplink payload encoder and decoder
+ *
+ * Both are expanded from the schema in schema.h, so field widths are fixed
+ * at compile time and the decoder can't drift from the encoder. This file
+ * has no Zephyr dependencies, so host tools can build it too.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "schema.h"
+#include "payload.h"
+
+#define PAYLOAD_X_BASE(id, name, unit, scale, offset, bits, stddev_bits) \
+	{ name, unit, scale, offset, bits, stddev_bits, false },
+#define PAYLOAD_X_EXT(id, name, unit, scale, offset, bits, stddev_bits) \
+	{ name, unit, scale, offset, bits, stddev_bits, true },
+
+const struct payload_field payload_fields[PAYLOAD_FIELD_COUNT] = {
+	SCHEMA_BASE_FIELDS(PAYLOAD_X_BASE)
+	SCHEMA_EXTENDED_FIELDS(PAYLOAD_X_EXT)
+};
+
+static void payload_put_bits(uint8_t *buf, uint16_t pos, uint32_t value, uint8_t bits)
+{
+	for (int i = bits - 1; i >= 0; i--, pos++) {
+		if (value & ((uint32_t)1 << i)) {
+			buf[pos / 8] |= 0x80 >> (pos % 8);
+		} else {
+			buf[pos / 8] &= ~(0x80 >> (pos % 8));
+		}
+	}
+}
+
+static uint32_t payload_get_bits(const uint8_t *buf, uint16_t pos, uint8_t bits)
+{
+	uint32_t value = 0;
+
+	for (int i = 0; i < bits; i++, pos++) {
+		value = (value << 1) | ((buf[pos / 8] >> (7 - pos % 8)) & 1);
+	}
+	return value;
+}
+
+// Saturates below PAYLOAD_INVALID(bits), which marks a field with no reading.
+static uint32_t payload_clamp(int64_t value, uint8_t bits)
+{
+	int64_t max = (int64_t)PAYLOAD_INVALID(bits) - 1;
+
+	return value < 0 ? 0 : (value > max ? max : value);
+}
+
+static uint8_t payload_varint_bits(uint32_t value)
+{
+	uint8_t bits = 8;
+
+	while (value >= 0x80) {
+		value >>= 7;
+		bits += 8;
+	}
+	return bits;
+}
+
+uint16_t payload_record_bits(uint8_t flags, uint32_t delta, bool first)
+{
+	bool extended = flags & PAYLOAD_FLAG_EXTENDED;
+	uint16_t bits;
+
+	if (flags & PAYLOAD_FLAG_MEANS_ONLY) {
+		bits = PAYLOAD_BASE_MEANS_BITS + (extended ? PAYLOAD_EXT_MEANS_BITS : 0);
+	} else {
+		bits = PAYLOAD_BASE_STATS_BITS + (extended ? PAYLOAD_EXT_STATS_BITS : 0);
+	}
+	return bits + (first ? 0 : payload_varint_bits(delta));
+}
+
+int payload_start(struct payload_writer *w, uint8_t *buf, uint8_t max_len, uint8_t flags, uint32_t base_time)
+{
+	if (max_len < PAYLOAD_HDR_LEN) {
+		return -ENOSPC;
+	}
+
+	w->buf = buf;
+	w->max_bits = (max_len - PAYLOAD_HDR_LEN) * 8;
+	w->bits = 0;
+	w->count = 0;
+
+	buf[0] = flags & ~PAYLOAD_COUNT_MASK;
+	buf[1] = base_time;
+	buf[2] = base_time >> 8;
+	buf[3] = base_time >> 16;
+	buf[4] = base_time >> 24;
+	return 0;
+}
+
+bool payload_add(struct payload_writer *w, const struct payload_record *rec)
+{
+	uint8_t flags = w->buf[0];
+	uint8_t *stream = &w->buf[PAYLOAD_HDR_LEN];
+	const struct payload_field *f;
+	uint32_t delta = rec->delta;
+	bool valid;
+
+	if (w->count == PAYLOAD_COUNT_MASK ||
+	    w->bits + payload_record_bits(flags, delta, w->count == 0) > w->max_bits) {
+		return false;
+	}
+
+	if (w->count > 0) {
+		while (delta >= 0x80) {
+			payload_put_bits(stream, w->bits, (delta & 0x7F) | 0x80, 8);
+			w->bits += 8;
+			delta >>= 7;
+		}
+		payload_put_bits(stream, w->bits, delta, 8);
+		w->bits += 8;
+	}
+
+	if (!(flags & PAYLOAD_FLAG_MEANS_ONLY)) {
+		payload_put_bits(stream, w->bits, rec->samples, PAYLOAD_SAMPLES_BITS);
+		w->bits += PAYLOAD_SAMPLES_BITS;
+	}
+
+	for (int i = 0; i < PAYLOAD_FIELD_COUNT; i++) {
+		f = &payload_fields[i];
+		valid = rec->valid & PAYLOAD_FIELD_BIT(i);
+		if (f->extended && !(flags & PAYLOAD_FLAG_EXTENDED)) {
+			continue;
+		}
+		for (int s = PAYLOAD_MIN; s <= PAYLOAD_MEAN; s++) {
+			if ((flags & PAYLOAD_FLAG_MEANS_ONLY) && s != PAYLOAD_MEAN) {
+				continue;
+			}
+			payload_put_bits(stream, w->bits,
+					 valid ? payload_clamp((int64_t)rec->stats[i][s] - f->offset, f->bits) :
+					 PAYLOAD_INVALID(f->bits), f->bits);
+			w->bits += f->bits;
+		}
+		if (!(flags & PAYLOAD_FLAG_MEANS_ONLY)) {
+			payload_put_bits(stream, w->bits,
+					 valid ? payload_clamp(rec->stats[i][PAYLOAD_STDDEV], f->stddev_bits) :
+					 PAYLOAD_INVALID(f->stddev_bits), f->stddev_bits);
+			w->bits += f->stddev_bits;
+		}
+	}
+
+	w->count++;
+	return true;
+}
+
+int payload_finish(struct payload_writer *w)
+{
+	uint16_t len = PAYLOAD_HDR_LEN + (w->bits + 7) / 8;
+
+	// Zero the padding in the last byte.
+	if (w->bits % 8) {
+		w->buf[len - 1] &= 0xFF << (8 - w->bits % 8);
+	}
+
+	w->buf[0] = (w->buf[0] & ~PAYLOAD_COUNT_MASK) | w->count;
+	return len;
+}
+
+int payload_decode(const uint8_t *buf, uint8_t len, struct payload_frame *frame)
+{
+	const uint8_t *stream = &buf[PAYLOAD_HDR_LEN];
+	struct payload_record *rec;
+	const struct payload_field *f;
+	uint16_t max_bits, pos = 0;
+	uint32_t group;
+	uint8_t shift;
+
+	if (len < PAYLOAD_HDR_LEN) {
+		return -EINVAL;
+	}
+
+	memset(frame, 0, sizeof(*frame));
+	frame->flags = buf[0] & ~PAYLOAD_COUNT_MASK;
+	frame->count = buf[0] & PAYLOAD_COUNT_MASK;
+	frame->base_time = buf[1] | (buf[2] << 8) | (buf[3] << 16) | ((uint32_t)buf[4] << 24);
+	max_bits = (len - PAYLOAD_HDR_LEN) * 8;
+
+	for (int r = 0; r < frame->count; r++) {
+		rec = &frame->records[r];
+
+		if (r > 0) {
+			shift = 0;
+			do {
+				if (pos + 8 > max_bits || shift > 28) {
+					return -EINVAL;
+				}
+				group = payload_get_bits(stream, pos, 8);
+				pos += 8;
+				rec->delta |= (group & 0x7F) << shift;
+				shift += 7;
+			} while (group & 0x80);
+		}
+
+		if (pos + payload_record_bits(frame->flags, 0, true) > max_bits) {
+			return -EINVAL;
+		}
+
+		if (!(frame->flags & PAYLOAD_FLAG_MEANS_ONLY)) {
+			rec->samples = payload_get_bits(stream, pos, PAYLOAD_SAMPLES_BITS);
+			pos += PAYLOAD_SAMPLES_BITS;
+		}
+
+		for (int i = 0; i < PAYLOAD_FIELD_COUNT; i++) {
+			f = &payload_fields[i];
+			if (f->extended && !(frame->flags & PAYLOAD_FLAG_EXTENDED)) {
+				continue;
+			}
+			for (int s = PAYLOAD_MIN; s <= PAYLOAD_MEAN; s++) {
+				if ((frame->flags & PAYLOAD_FLAG_MEANS_ONLY) && s != PAYLOAD_MEAN) {
+					continue;
+				}
+				rec->stats[i][s] = (int32_t)payload_get_bits(stream, pos, f->bits) + f->offset;
+				pos += f->bits;
+			}
+			if (!(frame->flags & PAYLOAD_FLAG_MEANS_ONLY)) {
+				rec->stats[i][PAYLOAD_STDDEV] = payload_get_bits(stream, pos, f->stddev_bits);
+				pos += f->stddev_bits;
+			}
+
+			// Valid means saturate below the marker, so the mean alone tells.
+			if (rec->stats[i][PAYLOAD_MEAN] - f->offset == (int32_t)PAYLOAD_INVALID(f->bits)) {
+				memset(rec->stats[i], 0, sizeof(rec->stats[i]));
+			} else {
+				rec->valid |= PAYLOAD_FIELD_BIT(i);
+			}
+		}
+	}
+
+	return 0;
+}
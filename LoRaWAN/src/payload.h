@@ -0,0 +1,103 @@
+
+/*
+ * Bit-packed uplink payload encoder and decoder
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Uplink frame (port RECORD_PORT):
+ *
+ *   [0]     Bit 7: base time is GPS time, otherwise seconds before transmission
+ *           Bit 6: records hold means only
+ *           Bit 5: records include the extended schema fields
+ *           Bits 0-4: number of records
+ *   [1..4]  Base time (LE32), end of the first record's window
+ *   Bit stream, most significant bit first, zero padded to a whole byte.
+ *   Records of:
+ *           Seconds since the previous record (LEB128 varint in 8 bit
+ *           groups, omitted for the first record)
+ *           Number of samples in the window (8 bits, saturates at 255)
+ *           For each schema field: minimum, maximum, mean, standard deviation
+ *   With bit 6 set, records hold only the mean of each field, and no
+ *   number of samples.
+ *
+ * A field with no valid reading in a record's window is sent with all of
+ * its values (PAYLOAD_INVALID), so valid values saturate one below that.
+ */
+
+#define PAYLOAD_HDR_LEN             5
+#define PAYLOAD_FLAG_GPS_TIME       0x80
+#define PAYLOAD_FLAG_MEANS_ONLY     0x40
+#define PAYLOAD_FLAG_EXTENDED       0x20
+#define PAYLOAD_COUNT_MASK          0x1F
+#define PAYLOAD_SAMPLES_BITS        8
+
+// Every bit of a field value set marks a field with no reading
+#define PAYLOAD_INVALID(bits)       (((uint32_t)1 << (bits)) - 1)
+#define PAYLOAD_FIELD_BIT(id)       ((uint32_t)1 << (id))
+
+#define PAYLOAD_X_ID(id, name, unit, scale, offset, bits, stddev_bits) PAYLOAD_##id,
+#define PAYLOAD_X_MEAN_BITS(id, name, unit, scale, offset, bits, stddev_bits) + (bits)
+#define PAYLOAD_X_STATS_BITS(id, name, unit, scale, offset, bits, stddev_bits) + 3 * (bits) + (stddev_bits)
+
+// Record sizes in bits, excluding the time delta
+#define PAYLOAD_BASE_MEANS_BITS     (0 SCHEMA_BASE_FIELDS(PAYLOAD_X_MEAN_BITS))
+#define PAYLOAD_BASE_STATS_BITS     (PAYLOAD_SAMPLES_BITS SCHEMA_BASE_FIELDS(PAYLOAD_X_STATS_BITS))
+#define PAYLOAD_EXT_MEANS_BITS      (0 SCHEMA_EXTENDED_FIELDS(PAYLOAD_X_MEAN_BITS))
+#define PAYLOAD_EXT_STATS_BITS      (0 SCHEMA_EXTENDED_FIELDS(PAYLOAD_X_STATS_BITS))
+
+enum payload_field_id {
+	SCHEMA_BASE_FIELDS(PAYLOAD_X_ID)
+	SCHEMA_EXTENDED_FIELDS(PAYLOAD_X_ID)
+	PAYLOAD_FIELD_COUNT
+};
+
+enum payload_stat {
+	PAYLOAD_MIN,
+	PAYLOAD_MAX,
+	PAYLOAD_MEAN,
+	PAYLOAD_STDDEV,
+	PAYLOAD_STAT_COUNT
+};
+
+struct payload_field {
+	const char *name;
+	const char *unit;
+	int32_t scale;
+	int32_t offset;
+	uint8_t bits;
+	uint8_t stddev_bits;
+	bool extended;
+};
+
+struct payload_record {
+	uint32_t delta;         // Seconds since the previous record
+	uint8_t samples;
+	uint32_t valid;         // PAYLOAD_FIELD_BIT() of each field with a reading
+	int32_t stats[PAYLOAD_FIELD_COUNT][PAYLOAD_STAT_COUNT];     // 0 for invalid fields
+};
+
+struct payload_writer {
+	uint8_t *buf;
+	uint16_t max_bits;
+	uint16_t bits;
+	uint8_t count;
+};
+
+struct payload_frame {
+	uint8_t flags;
+	uint32_t base_time;
+	uint8_t count;
+	struct payload_record records[PAYLOAD_COUNT_MASK];
+};
+
+extern const struct payload_field payload_fields[PAYLOAD_FIELD_COUNT];
+
+uint16_t payload_record_bits(uint8_t flags, uint32_t delta, bool first);
+int payload_start(struct payload_writer *w, uint8_t *buf, uint8_t max_len, uint8_t flags, uint32_t base_time);
+bool payload_add(struct payload_writer *w, const struct payload_record *rec);
+int payload_finish(struct payload_writer *w);
+int payload_decode(const uint8_t *buf, uint8_t len, struct payload_frame *frame);
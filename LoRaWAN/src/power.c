@@ -0,0 +1,148 @@
+
+/*
+ * Device power management and energy accounting
+ *
+ * The SPI and I2C buses (and the radio, where its driver supports it) are
+ * put under device runtime PM, so they sit suspended in their sleep pinctrl
+ * state except while a domain is resumed around sensor reads or LoRaWAN
+ * activity. The domains are declared here from the devicetree; their
+ * reference counting and resume and suspend order are in power_domain.c.
+ *
+ * Every uplink, including those the stack's application layer services send
+ * by themselves (clock sync retransmissions and answers to the server), goes
+ * through lorawan_send(), which returns once the receive windows have closed.
+ * The linker routes all calls to it through __wrap_lorawan_send() below (see
+ * CMakeLists.txt), so the radio domain is held for as long as the MAC may use
+ * the radio, and the airtime of every uplink is accounted. Joins are resumed
+ * explicitly, and Class C holds the domain permanently.
+ *
+ * The time each domain is resumed, plus the estimated airtime of each
+ * uplink, is multiplied by the board current figures in power.h to give the
+ * charge used and an estimate of battery life for this firmware build.
+ * Time the CPU is awake outside a domain is short and counted as sleep.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/lorawan/lorawan.h>
+
+#include "airtime.h"
+#include "config.h"
+#include "power.h"
+#include "power_domain.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(power);
+
+static struct power_domain_state domains[POWER_DOMAIN_COUNT] = {
+	[POWER_DOMAIN_SENSOR] = {
+		.name = "sensor",
+#if DT_NODE_EXISTS(DT_ALIAS(sensorbus))
+		.devs = { DEVICE_DT_GET(DT_ALIAS(sensorbus)) },
+#endif
+	},
+	[POWER_DOMAIN_RADIO] = {
+		.name = "radio",
+		// Bus first, so it is resumed before the radio and suspended after it.
+		.devs = { DEVICE_DT_GET(DT_BUS(DT_ALIAS(lora0))), DEVICE_DT_GET(DT_ALIAS(lora0)) },
+	},
+};
+
+static K_MUTEX_DEFINE(power_lock);
+static uint64_t tx_us;
+static uint32_t cycles;
+
+int power_init(void)
+{
+	for (int d = 0; d < POWER_DOMAIN_COUNT; d++)
+		power_domain_init(&domains[d]);
+
+	LOG_INF("Board currents: sleep %duA, sensor %duA, radio %duA, tx %duA",
+		POWER_SLEEP_UA, POWER_SENSOR_UA, POWER_RADIO_UA, POWER_TX_UA);
+	return 0;
+}
+
+void power_resume(enum power_domain domain)
+{
+	power_domain_get(&domains[domain]);
+}
+
+void power_suspend(enum power_domain domain)
+{
+	power_domain_put(&domains[domain]);
+}
+
+int __real_lorawan_send(uint8_t port, uint8_t *data, uint8_t len, enum lorawan_message_type type);
+
+int __wrap_lorawan_send(uint8_t port, uint8_t *data, uint8_t len, enum lorawan_message_type type)
+{
+	uint32_t airtime;
+	int ret;
+
+	power_resume(POWER_DOMAIN_RADIO);
+	ret = __real_lorawan_send(port, data, len, type);
+	power_suspend(POWER_DOMAIN_RADIO);
+
+	// Busy means nothing was sent; any other result went on air (confirmed may be unacked).
+	if (ret != -EAGAIN) {
+		airtime = airtime_dr_us(config_get_datarate(), len);
+		k_mutex_lock(&power_lock, K_FOREVER);
+		tx_us += airtime;
+		k_mutex_unlock(&power_lock);
+	}
+	return ret;
+}
+
+void power_get_stats(struct power_stats *stats)
+{
+	uint64_t domain_ms[POWER_DOMAIN_COUNT];
+	int64_t now = k_uptime_get();
+	uint64_t awake_ms = 0;
+
+	for (int d = 0; d < POWER_DOMAIN_COUNT; d++) {
+		domain_ms[d] = power_domain_resumed_ms(&domains[d], now);
+		awake_ms += domain_ms[d];
+	}
+
+	k_mutex_lock(&power_lock, K_FOREVER);
+	stats->tx_ms = tx_us / USEC_PER_MSEC;
+	k_mutex_unlock(&power_lock);
+
+	stats->sensor_ms = domain_ms[POWER_DOMAIN_SENSOR];
+	stats->radio_ms = domain_ms[POWER_DOMAIN_RADIO] - MIN(stats->tx_ms, domain_ms[POWER_DOMAIN_RADIO]);
+	stats->sleep_ms = now - MIN(awake_ms, (uint64_t)now);
+
+	stats->charge_uas = (stats->sleep_ms * POWER_SLEEP_UA +
+			     stats->sensor_ms * POWER_SENSOR_UA +
+			     stats->radio_ms * POWER_RADIO_UA +
+			     stats->tx_ms * POWER_TX_UA) / MSEC_PER_SEC;
+
+	stats->average_ua = now > 0 ? (stats->charge_uas * MSEC_PER_SEC) / now : 0;
+	stats->life_days = stats->average_ua ?
+		((uint64_t)POWER_BATTERY_MAH * 1000) / stats->average_ua / 24 : 0;
+}
+
+void power_print_stats(void)
+{
+	struct power_stats stats;
+
+	power_get_stats(&stats);
+	LOG_INF("Energy: sleep %llums, sensor %llums, radio %llums, tx %llums",
+		stats.sleep_ms, stats.sensor_ms, stats.radio_ms, stats.tx_ms);
+	LOG_INF("Energy: %llu uAs used, average %uuA, %u days on %umAh",
+		stats.charge_uas, stats.average_ua, stats.life_days, POWER_BATTERY_MAH);
+}
+
+void power_cycle_done(void)
+{
+	if (++cycles % POWER_REPORT_CYCLES == 0) {
+		power_print_stats();
+	}
+}
@@ -0,0 +1,61 @@
+
+/*
+ * Device power management and energy accounting
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Board current draw in each state (uA), used to estimate battery life.
+ * The figures are the whole board: MCU, regulators and peripherals. They
+ * are datasheet estimates, replace with measured values for your build.
+ */
+#if defined(CONFIG_BOARD_LEMON_IOT_LORA_RAK3172)
+#define POWER_SLEEP_UA          3       // STM32WLE5 Stop 2, SHTC3/BME680 idle
+#define POWER_SENSOR_UA         3500    // Run mode, I2C and conversions
+#define POWER_RADIO_UA          6000    // Sub-GHz radio receive windows
+#define POWER_TX_UA             45000   // 14dBm, high power PA
+#elif defined(CONFIG_BOARD_LEMON_IOT_BLE_NRF52832)
+#define POWER_SLEEP_UA          5       // System ON, RTC, SX1276 sleep
+#define POWER_SENSOR_UA         3000
+#define POWER_RADIO_UA          13000   // SX1276 receive plus SPIM
+#define POWER_TX_UA             90000   // PA_BOOST
+#elif defined(CONFIG_BOARD_LEMON_IOT_LTE_NRF9160) || defined(CONFIG_BOARD_LEMON_IOT_LTE_NRF9160_NS)
+#define POWER_SLEEP_UA          8       // Modem off
+#define POWER_SENSOR_UA         3500
+#define POWER_RADIO_UA          13500
+#define POWER_TX_UA             90000
+#else
+#define POWER_SLEEP_UA          10
+#define POWER_SENSOR_UA         4000
+#define POWER_RADIO_UA          14000
+#define POWER_TX_UA             100000
+#endif
+
+#define POWER_BATTERY_MAH       2600    // e.g. AA lithium thionyl chloride
+#define POWER_REPORT_CYCLES     6       // Print the estimate this often
+
+enum power_domain {
+	POWER_DOMAIN_SENSOR,    // Sensor I2C bus
+	POWER_DOMAIN_RADIO,     // Radio and its SPI bus
+	POWER_DOMAIN_COUNT
+};
+
+struct power_stats {
+	uint64_t sleep_ms;
+	uint64_t sensor_ms;
+	uint64_t radio_ms;      // Radio resumed, excluding transmit
+	uint64_t tx_ms;
+	uint64_t charge_uas;    // Estimated charge used (uA * s)
+	uint32_t average_ua;
+	uint32_t life_days;
+};
+
+int power_init(void);
+void power_resume(enum power_domain domain);
+void power_suspend(enum power_domain domain);
+void power_get_stats(struct power_stats *stats);
+void power_print_stats(void);
+void power_cycle_done(void);
@@ -0,0 +1,99 @@
+/*
+ * Reference counted device power domains
+ *
+ * A domain is a short list of devices under device runtime PM, such as a
+ * bus and the device on it. The first user resumes them in list order and
+ * the last suspends them in reverse, so a bus is always active while the
+ * devices on it change state. Domains are shared by the application work
+ * queue and the LoRaWAN stack's own threads, so changes are serialised
+ * here. The time each domain spends resumed is kept for power.c's energy
+ * estimate.
+ *
+ * The domains are passed in rather than taken from the devicetree, so the
+ * sequencing can be tested with dummy devices (see tests/power).
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/pm/device_runtime.h>
+
+#include "power_domain.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(power_domain);
+
+static K_MUTEX_DEFINE(domain_lock);
+
+void power_domain_init(struct power_domain_state *dom)
+{
+	int ret;
+
+	for (int i = 0; i < POWER_DOMAIN_MAX_DEVICES && dom->devs[i]; i++) {
+		// Suspends the device, as nothing holds it yet.
+		ret = pm_device_runtime_enable(dom->devs[i]);
+		if (ret == -ENOTSUP) {
+			LOG_DBG("%s: no runtime PM support", dom->devs[i]->name);
+		} else if (ret < 0) {
+			LOG_WRN("%s: runtime PM enable failed (%d)", dom->devs[i]->name, ret);
+		}
+	}
+}
+
+void power_domain_get(struct power_domain_state *dom)
+{
+	int ret;
+
+	k_mutex_lock(&domain_lock, K_FOREVER);
+	if (dom->users++ == 0) {
+		dom->resumed_at = k_uptime_get();
+		for (int i = 0; i < POWER_DOMAIN_MAX_DEVICES && dom->devs[i]; i++) {
+			// Returns 0 for devices that aren't under runtime PM.
+			ret = pm_device_runtime_get(dom->devs[i]);
+			if (ret < 0) {
+				LOG_ERR("%s: resume failed (%d)", dom->devs[i]->name, ret);
+			}
+		}
+	}
+	k_mutex_unlock(&domain_lock);
+}
+
+void power_domain_put(struct power_domain_state *dom)
+{
+	int ret;
+
+	k_mutex_lock(&domain_lock, K_FOREVER);
+	if (dom->users == 0) {
+		LOG_WRN("%s domain suspended while not resumed", dom->name);
+	} else if (--dom->users == 0) {
+		for (int i = POWER_DOMAIN_MAX_DEVICES - 1; i >= 0; i--) {
+			if (dom->devs[i] == NULL) {
+				continue;
+			}
+			ret = pm_device_runtime_put(dom->devs[i]);
+			if (ret < 0) {
+				LOG_ERR("%s: suspend failed (%d)", dom->devs[i]->name, ret);
+			}
+		}
+		dom->resumed_ms += k_uptime_get() - dom->resumed_at;
+	}
+	k_mutex_unlock(&domain_lock);
+}
+
+// Time the domain has been resumed, including the current period if it still is
+uint64_t power_domain_resumed_ms(const struct power_domain_state *dom, int64_t now)
+{
+	uint64_t ms;
+
+	k_mutex_lock(&domain_lock, K_FOREVER);
+	ms = dom->resumed_ms;
+	if (dom->users) {
+		ms += now - dom->resumed_at;
+	}
+	k_mutex_unlock(&domain_lock);
+	return ms;
+}
@@ -0,0 +1,24 @@
+
+/*
+ * Reference counted device power domains
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define POWER_DOMAIN_MAX_DEVICES    2
+
+struct power_domain_state {
+	const char *name;
+	// Resumed in this order and suspended in reverse, so buses come first
+	const struct device *devs[POWER_DOMAIN_MAX_DEVICES];
+	uint8_t users;
+	int64_t resumed_at;
+	uint64_t resumed_ms;        // Total of the periods resumed, excluding the current one
+};
+
+void power_domain_init(struct power_domain_state *dom);
+void power_domain_get(struct power_domain_state *dom);
+void power_domain_put(struct power_domain_state *dom);
+uint64_t power_domain_resumed_ms(const struct power_domain_state *dom, int64_t now);
@@ -0,0 +1,132 @@
+
+/*
+ * Timestamped sensor records and uplink frame encoding
+ *
+ * Each sample is stamped with the uptime it was taken at and queued, so
+ * samples can be batched and backfilled after a failed send. When a frame is
+ * built, the uptime stamps are converted to GPS time using the clock service,
+ * which only needs network time at transmission, not when sampling. Only the
+ * first record carries an absolute time; the rest carry small offsets.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+
+#include "clock.h"
+#include "schema.h"
+#include "sensors.h"
+#include "aggregate.h"
+#include "payload.h"
+#include "record.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(record);
+
+BUILD_ASSERT(AGG_MIN == PAYLOAD_MIN && AGG_MAX == PAYLOAD_MAX &&
+	     AGG_MEAN == PAYLOAD_MEAN && AGG_STDDEV == PAYLOAD_STDDEV,
+	     "Summary statistics must be in payload order");
+BUILD_ASSERT(SENSOR_FIELD_COUNT <= PAYLOAD_FIELD_COUNT);
+BUILD_ASSERT(RECORD_MAX <= PAYLOAD_COUNT_MASK);
+
+static struct record records[RECORD_MAX];
+static uint8_t head;
+static uint8_t count;
+static uint32_t overwritten;
+
+void record_add(const struct agg_summary *summary)
+{
+	struct record *rec;
+
+	if (count == RECORD_MAX) {
+		// Queue full, lose the oldest record.
+		head = (head + 1) % RECORD_MAX;
+		count--;
+		overwritten++;
+		LOG_WRN("Record queue full, %u records lost", overwritten);
+	}
+
+	rec = &records[(head + count) % RECORD_MAX];
+	rec->uptime = k_uptime_get() / MSEC_PER_SEC;
+	rec->summary = *summary;
+	count++;
+}
+
+uint8_t record_pending(void)
+{
+	return count;
+}
+
+int record_encode(uint8_t *buf, uint8_t max_len, uint8_t *encoded)
+{
+	const struct record *rec, *prev = NULL;
+	uint32_t now = k_uptime_get() / MSEC_PER_SEC;
+	struct payload_writer writer;
+	struct payload_record prec;
+	uint64_t gps_us;
+	uint32_t base;
+	uint8_t flags = 0;
+	uint8_t n = 0;
+
+	*encoded = 0;
+	if (count == 0) {
+		return -ENOSPC;
+	}
+
+	rec = &records[head];
+	if (clock_get_gps_us(&gps_us) == 0) {
+		base = gps_us / USEC_PER_SEC - (now - rec->uptime);
+		flags |= PAYLOAD_FLAG_GPS_TIME;
+	} else {
+		base = now - rec->uptime;
+	}
+
+#ifdef SENSORS_HAVE_BME680
+	flags |= PAYLOAD_FLAG_EXTENDED;
+#endif
+
+	// Fall back to means only when a full summary doesn't fit (e.g. DR2 with dwell time).
+	if (max_len < PAYLOAD_HDR_LEN + (payload_record_bits(flags, 0, true) + 7) / 8) {
+		flags |= PAYLOAD_FLAG_MEANS_ONLY;
+	}
+
+	if (payload_start(&writer, buf, max_len, flags, base) < 0) {
+		return -ENOSPC;
+	}
+
+	memset(&prec, 0, sizeof(prec));
+	while (n < count) {
+		rec = &records[(head + n) % RECORD_MAX];
+
+		prec.delta = prev ? rec->uptime - prev->uptime : 0;
+		prec.samples = MIN(rec->summary.samples, UINT8_MAX);
+		prec.valid = rec->summary.valid;
+		memcpy(prec.stats, rec->summary.stats, sizeof(rec->summary.stats));
+
+		if (!payload_add(&writer, &prec)) {
+			break;
+		}
+		prev = rec;
+		n++;
+	}
+
+	if (n == 0) {
+		return -ENOSPC;
+	}
+
+	*encoded = n;
+	return payload_finish(&writer);
+}
+
+void record_consume(uint8_t consumed)
+{
+	consumed = MIN(consumed, count);
+	head = (head + consumed) % RECORD_MAX;
+	count -= consumed;
+}
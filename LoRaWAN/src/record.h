@@ -0,0 +1,22 @@
+
+/*
+ * Timestamped sensor records and uplink frame encoding
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Frames are encoded by payload.c, see payload.h for the layout.
+#define RECORD_PORT             2
+#define RECORD_MAX              16
+
+struct record {
+	uint32_t uptime;        // Seconds, end of window
+	struct agg_summary summary;
+};
+
+void record_add(const struct agg_summary *summary);
+uint8_t record_pending(void);
+int record_encode(uint8_t *buf, uint8_t max_len, uint8_t *encoded);
+void record_consume(uint8_t consumed);
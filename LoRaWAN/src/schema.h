@@ -0,0 +1,31 @@
+
+/*
+ * Uplink payload schema
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Every sensor field, in uplink order. The sensor field IDs, the bit-packed
+ * encoder and decoder (payload.c) and the TTN formatter generated by
+ * tools/payload_tool.c are all expanded from these lists.
+ *
+ * X(id, name, unit, scale, offset, bits, stddev_bits)
+ *
+ *   Readings are integers in 1/scale of unit. Minimum, maximum and mean are
+ *   sent as (reading - offset) in bits, standard deviation in stddev_bits.
+ *   Values outside the range saturate. The all ones value of each width is
+ *   reserved to mark a field with no reading (see payload.h), so the ranges
+ *   below end one count short of the full width.
+ *
+ * Extended fields are only sent by nodes with a BME680.
+ */
+#define SCHEMA_BASE_FIELDS(X) \
+	X(TEMPERATURE,    "temperature", "degC", 100, -4000, 14, 10)   /* -40.00 to 123.82 */ \
+	X(HUMIDITY,       "humidity",    "%RH",  10,  0,     10, 8)    /* 0.0 to 102.2 */
+
+#define SCHEMA_EXTENDED_FIELDS(X) \
+	X(PRESSURE,       "pressure",    "hPa",  10,  3000,  13, 8)    /* 300.0 to 1119.0 */ \
+	X(GAS_RESISTANCE, "gas",         "kOhm", 10,  0,     14, 10)   /* 0.0 to 1638.2 */
@@ -0,0 +1,258 @@
+/*
+ * Sensor acquisition
+ *
+ * When the devicetree declares the sensors (e.g. shtcx and bme680 on the
+ * RAK3172), they are read through the Zephyr sensor API. The drivers sleep
+ * through each conversion inside sensor_sample_fetch(), so the BME680 (the
+ * longest, with its gas heater) is fetched on its own work queue thread
+ * while the calling thread fetches the SHTC3, and the two conversions
+ * overlap. Each sensor is read on its own at init, and every acquisition
+ * logs its window against the sum of those. Boards that only provide a
+ * sensorbus alias use the SHTC3 driver in shtc3.c.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/sensor.h>
+
+#include "shtc3.h"
+#include "power.h"
+#include "schema.h"
+#include "sensors.h"
+#include "workq.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(sensors);
+
+static struct sensors_stats stats;
+
+#ifdef SENSORS_USE_SENSOR_API
+
+#define SHTC3_NODE DT_INST(0, sensirion_shtcx)
+#define BME680_NODE DT_INST(0, bosch_bme680)
+
+// Readings are converted from sensor API units to the schema units by mul / div.
+struct sensor_map {
+	enum sensor_channel chan;
+	enum sensor_field_id field;
+	int32_t mul;
+	int32_t div;
+};
+
+struct sensor_source {
+	const struct device *dev;
+	const struct sensor_map *map;
+	uint8_t map_len;
+	struct k_work_q *queue;     // Fetched on this thread, or the caller's if NULL
+	struct k_work work;
+	int32_t *values;
+	uint32_t valid;
+	uint32_t done_us;           // Since the start of the acquisition
+	int result;
+};
+
+static const struct sensor_map shtc3_map[] = {
+	{ SENSOR_CHAN_AMBIENT_TEMP, SENSOR_FIELD_TEMPERATURE, 100, 1 },   // degC to 0.01 degC
+	{ SENSOR_CHAN_HUMIDITY, SENSOR_FIELD_HUMIDITY, 10, 1 },            // %RH to 0.1 %RH
+};
+
+#ifdef SENSORS_HAVE_BME680
+static const struct sensor_map bme680_map[] = {
+	{ SENSOR_CHAN_PRESS, SENSOR_FIELD_PRESSURE, 100, 1 },              // kPa to 0.1 hPa
+	{ SENSOR_CHAN_GAS_RES, SENSOR_FIELD_GAS_RESISTANCE, 1, 100 },      // ohm to 0.1 kOhm
+};
+
+K_THREAD_STACK_DEFINE(bme680_stack, SENSORS_STACK_SIZE);
+static struct k_work_q bme680_workq;
+#endif
+
+static struct sensor_source sources[] = {
+	{ .dev = DEVICE_DT_GET(SHTC3_NODE), .map = shtc3_map, .map_len = ARRAY_SIZE(shtc3_map) },
+#ifdef SENSORS_HAVE_BME680
+	{ .dev = DEVICE_DT_GET(BME680_NODE), .map = bme680_map, .map_len = ARRAY_SIZE(bme680_map),
+	  .queue = &bme680_workq },
+#endif
+};
+
+static K_SEM_DEFINE(sensors_done, 0, ARRAY_SIZE(sources));
+static uint32_t acquire_start;
+
+static int32_t sensors_scale(const struct sensor_value *val, const struct sensor_map *map)
+{
+	int64_t micro = (int64_t)val->val1 * 1000000 + val->val2;
+
+	return (int32_t)(micro * map->mul / map->div / 1000000);
+}
+
+// Fetch every channel of a source into its values, in schema units.
+static void sensors_read(struct sensor_source *src)
+{
+	struct sensor_value val;
+	int ret;
+
+	src->valid = 0;
+	src->result = sensor_sample_fetch(src->dev);
+	if (src->result < 0) {
+		LOG_ERR("%s: fetch failed (%d)", src->dev->name, src->result);
+	}
+
+	for (int i = 0; i < src->map_len && src->result == 0; i++) {
+		ret = sensor_channel_get(src->dev, src->map[i].chan, &val);
+		if (ret < 0) {
+			LOG_WRN("%s: channel %d not read (%d)", src->dev->name, src->map[i].chan, ret);
+			continue;
+		}
+		src->values[src->map[i].field] = sensors_scale(&val, &src->map[i]);
+		src->valid |= BIT(src->map[i].field);
+	}
+	src->done_us = k_cyc_to_us_floor32(k_cycle_get_32() - acquire_start);
+}
+
+static void sensors_work_handler(struct k_work *work)
+{
+	struct sensor_source *src = CONTAINER_OF(work, struct sensor_source, work);
+
+	sensors_read(src);
+	k_sem_give(&sensors_done);
+}
+
+int sensors_init(void)
+{
+	int32_t values[SENSOR_FIELD_COUNT];
+#ifdef SENSORS_HAVE_BME680
+	const struct k_work_queue_config cfg = {
+		.name = "bme680",
+	};
+#endif
+
+	for (int i = 0; i < ARRAY_SIZE(sources); i++) {
+		if (!device_is_ready(sources[i].dev)) {
+			LOG_ERR("%s: device not ready.", sources[i].dev->name);
+			return -ENODEV;
+		}
+		k_work_init(&sources[i].work, sensors_work_handler);
+	}
+
+#ifdef SENSORS_HAVE_BME680
+	k_work_queue_start(&bme680_workq, bme680_stack, K_THREAD_STACK_SIZEOF(bme680_stack),
+			   APP_WORKQ_PRIORITY, &cfg);
+#endif
+
+	// Each sensor on its own, on the calling thread
+	power_resume(POWER_DOMAIN_SENSOR);
+	for (int i = 0; i < ARRAY_SIZE(sources); i++) {
+		acquire_start = k_cycle_get_32();
+		sources[i].values = values;
+		sensors_read(&sources[i]);
+		stats.solo_total_us += sources[i].done_us;
+		LOG_INF("%s: %uus on its own", sources[i].dev->name, sources[i].done_us);
+	}
+	power_suspend(POWER_DOMAIN_SENSOR);
+
+	LOG_INF("%d sensors, %d uplink fields", ARRAY_SIZE(sources), SENSOR_FIELD_COUNT);
+	return 0;
+}
+
+uint32_t sensors_acquire(int32_t values[SENSOR_FIELD_COUNT])
+{
+	uint32_t valid = 0;
+	int pending = 0;
+	int ret;
+
+	memset(values, 0, sizeof(int32_t) * SENSOR_FIELD_COUNT);
+	power_resume(POWER_DOMAIN_SENSOR);
+	acquire_start = k_cycle_get_32();
+
+	// Start the sensors with their own thread, then fetch the rest here while they convert.
+	for (int i = 0; i < ARRAY_SIZE(sources); i++) {
+		sources[i].values = values;
+		if (sources[i].queue == NULL) {
+			continue;
+		}
+		ret = k_work_submit_to_queue(sources[i].queue, &sources[i].work);
+		if (ret < 0) {
+			LOG_ERR("%s: submit failed (%d)", sources[i].dev->name, ret);
+			sources[i].valid = 0;
+			continue;
+		}
+		pending++;
+	}
+	for (int i = 0; i < ARRAY_SIZE(sources); i++) {
+		if (sources[i].queue == NULL) {
+			sensors_read(&sources[i]);
+		}
+	}
+	while (pending-- > 0) {
+		k_sem_take(&sensors_done, K_FOREVER);
+	}
+
+	power_suspend(POWER_DOMAIN_SENSOR);
+	stats.window_us = k_cyc_to_us_floor32(k_cycle_get_32() - acquire_start);
+
+	for (int i = 0; i < ARRAY_SIZE(sources); i++) {
+		valid |= sources[i].valid;
+		LOG_DBG("%s done at %uus (%d)", sources[i].dev->name, sources[i].done_us, sources[i].result);
+	}
+
+	// Overlap is how much shorter the window is than the reads done one at a time.
+	LOG_DBG("Acquired in %uus, %uus one at a time, %uus overlapped",
+		stats.window_us, stats.solo_total_us,
+		stats.solo_total_us > stats.window_us ? stats.solo_total_us - stats.window_us : 0);
+	return valid;
+}
+
+#else
+
+static const struct device *i2c_dev = DEVICE_DT_GET(DT_ALIAS(sensorbus));
+
+int sensors_init(void)
+{
+	if (!device_is_ready(i2c_dev)) {
+		LOG_ERR("I2C: Device driver not found.");
+		return -ENODEV;
+	}
+	return 0;
+}
+
+uint32_t sensors_acquire(int32_t values[SENSOR_FIELD_COUNT])
+{
+	uint32_t start = k_cycle_get_32();
+	uint16_t temperature, humidity;
+	uint8_t ret;
+
+	power_resume(POWER_DOMAIN_SENSOR);
+	shtc3_wakeup(i2c_dev);
+	k_msleep(1);
+	ret = shtc3_GetTempAndHumidity(i2c_dev, &temperature, &humidity);
+	shtc3_sleep(i2c_dev);
+	power_suspend(POWER_DOMAIN_SENSOR);
+
+	// A single sensor, so nothing overlaps.
+	stats.window_us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+	stats.solo_total_us = stats.window_us;
+
+	if (ret != SHTC3_NO_ERROR) {
+		LOG_ERR("SHTC3 read failed (%d)", ret);
+		return 0;
+	}
+
+	// Schema units, 0.01 degC and 0.1 %RH
+	values[SENSOR_FIELD_TEMPERATURE] = ((17500 * (int32_t)temperature) >> 16) - 4500;
+	values[SENSOR_FIELD_HUMIDITY] = (1000 * (int32_t)humidity) >> 16;
+	return BIT(SENSOR_FIELD_TEMPERATURE) | BIT(SENSOR_FIELD_HUMIDITY);
+}
+
+#endif
+
+void sensors_get_stats(struct sensors_stats *out)
+{
+	*out = stats;
+}
@@ -0,0 +1,50 @@
+
+/*
+ * Sensor acquisition
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#if DT_HAS_COMPAT_STATUS_OKAY(sensirion_shtcx) && defined(CONFIG_SENSOR)
+#define SENSORS_USE_SENSOR_API      1
+#endif
+
+#if defined(SENSORS_USE_SENSOR_API) && DT_HAS_COMPAT_STATUS_OKAY(bosch_bme680)
+#define SENSORS_HAVE_BME680         1
+#endif
+
+/*
+ * Stack of the thread fetching the BME680. The driver only does short I2C
+ * transfers and its integer compensation. Sized within the stack budget in
+ * prj.conf; this is an estimate, check it against the high-water mark from
+ * a debug.conf build.
+ */
+#define SENSORS_STACK_SIZE          512
+
+/*
+ * One value per field of the uplink schema (schema.h), in the same order and
+ * fixed point units. Temperature and humidity come from the SHTC3 and are
+ * always present; the extended fields need a BME680 in the devicetree.
+ */
+#define SENSOR_X_ID(id, name, unit, scale, offset, bits, stddev_bits) SENSOR_FIELD_##id,
+
+enum sensor_field_id {
+	SCHEMA_BASE_FIELDS(SENSOR_X_ID)
+#ifdef SENSORS_HAVE_BME680
+	SCHEMA_EXTENDED_FIELDS(SENSOR_X_ID)
+#endif
+	SENSOR_FIELD_COUNT
+};
+
+// Times of the last acquisition, to show how much the conversions overlap
+struct sensors_stats {
+	uint32_t window_us;         // Sensor domain resumed to all reads done
+	uint32_t solo_total_us;     // Sum of each sensor read on its own at init
+};
+
+int sensors_init(void);
+// Returns a mask with BIT(field) set for each field read, 0 if none were
+uint32_t sensors_acquire(int32_t values[SENSOR_FIELD_COUNT]);
+void sensors_get_stats(struct sensors_stats *stats);
@@ -0,0 +1,68 @@
+
+/*
+ * Uplink slot scheduler
+ *
+ * After a site power cut, every node boots at the same time and runs the same
+ * reporting period, so uplinks collide at the gateway period after period.
+ * Each node instead derives a transmit offset within the reporting period
+ * from a hash of its DevEUI, and wakes at that offset in absolute (network)
+ * time. Until network time is available, the period is randomly jittered so
+ * the fleet drifts apart. The arithmetic is in slot_calc.c.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/random/random.h>
+#include <zephyr/sys/util.h>
+
+#include "clock.h"
+#include "slot.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(slot);
+
+static uint32_t slot_hash;
+static uint32_t period_ms;
+static uint32_t offset_ms;
+
+void slot_init(const uint8_t dev_eui[8], uint32_t period_s)
+{
+	slot_hash = slot_hash_eui(dev_eui);
+	slot_set_period(period_s);
+}
+
+void slot_set_period(uint32_t period_s)
+{
+	period_ms = period_s * MSEC_PER_SEC;
+	offset_ms = slot_offset_ms(slot_hash, period_ms);
+	LOG_INF("Uplink slot at %u.%03us of %us period", offset_ms / MSEC_PER_SEC,
+		offset_ms % MSEC_PER_SEC, period_s);
+}
+
+uint32_t slot_get_offset_ms(void)
+{
+	return offset_ms;
+}
+
+k_timeout_t slot_next_wakeup(void)
+{
+	uint64_t gps_us;
+	uint32_t wait_ms;
+
+	if (clock_get_gps_us(&gps_us) != 0) {
+		// No network time, randomise around the nominal period.
+		wait_ms = slot_jitter_wait_ms(period_ms, sys_rand32_get());
+		LOG_DBG("No network time, next uplink in %ums", wait_ms);
+		return K_MSEC(wait_ms);
+	}
+
+	wait_ms = slot_wait_ms(offset_ms, period_ms, gps_us / USEC_PER_MSEC);
+	LOG_DBG("Next uplink slot in %ums", wait_ms);
+	return K_MSEC(wait_ms);
+}
@@ -0,0 +1,15 @@
+
+/*
+ * Uplink slot scheduler
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "slot_calc.h"
+
+void slot_init(const uint8_t dev_eui[8], uint32_t period_s);
+void slot_set_period(uint32_t period_s);
+uint32_t slot_get_offset_ms(void);
+k_timeout_t slot_next_wakeup(void);
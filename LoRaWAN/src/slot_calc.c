@@ -0,0 +1,64 @@
+/*
+ * Uplink slot offset and wait calculations
+ *
+ * The arithmetic behind slot.c. This file has no Zephyr dependencies, so
+ * host tools can build it too.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "slot_calc.h"
+
+// FNV-1a, spreads DevEUIs that differ only in their last bytes
+uint32_t slot_hash_eui(const uint8_t dev_eui[8])
+{
+	uint32_t hash = 2166136261U;
+
+	for (size_t i = 0; i < 8; i++) {
+		hash ^= dev_eui[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+// Transmit offset within the reporting period
+uint32_t slot_offset_ms(uint32_t hash, uint32_t period_ms)
+{
+	return period_ms ? hash % period_ms : 0;
+}
+
+/*
+ * Time from gps_ms (network time) to the next occurrence of offset_ms in
+ * the period, at least SLOT_MIN_GAP_MS away.
+ */
+uint32_t slot_wait_ms(uint32_t offset_ms, uint32_t period_ms, uint64_t gps_ms)
+{
+	uint32_t position_ms, wait_ms;
+
+	if (period_ms == 0) {
+		return SLOT_MIN_GAP_MS;
+	}
+
+	position_ms = gps_ms % period_ms;
+	wait_ms = (offset_ms % period_ms + period_ms - position_ms) % period_ms;
+	if (wait_ms < SLOT_MIN_GAP_MS) {
+		wait_ms += period_ms;
+	}
+	return wait_ms;
+}
+
+/*
+ * Without network time, the period with up to SLOT_JITTER_PERCENT either
+ * side of it, chosen by rand.
+ */
+uint32_t slot_jitter_wait_ms(uint32_t period_ms, uint32_t rand)
+{
+	uint32_t jitter_ms = (uint64_t)period_ms * SLOT_JITTER_PERCENT / 100;
+
+	return period_ms - jitter_ms + (rand % (2 * jitter_ms + 1));
+}
@@ -0,0 +1,19 @@
+
+/*
+ * Uplink slot offset and wait calculations
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Fraction of the period used for random jitter when network time isn't available
+#define SLOT_JITTER_PERCENT     10
+
+// Don't schedule a slot closer than this, skip to the next period instead
+#define SLOT_MIN_GAP_MS         5000
+
+uint32_t slot_hash_eui(const uint8_t dev_eui[8]);
+uint32_t slot_offset_ms(uint32_t hash, uint32_t period_ms);
+uint32_t slot_wait_ms(uint32_t offset_ms, uint32_t period_ms, uint64_t gps_ms);
+uint32_t slot_jitter_wait_ms(uint32_t period_ms, uint32_t rand);
@@ -0,0 +1,105 @@
+/*
+ * Fixed point running statistics (Welford's algorithm)
+ *
+ * Keeps the minimum, maximum, mean and sum of squared differences of a
+ * series, so no samples need to be stored. The mean and sum of squares are
+ * kept with WELFORD_FRAC_BITS fractional bits. The product of two deltas
+ * needs 2 * WELFORD_FRAC_BITS, so in 64 bits it only fits while a delta is
+ * below about 46,000 counts; larger deltas drop half of the fraction bits
+ * first. The standard deviation fits up to 65,535 counts. This file has no
+ * Zephyr dependencies, so host tools can build it too.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "welford.h"
+
+// Largest delta, Q(WELFORD_FRAC_BITS), whose square fits in an int64_t
+#define WELFORD_DELTA_MAX       ((int64_t)46340 << WELFORD_FRAC_BITS)
+
+void welford_reset(struct welford *w)
+{
+	memset(w, 0, sizeof(*w));
+}
+
+void welford_add(struct welford *w, int32_t value)
+{
+	int64_t x = (int64_t)value << WELFORD_FRAC_BITS;
+	int64_t delta, delta2;
+	int half = WELFORD_FRAC_BITS / 2;
+
+	if (w->samples == UINT16_MAX) {
+		return;
+	}
+
+	if (w->samples++ == 0) {
+		w->min = w->max = value;
+		w->mean = x;
+		w->m2 = 0;
+		return;
+	}
+
+	w->min = value < w->min ? value : w->min;
+	w->max = value > w->max ? value : w->max;
+
+	delta = x - w->mean;
+	w->mean += delta / w->samples;
+	delta2 = x - w->mean;
+
+	if (delta > WELFORD_DELTA_MAX || delta < -WELFORD_DELTA_MAX) {
+		w->m2 += (delta >> half) * (delta2 >> half);
+	} else {
+		w->m2 += (delta * delta2) >> WELFORD_FRAC_BITS;
+	}
+}
+
+static uint32_t welford_isqrt(uint64_t value)
+{
+	uint64_t bit = (uint64_t)1 << 62;
+	uint64_t root = 0;
+
+	while (bit > value) {
+		bit >>= 2;
+	}
+	while (bit) {
+		if (value >= root + bit) {
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}
+
+// Round Q(WELFORD_FRAC_BITS) to the nearest integer, halves away from zero
+static int32_t welford_round(int64_t value)
+{
+	int64_t half = (int64_t)1 << (WELFORD_FRAC_BITS - 1);
+
+	return value >= 0 ? (value + half) >> WELFORD_FRAC_BITS : -((-value + half) >> WELFORD_FRAC_BITS);
+}
+
+void welford_summarise(const struct welford *w, int32_t stats[AGG_STAT_COUNT])
+{
+	uint64_t variance;
+
+	stats[AGG_MIN] = w->min;
+	stats[AGG_MAX] = w->max;
+	stats[AGG_MEAN] = welford_round(w->mean);
+
+	if (w->samples < 2 || w->m2 <= 0) {
+		stats[AGG_STDDEV] = 0;
+		return;
+	}
+
+	// Divide before shifting to Q(2 * WELFORD_FRAC_BITS), so its root is in Q(WELFORD_FRAC_BITS)
+	variance = ((uint64_t)w->m2 / (w->samples - 1)) << WELFORD_FRAC_BITS;
+	stats[AGG_STDDEV] = welford_round(welford_isqrt(variance));
+}
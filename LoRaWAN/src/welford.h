@@ -0,0 +1,31 @@
+
+/*
+ * Fixed point running statistics (Welford's algorithm)
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Fractional bits kept in the running mean and sum of squares
+#define WELFORD_FRAC_BITS       16
+
+enum agg_stat {
+	AGG_MIN,
+	AGG_MAX,
+	AGG_MEAN,
+	AGG_STDDEV,             // Sample standard deviation, 0 for fewer than 2 samples
+	AGG_STAT_COUNT
+};
+
+struct welford {
+	uint16_t samples;
+	int32_t min;
+	int32_t max;
+	int64_t mean;           // Q(WELFORD_FRAC_BITS)
+	int64_t m2;             // Sum of squared differences, Q(WELFORD_FRAC_BITS)
+};
+
+void welford_reset(struct welford *w);
+void welford_add(struct welford *w, int32_t value);
+void welford_summarise(const struct welford *w, int32_t stats[AGG_STAT_COUNT]);
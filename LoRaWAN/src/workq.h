@@ -0,0 +1,20 @@
+
+/*
+ * Application work queue
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * All application work (sampling, uplinks, downlink commands, clock sync
+ * and flash writes) runs on this queue, one item at a time. Its deepest
+ * paths are lorawan_send() and join (MAC framing and AES), NVS and flash
+ * writes. Sized within the stack budget in prj.conf; this is an estimate,
+ * check it against the high-water mark from a debug.conf build.
+ */
+#define APP_WORKQ_STACK_SIZE    1280
+#define APP_WORKQ_PRIORITY      K_PRIO_PREEMPT(7)
+
+extern struct k_work_q app_workq;
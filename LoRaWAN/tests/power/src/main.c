@@ -0,0 +1,184 @@
+/*
+ * Power domain sequencing against dummy PM devices
+ *
+ * power.c builds its domains from the sensorbus and lora0 aliases, which
+ * native_sim.overlay points at devices logging every PM action. The tests
+ * check the order of those actions around sensor reads and uplinks, that
+ * nested users don't suspend a domain early, and the energy accounting.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <zephyr/pm/device.h>
+#include <zephyr/ztest.h>
+
+#include "power.h"
+#include "pm_dummy.h"
+
+static const struct device *i2c = DEVICE_DT_GET(DT_NODELABEL(test_i2c));
+static const struct device *spi = DEVICE_DT_GET(DT_NODELABEL(test_spi));
+static const struct device *radio = DEVICE_DT_GET(DT_NODELABEL(test_radio));
+
+static int send_result;
+
+int __wrap_lorawan_send(uint8_t port, uint8_t *data, uint8_t len, enum lorawan_message_type type);
+
+static bool device_active(const struct device *dev)
+{
+	enum pm_device_state state;
+
+	return pm_device_state_get(dev, &state) == 0 && state == PM_DEVICE_STATE_ACTIVE;
+}
+
+// The stack, which needs the radio and its bus until the receive windows close
+int __real_lorawan_send(uint8_t port, uint8_t *data, uint8_t len, enum lorawan_message_type type)
+{
+	zassert_true(device_active(spi) && device_active(radio), "uplink with the radio suspended");
+	pm_log_add(radio, PM_EVENT_USE);
+	return send_result;
+}
+
+uint8_t config_get_datarate(void)
+{
+	return 2;
+}
+
+static void check_log(const struct pm_event *expected, int len)
+{
+	zassert_equal(pm_log_len, len, "%d PM events, expected %d", pm_log_len, len);
+	for (int i = 0; i < len; i++) {
+		zassert_equal_ptr(pm_log[i].dev, expected[i].dev, "event %d on %s", i, pm_log[i].dev->name);
+		zassert_equal(pm_log[i].type, expected[i].type, "event %d on %s", i, pm_log[i].dev->name);
+	}
+}
+
+static void *power_setup(void)
+{
+	zassert_ok(power_init());
+	return NULL;
+}
+
+static void power_before(void *fixture)
+{
+	pm_log_len = 0;
+	send_result = 0;
+}
+
+static void power_after(void *fixture)
+{
+	zassert_false(device_active(i2c) || device_active(spi) || device_active(radio),
+		      "a domain was left resumed");
+}
+
+ZTEST(power, test_suspended_at_init)
+{
+	zassert_false(device_active(i2c));
+	zassert_false(device_active(spi));
+	zassert_false(device_active(radio));
+}
+
+ZTEST(power, test_sensor_read)
+{
+	const struct pm_event expected[] = {
+		{ i2c, PM_EVENT_RESUME }, { i2c, PM_EVENT_USE }, { i2c, PM_EVENT_SUSPEND },
+	};
+
+	// As sensors_acquire() does
+	power_resume(POWER_DOMAIN_SENSOR);
+	zassert_true(device_active(i2c));
+	pm_log_add(i2c, PM_EVENT_USE);
+	power_suspend(POWER_DOMAIN_SENSOR);
+
+	check_log(expected, ARRAY_SIZE(expected));
+}
+
+ZTEST(power, test_uplink)
+{
+	const struct pm_event expected[] = {
+		{ spi, PM_EVENT_RESUME }, { radio, PM_EVENT_RESUME }, { radio, PM_EVENT_USE },
+		{ radio, PM_EVENT_SUSPEND }, { spi, PM_EVENT_SUSPEND },
+	};
+	uint8_t data[4] = { 0 };
+
+	zassert_ok(__wrap_lorawan_send(2, data, sizeof(data), LORAWAN_MSG_UNCONFIRMED));
+	check_log(expected, ARRAY_SIZE(expected));
+}
+
+ZTEST(power, test_uplink_during_join)
+{
+	const struct pm_event expected[] = {
+		{ spi, PM_EVENT_RESUME }, { radio, PM_EVENT_RESUME },
+		{ radio, PM_EVENT_USE }, { radio, PM_EVENT_USE },
+		{ radio, PM_EVENT_SUSPEND }, { spi, PM_EVENT_SUSPEND },
+	};
+	uint8_t data[4] = { 0 };
+
+	// A join holds the domain, and the services send while it does.
+	power_resume(POWER_DOMAIN_RADIO);
+	__wrap_lorawan_send(2, data, sizeof(data), LORAWAN_MSG_UNCONFIRMED);
+	__wrap_lorawan_send(202, data, sizeof(data), LORAWAN_MSG_UNCONFIRMED);
+	zassert_true(device_active(radio), "suspended with a user left");
+	power_suspend(POWER_DOMAIN_RADIO);
+
+	check_log(expected, ARRAY_SIZE(expected));
+}
+
+ZTEST(power, test_domains_independent)
+{
+	const struct pm_event expected[] = {
+		{ i2c, PM_EVENT_RESUME },
+		{ spi, PM_EVENT_RESUME }, { radio, PM_EVENT_RESUME }, { radio, PM_EVENT_USE },
+		{ radio, PM_EVENT_SUSPEND }, { spi, PM_EVENT_SUSPEND },
+		{ i2c, PM_EVENT_SUSPEND },
+	};
+	uint8_t data[4] = { 0 };
+
+	power_resume(POWER_DOMAIN_SENSOR);
+	__wrap_lorawan_send(2, data, sizeof(data), LORAWAN_MSG_UNCONFIRMED);
+	zassert_true(device_active(i2c));
+	power_suspend(POWER_DOMAIN_SENSOR);
+
+	check_log(expected, ARRAY_SIZE(expected));
+}
+
+ZTEST(power, test_unbalanced_suspend)
+{
+	power_suspend(POWER_DOMAIN_RADIO);
+	zassert_equal(pm_log_len, 0);
+
+	// Still counts from zero afterwards
+	power_resume(POWER_DOMAIN_RADIO);
+	zassert_true(device_active(radio));
+	power_suspend(POWER_DOMAIN_RADIO);
+	zassert_false(device_active(radio));
+}
+
+ZTEST(power, test_accounting)
+{
+	struct power_stats before, after;
+	uint8_t data[10] = { 0 };
+
+	power_get_stats(&before);
+
+	power_resume(POWER_DOMAIN_SENSOR);
+	k_msleep(100);
+	power_suspend(POWER_DOMAIN_SENSOR);
+
+	__wrap_lorawan_send(2, data, sizeof(data), LORAWAN_MSG_UNCONFIRMED);
+	power_get_stats(&after);
+	zassert_true(after.sensor_ms - before.sensor_ms >= 100);
+	zassert_true(after.tx_ms > before.tx_ms, "uplink airtime not counted");
+
+	// Busy, nothing went on air
+	send_result = -EAGAIN;
+	__wrap_lorawan_send(2, data, sizeof(data), LORAWAN_MSG_UNCONFIRMED);
+	power_get_stats(&before);
+	zassert_equal(before.tx_ms, after.tx_ms);
+}
+
+ZTEST_SUITE(power, NULL, power_setup, power_before, power_after, NULL);
@@ -0,0 +1,56 @@
+/*
+ * Dummy PM devices that log their actions
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/pm/device.h>
+
+#include "pm_dummy.h"
+
+struct pm_event pm_log[PM_LOG_MAX];
+int pm_log_len;
+
+void pm_log_add(const struct device *dev, enum pm_event_type type)
+{
+	if (pm_log_len < PM_LOG_MAX) {
+		pm_log[pm_log_len].dev = dev;
+		pm_log[pm_log_len].type = type;
+	}
+	pm_log_len++;
+}
+
+static int pm_dummy_action(const struct device *dev, enum pm_device_action action)
+{
+	switch (action) {
+	case PM_DEVICE_ACTION_RESUME:
+		pm_log_add(dev, PM_EVENT_RESUME);
+		return 0;
+	case PM_DEVICE_ACTION_SUSPEND:
+		pm_log_add(dev, PM_EVENT_SUSPEND);
+		return 0;
+	default:
+		return -ENOTSUP;
+	}
+}
+
+static int pm_dummy_init(const struct device *dev)
+{
+	return 0;
+}
+
+#define PM_DUMMY_DEFINE(n)                                                              \
+	PM_DEVICE_DT_INST_DEFINE(n, pm_dummy_action);                                   \
+	DEVICE_DT_INST_DEFINE(n, pm_dummy_init, PM_DEVICE_DT_INST_GET(n), NULL, NULL,   \
+			      POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEVICE, NULL);
+
+#define DT_DRV_COMPAT test_pm_dummy_bus
+DT_INST_FOREACH_STATUS_OKAY(PM_DUMMY_DEFINE)
+
+#undef DT_DRV_COMPAT
+#define DT_DRV_COMPAT test_pm_dummy
+DT_INST_FOREACH_STATUS_OKAY(PM_DUMMY_DEFINE)
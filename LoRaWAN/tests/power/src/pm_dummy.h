@@ -0,0 +1,26 @@
+
+/*
+ * Dummy PM devices that log their actions
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define PM_LOG_MAX              16
+
+enum pm_event_type {
+	PM_EVENT_RESUME,
+	PM_EVENT_SUSPEND,
+	PM_EVENT_USE,               // Logged by the test where the device is used
+};
+
+struct pm_event {
+	const struct device *dev;
+	enum pm_event_type type;
+};
+
+extern struct pm_event pm_log[PM_LOG_MAX];
+extern int pm_log_len;
+
+void pm_log_add(const struct device *dev, enum pm_event_type type);
@@ -0,0 +1,170 @@
+/*
+ * I2C emulators of the SHTC3 and BME680
+ *
+ * Just enough of each device for the Zephyr drivers to probe and fetch.
+ * The SHTC3 answers every read with its ID or a measurement (with the
+ * Sensirion CRC). The BME680 is a register file preloaded with its chip
+ * ID, plausible calibration and a completed measurement, so the driver's
+ * compensation has no zero divisors.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/emul.h>
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/i2c_emul.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "emul_sensors.h"
+
+uint8_t emul_domain_users;
+uint32_t emul_suspended_transfers;
+
+static void emul_check_domain(void)
+{
+	if (emul_domain_users == 0) {
+		emul_suspended_transfers++;
+	}
+}
+
+#define DT_DRV_COMPAT sensirion_shtcx
+
+#define SHTC3_ID                0x0807
+
+static uint8_t shtc3_crc(const uint8_t *data)
+{
+	uint8_t crc = 0xFF;
+
+	for (int i = 0; i < 2; i++) {
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : crc << 1;
+	}
+	return crc;
+}
+
+static void shtc3_put_word(uint16_t word, uint8_t *buf)
+{
+	sys_put_be16(word, buf);
+	buf[2] = shtc3_crc(buf);
+}
+
+static int shtc3_emul_transfer(const struct emul *target, struct i2c_msg *msgs, int num_msgs, int addr)
+{
+	emul_check_domain();
+
+	for (int i = 0; i < num_msgs; i++) {
+		if (!(msgs[i].flags & I2C_MSG_READ)) {
+			continue;
+		}
+		// Three bytes is the ID, six a measurement (temperature first).
+		if (msgs[i].len == 3) {
+			shtc3_put_word(SHTC3_ID, msgs[i].buf);
+		} else if (msgs[i].len == 6) {
+			shtc3_put_word(EMUL_SHTC3_TEMP_RAW, &msgs[i].buf[0]);
+			shtc3_put_word(EMUL_SHTC3_HUM_RAW, &msgs[i].buf[3]);
+		} else {
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+static const struct i2c_emul_api shtc3_emul_api = {
+	.transfer = shtc3_emul_transfer,
+};
+
+static int shtc3_emul_init(const struct emul *target, const struct device *parent)
+{
+	return 0;
+}
+
+#define SHTC3_EMUL(n) EMUL_DT_INST_DEFINE(n, shtc3_emul_init, NULL, NULL, &shtc3_emul_api, NULL)
+DT_INST_FOREACH_STATUS_OKAY(SHTC3_EMUL)
+
+#undef DT_DRV_COMPAT
+#define DT_DRV_COMPAT bosch_bme680
+
+struct bme680_emul_data {
+	uint8_t regs[256];
+	uint8_t addr;
+};
+
+static int bme680_emul_transfer(const struct emul *target, struct i2c_msg *msgs, int num_msgs, int addr)
+{
+	struct bme680_emul_data *data = target->data;
+
+	emul_check_domain();
+
+	for (int i = 0; i < num_msgs; i++) {
+		if (msgs[i].flags & I2C_MSG_READ) {
+			for (int k = 0; k < msgs[i].len; k++)
+				msgs[i].buf[k] = data->regs[(uint8_t)(data->addr + k)];
+			continue;
+		}
+		// Register address, then any values written from there on
+		data->addr = msgs[i].buf[0];
+		for (int k = 1; k < msgs[i].len; k++) {
+			// Soft reset and the mode bits aren't kept, so a measurement always reads done.
+			if (data->addr + k - 1 < 0x1D || data->addr + k - 1 > 0x2B) {
+				data->regs[(uint8_t)(data->addr + k - 1)] = msgs[i].buf[k];
+			}
+		}
+	}
+	return 0;
+}
+
+static const struct i2c_emul_api bme680_emul_api = {
+	.transfer = bme680_emul_transfer,
+};
+
+static int bme680_emul_init(const struct emul *target, const struct device *parent)
+{
+	struct bme680_emul_data *data = target->data;
+	uint8_t *regs = data->regs;
+
+	memset(regs, 0, sizeof(data->regs));
+	regs[0xD0] = 0x61;                      // Chip ID
+
+	// Calibration, typical of a real part
+	sys_put_le16(26000, &regs[0xE9]);       // T1
+	sys_put_le16(26000, &regs[0x8A]);       // T2
+	regs[0x8C] = 3;                         // T3
+	sys_put_le16(36000, &regs[0x8E]);       // P1
+	sys_put_le16(-10400, &regs[0x90]);      // P2
+	regs[0x92] = 88;                        // P3
+	sys_put_le16(6000, &regs[0x94]);        // P4
+	sys_put_le16(-100, &regs[0x96]);        // P5
+	regs[0x99] = 30;                        // P6
+	regs[0x98] = 30;                        // P7
+	sys_put_le16(-300, &regs[0x9C]);        // P8
+	sys_put_le16(-3000, &regs[0x9E]);       // P9
+	regs[0xA0] = 30;                        // P10
+	regs[0xE2] = 0x30;                      // H1 and H2 low nibbles
+	regs[0xE3] = 0x30;                      // H1
+	regs[0xE1] = 0x3E;                      // H2
+	regs[0xED] = 0x40;                      // G1
+	sys_put_le16(-8000, &regs[0xEB]);       // G2
+	regs[0xEE] = 0x12;                      // G3
+	regs[0x02] = 0x10;                      // Heater resistance range
+	regs[0x00] = 0x30;                      // Heater resistance correction
+
+	// A completed measurement: new data, then pressure, temperature, humidity and gas
+	regs[0x1D] = 0x80;
+	regs[0x1F] = 0x50;
+	regs[0x22] = 0x80;
+	regs[0x25] = 0x60;
+	regs[0x2A] = 0x96;
+	regs[0x2B] = 0x30;                      // Gas valid, heater stable, range 0
+	return 0;
+}
+
+#define BME680_EMUL(n)                                                                  \
+	static struct bme680_emul_data bme680_emul_data_##n;                            \
+	EMUL_DT_INST_DEFINE(n, bme680_emul_init, &bme680_emul_data_##n, NULL,           \
+			    &bme680_emul_api, NULL)
+DT_INST_FOREACH_STATUS_OKAY(BME680_EMUL)
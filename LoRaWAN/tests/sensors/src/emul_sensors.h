@@ -0,0 +1,16 @@
+
+/*
+ * I2C emulators of the SHTC3 and BME680
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Raw readings returned by the SHTC3 emulator, 42.5 degC and 25.0 %RH
+#define EMUL_SHTC3_TEMP_RAW     0x8000
+#define EMUL_SHTC3_HUM_RAW      0x4000
+
+// Transfers made while the sensor domain was suspended, set by the test's power_resume()
+extern uint8_t emul_domain_users;
+extern uint32_t emul_suspended_transfers;
@@ -0,0 +1,97 @@
+/*
+ * sensors.c against emulated SHTC3 and BME680
+ *
+ * The real Zephyr shtcx and bme680 drivers talk to the I2C emulators in
+ * emul_sensors.c. Both drivers sleep through their conversions, so an
+ * acquisition that overlaps them must take less than the two reads did one
+ * after another at init. power.c is replaced by a counter, to check every
+ * transfer is made with the sensor domain resumed.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "power.h"
+#include "schema.h"
+#include "sensors.h"
+#include "emul_sensors.h"
+
+BUILD_ASSERT(IS_ENABLED(SENSORS_USE_SENSOR_API) && IS_ENABLED(SENSORS_HAVE_BME680),
+	     "native_sim.overlay must declare both sensors");
+
+static uint32_t resumes;
+
+void power_resume(enum power_domain domain)
+{
+	zassert_equal(domain, POWER_DOMAIN_SENSOR);
+	emul_domain_users++;
+	resumes++;
+}
+
+void power_suspend(enum power_domain domain)
+{
+	zassert_equal(domain, POWER_DOMAIN_SENSOR);
+	zassert_true(emul_domain_users > 0, "suspended while not resumed");
+	emul_domain_users--;
+}
+
+static void *sensors_setup(void)
+{
+	zassert_ok(sensors_init());
+	zassert_equal(emul_domain_users, 0);
+	return NULL;
+}
+
+static void sensors_before(void *fixture)
+{
+	emul_suspended_transfers = 0;
+	resumes = 0;
+}
+
+ZTEST(sensors, test_values)
+{
+	int32_t values[SENSOR_FIELD_COUNT];
+	uint32_t valid;
+
+	valid = sensors_acquire(values);
+
+	zassert_equal(valid, BIT(SENSOR_FIELD_TEMPERATURE) | BIT(SENSOR_FIELD_HUMIDITY) |
+		      BIT(SENSOR_FIELD_PRESSURE) | BIT(SENSOR_FIELD_GAS_RESISTANCE));
+	// 42.5 degC and 25.0 %RH in schema units
+	zassert_equal(values[SENSOR_FIELD_TEMPERATURE], 4250);
+	zassert_equal(values[SENSOR_FIELD_HUMIDITY], 250);
+	zassert_true(values[SENSOR_FIELD_PRESSURE] > 0);
+	zassert_true(values[SENSOR_FIELD_GAS_RESISTANCE] > 0);
+}
+
+ZTEST(sensors, test_overlap)
+{
+	struct sensors_stats stats;
+	int32_t values[SENSOR_FIELD_COUNT];
+
+	sensors_acquire(values);
+	sensors_get_stats(&stats);
+
+	TC_PRINT("Acquired in %uus, %uus one at a time\n", stats.window_us, stats.solo_total_us);
+	zassert_true(stats.solo_total_us > 0);
+	zassert_true(stats.window_us < stats.solo_total_us, "conversions did not overlap");
+}
+
+ZTEST(sensors, test_power_domain)
+{
+	int32_t values[SENSOR_FIELD_COUNT];
+
+	for (int i = 0; i < 3; i++)
+		sensors_acquire(values);
+
+	zassert_equal(resumes, 3);
+	zassert_equal(emul_domain_users, 0);
+	zassert_equal(emul_suspended_transfers, 0, "I2C used with the sensor domain suspended");
+}
+
+ZTEST_SUITE(sensors, NULL, sensors_setup, sensors_before, NULL, NULL);
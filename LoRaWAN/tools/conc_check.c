@@ -0,0 +1,320 @@
+/*
+ * Host side check of the LoRa Concentrator deduplication and batching
+ *
+ * Builds concentrator.c from LoRa_Concentrator as used by the firmware and
+ * runs it through duplicates, late and lost frames, full batches, a falling
+ * batch limit and a deterministic fleet of senders:
+ *
+ *   cc -I../../LoRa_Concentrator/src -o conc_check conc_check.c \
+ *      ../../LoRa_Concentrator/src/concentrator.c
+ *   ./conc_check
+ *
+ * The exit status is 1 if any check fails.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "concentrator.h"
+
+#define FLEET_SENDERS           64
+#define FLEET_FRAMES            20000
+#define FLEET_DATA_LEN          4
+#define FLEET_DUP_PERCENT       10
+#define FLEET_LOSS_PERCENT      5
+
+// LoRaWAN MAC header, FPort and MIC overhead per uplink
+#define LORAWAN_FRAME_OVERHEAD  13
+
+#define CHECK(cond) check(cond, #cond, __LINE__)
+
+static int failures;
+
+static void check(bool ok, const char *what, int line)
+{
+	if (!ok) {
+		printf("FAIL line %d: %s\n", line, what);
+		failures++;
+	}
+}
+
+static uint32_t fleet_rand(void)
+{
+	static uint32_t state = 0x12345678;
+
+	// xorshift32, deterministic so runs are comparable
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static struct p2p_frame make_frame(uint16_t id, uint8_t seq, uint8_t data_len)
+{
+	struct p2p_frame frame;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.data[0] = CONC_NODE_MAGIC;
+	frame.data[1] = id & 0xFF;
+	frame.data[2] = id >> 8;
+	frame.data[3] = seq;
+	for (int i = 0; i < data_len; i++)
+		frame.data[CONC_NODE_HDR_LEN + i] = seq + i;
+	frame.size = CONC_NODE_HDR_LEN + data_len;
+	frame.rssi = -80;
+	frame.snr = 5;
+	return frame;
+}
+
+static int process(uint16_t id, uint8_t seq, uint8_t data_len)
+{
+	struct p2p_frame frame = make_frame(id, seq, data_len);
+
+	return conc_process(&frame, 0);
+}
+
+static const struct conc_source *find_source(uint16_t id)
+{
+	const struct conc_source *sources = conc_get_sources();
+
+	for (int i = 0; i < CONC_MAX_SOURCES; i++) {
+		if (sources[i].used && sources[i].id == id) {
+			return &sources[i];
+		}
+	}
+	return NULL;
+}
+
+static void check_dedup(void)
+{
+	const struct conc_source *src;
+
+	conc_init(CONC_BATCH_MAX);
+
+	CHECK(process(1, 10, 2) == CONC_ACCEPTED);
+	CHECK(process(1, 10, 2) == CONC_DUPLICATE);
+	CHECK(process(1, 11, 2) == CONC_ACCEPTED);
+
+	// 12 and 13 skipped, then 12 arrives late
+	CHECK(process(1, 14, 2) == CONC_ACCEPTED);
+	src = find_source(1);
+	CHECK(src != NULL && src->lost == 2);
+	CHECK(process(1, 12, 2) == CONC_ACCEPTED);
+	CHECK(src != NULL && src->lost == 1);
+	CHECK(process(1, 12, 2) == CONC_DUPLICATE);
+
+	// Sequence numbers wrap at 255
+	CHECK(process(2, 254, 2) == CONC_ACCEPTED);
+	CHECK(process(2, 255, 2) == CONC_ACCEPTED);
+	CHECK(process(2, 0, 2) == CONC_ACCEPTED);
+	CHECK(process(2, 255, 2) == CONC_DUPLICATE);
+
+	// Far behind the window, taken as a reboot and accepted
+	CHECK(process(1, 14 - CONC_SEQ_WINDOW - 20, 2) == CONC_ACCEPTED);
+
+	CHECK(conc_get_totals()->duplicates == 3);
+	CHECK(conc_get_totals()->frames_in == 8);
+}
+
+static void check_invalid(void)
+{
+	struct p2p_frame frame;
+
+	conc_init(CONC_BATCH_MAX);
+
+	frame = make_frame(1, 1, 2);
+	frame.data[0] = 0;
+	CHECK(conc_process(&frame, 0) == -EINVAL);
+
+	frame = make_frame(1, 1, 0);
+	frame.size = CONC_NODE_HDR_LEN - 1;
+	CHECK(conc_process(&frame, 0) == -EINVAL);
+
+	// Oversize frames keep their real size and are rejected, not truncated
+	frame = make_frame(1, 1, CONC_MAX_DATA);
+	frame.size = CONC_MAX_FRAME + 1;
+	CHECK(conc_process(&frame, 0) == -EINVAL);
+
+	CHECK(conc_get_totals()->invalid == 3);
+	CHECK(!conc_batch_pending());
+}
+
+static void check_batching(void)
+{
+	const struct conc_batch *batch = conc_batch_get();
+	uint16_t entry_len = CONC_ENTRY_HDR_LEN + 10;
+	int fit = (64 - CONC_BATCH_HDR_LEN) / entry_len;
+	int ret;
+
+	conc_init(64);
+
+	for (int i = 0; i < fit; i++)
+		CHECK(process(3, i, 10) == CONC_ACCEPTED);
+	CHECK(batch->count == fit);
+	CHECK(batch->len == CONC_BATCH_HDR_LEN + fit * entry_len);
+	CHECK(batch->buf[1] == fit);
+
+	// Full, the caller must forward and retry. The frame isn't marked seen.
+	CHECK(process(3, fit, 10) == -ENOSPC);
+	conc_batch_reset(true);
+	CHECK(process(3, fit, 10) == CONC_ACCEPTED);
+	CHECK(batch->buf[0] == 1);
+	CHECK(conc_get_totals()->batches_out == 1);
+
+	// Larger than an empty batch can hold
+	conc_batch_reset(false);
+	conc_set_batch_limit(CONC_BATCH_HDR_LEN + CONC_ENTRY_HDR_LEN + 4);
+	ret = process(3, fit + 1, 5);
+	CHECK(ret == -EMSGSIZE);
+	CHECK(conc_get_totals()->dropped == 1);
+	CHECK(conc_get_totals()->batches_failed == 1);
+}
+
+static void check_split(void)
+{
+	const struct conc_batch *batch = conc_batch_get();
+	static uint8_t piece[CONC_BATCH_MAX];
+	uint8_t count, seq, expect_seq = 0;
+	uint16_t len, sent = 0;
+	int entries = 0;
+
+	conc_init(CONC_BATCH_MAX);
+
+	// 12 entries of 15 bytes, 182 bytes
+	for (int i = 0; i < 12; i++)
+		CHECK(process(0x100 + i, 1, 10) == CONC_ACCEPTED);
+	CHECK(batch->len == 182);
+
+	// Datarate drops to a 51 byte payload, three entries per piece
+	conc_set_batch_limit(51);
+	seq = batch->seq;
+	while (batch->len > batch->limit) {
+		len = conc_batch_split(piece, &count);
+		CHECK(len != 0 && len <= 51);
+		CHECK(count == 3);
+		CHECK(piece[0] == seq + expect_seq);
+		CHECK(piece[1] == count);
+		// Entries in order, each complete
+		for (int i = 0, off = CONC_BATCH_HDR_LEN; i < count; i++) {
+			CHECK(piece[off] == ((0x100 + entries + i) & 0xFF));
+			CHECK(piece[off + 4] == 10);
+			off += CONC_ENTRY_HDR_LEN + piece[off + 4];
+		}
+		conc_batch_consume(count, len);
+		entries += count;
+		sent += len;
+		expect_seq++;
+	}
+	CHECK(entries == 9);
+	CHECK(batch->count == 3);
+	CHECK(batch->buf[0] == batch->seq);
+	CHECK(batch->buf[1] == 3);
+	CHECK(batch->len == CONC_BATCH_HDR_LEN + 3 * 15);
+	CHECK(batch->buf[CONC_BATCH_HDR_LEN] == ((0x100 + 9) & 0xFF));
+	conc_batch_reset(true);
+	CHECK(conc_get_totals()->batches_out == 4);
+	CHECK(conc_get_totals()->bytes_out == sent + CONC_BATCH_HDR_LEN + 3 * 15u);
+
+	// An entry larger than the new limit is dropped rather than stalling
+	conc_set_batch_limit(CONC_BATCH_MAX);
+	CHECK(process(0x200, 1, CONC_MAX_DATA) == CONC_ACCEPTED);
+	CHECK(process(0x201, 1, 2) == CONC_ACCEPTED);
+	conc_set_batch_limit(20);
+	CHECK(conc_batch_split(piece, &count) == 0);
+	conc_batch_consume(1, 0);
+	CHECK(conc_get_totals()->dropped == 1);
+	len = conc_batch_split(piece, &count);
+	CHECK(len == CONC_BATCH_HDR_LEN + CONC_ENTRY_HDR_LEN + 2 && count == 1);
+	CHECK(batch->len <= batch->limit);
+}
+
+static void check_eviction(void)
+{
+	conc_init(CONC_BATCH_MAX);
+
+	for (int i = 0; i <= CONC_MAX_SOURCES; i++) {
+		struct p2p_frame frame = make_frame(0x300 + i, 1, 1);
+
+		CHECK(conc_process(&frame, i) == CONC_ACCEPTED);
+		if (conc_batch_pending()) {
+			conc_batch_reset(true);
+		}
+	}
+	CHECK(conc_get_totals()->evicted == 1);
+	CHECK(find_source(0x300) == NULL);
+	CHECK(find_source(0x300 + CONC_MAX_SOURCES) != NULL);
+}
+
+static void check_fleet(void)
+{
+	static uint8_t seq[FLEET_SENDERS];
+	static uint8_t stats[CONC_STATS_MAX];
+	const struct conc_totals *totals = conc_get_totals();
+	uint32_t sent = 0, dups = 0, direct_bytes, batched_bytes;
+	struct p2p_frame frame;
+	uint16_t id;
+	int ret;
+
+	conc_init(CONC_BATCH_MAX);
+
+	for (int n = 0; n < FLEET_FRAMES; n++) {
+		id = fleet_rand() % FLEET_SENDERS;
+		seq[id]++;
+
+		if ((fleet_rand() % 100) < FLEET_LOSS_PERCENT) {
+			continue;
+		}
+
+		frame = make_frame(0x1000 + id, seq[id], FLEET_DATA_LEN);
+		ret = conc_process(&frame, n);
+		if (ret == -ENOSPC) {
+			conc_batch_reset(true);
+			ret = conc_process(&frame, n);
+		}
+		CHECK(ret == CONC_ACCEPTED);
+
+		if ((fleet_rand() % 100) < FLEET_DUP_PERCENT) {
+			// Same frame heard again, e.g. via a repeater
+			CHECK(conc_process(&frame, n) == CONC_DUPLICATE);
+			dups++;
+		}
+		sent++;
+	}
+	conc_batch_reset(true);
+
+	CHECK(totals->frames_in == sent);
+	CHECK(totals->duplicates == dups);
+	CHECK(totals->evicted > 0);
+
+	direct_bytes = totals->bytes_in + totals->frames_in * LORAWAN_FRAME_OVERHEAD;
+	batched_bytes = totals->bytes_out + totals->batches_out * LORAWAN_FRAME_OVERHEAD;
+	printf("Fleet: %d senders, %u frames (%u duplicates), %u uplinks of %u bytes replaced by %u uplinks of %u bytes\n",
+		FLEET_SENDERS, sent, dups, totals->frames_in, direct_bytes, totals->batches_out, batched_bytes);
+	CHECK(batched_bytes < direct_bytes);
+
+	// Report carries the totals and as many sources as fit
+	CHECK(conc_stats_encode(stats, sizeof(stats)) == CONC_STATS_MAX);
+	CHECK(stats[CONC_STATS_HDR_LEN - 1] == CONC_MAX_SOURCES);
+	CHECK(conc_stats_encode(stats, CONC_STATS_HDR_LEN - 1) == 0);
+}
+
+int main(void)
+{
+	check_dedup();
+	check_invalid();
+	check_batching();
+	check_split();
+	check_eviction();
+	check_fleet();
+
+	printf("%s\n", failures ? "FAILED" : "OK");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,104 @@
+// Generated by payload_tool -j from LoRaWAN/src/schema.h, do not edit.
+var FIELDS = [
+  { name: "temperature", unit: "degC", scale: 100, offset: -4000, bits: 14, stddevBits: 10, extended: false },
+  { name: "humidity", unit: "%RH", scale: 10, offset: 0, bits: 10, stddevBits: 8, extended: false },
+  { name: "pressure", unit: "hPa", scale: 10, offset: 3000, bits: 13, stddevBits: 8, extended: true },
+  { name: "gas", unit: "kOhm", scale: 10, offset: 0, bits: 14, stddevBits: 10, extended: true },
+];
+
+// GPS time each leap second took effect, and GPS - UTC from then on
+var LEAP_SECONDS = [
+  [46828801, 1],
+  [78364802, 2],
+  [109900803, 3],
+  [173059204, 4],
+  [252028805, 5],
+  [315187206, 6],
+  [346723207, 7],
+  [393984008, 8],
+  [425520009, 9],
+  [457056010, 10],
+  [504489611, 11],
+  [551750412, 12],
+  [599184013, 13],
+  [820108814, 14],
+  [914803215, 15],
+  [1025136016, 16],
+  [1119744017, 17],
+  [1167264018, 18],
+];
+
+function gpsToUnix(gps) {
+  var leap = 0;
+  for (var i = 0; i < LEAP_SECONDS.length && gps >= LEAP_SECONDS[i][0]; i++) {
+    leap = LEAP_SECONDS[i][1];
+  }
+  return 315964800 + gps - leap;
+}
+
+function decodeUplink(input) {
+  var bytes = input.bytes;
+  var pos = 5 * 8;
+
+  function get(bits) {
+    var value = 0;
+    for (var i = 0; i < bits; i++, pos++) {
+      if ((pos >> 3) >= bytes.length) throw "truncated frame";
+      value = value * 2 + ((bytes[pos >> 3] >> (7 - (pos & 7))) & 1);
+    }
+    return value;
+  }
+
+  if (bytes.length < 5) return { errors: ["frame too short"] };
+  var gps = (bytes[0] & 0x80) !== 0;
+  var meansOnly = (bytes[0] & 0x40) !== 0;
+  var extended = (bytes[0] & 0x20) !== 0;
+  var count = bytes[0] & 0x1f;
+  var base = (bytes[1] | (bytes[2] << 8) | (bytes[3] << 16) | (bytes[4] << 24)) >>> 0;
+  var records = [];
+  var offset = 0;
+
+  try {
+    for (var r = 0; r < count; r++) {
+      if (r > 0) {
+        var group, shift = 0;
+        do {
+          group = get(8);
+          offset += (group & 0x7f) * Math.pow(2, shift);
+          shift += 7;
+        } while (group & 0x80);
+      }
+      var rec = {};
+      if (gps) {
+        rec.time = new Date(gpsToUnix(base + offset) * 1000).toISOString();
+      } else {
+        rec.secondsBeforeUplink = base - offset;
+      }
+      if (!meansOnly) rec.samples = get(8);
+      for (var i = 0; i < FIELDS.length; i++) {
+        var f = FIELDS[i];
+        if (f.extended && !extended) continue;
+        // Every bit of a value set marks a field with no reading.
+        var invalid = Math.pow(2, f.bits) - 1;
+        if (meansOnly) {
+          var mean = get(f.bits);
+          rec[f.name] = mean === invalid ? null : (mean + f.offset) / f.scale;
+          continue;
+        }
+        var min = get(f.bits), max = get(f.bits), mean = get(f.bits), stddev = get(f.stddevBits);
+        rec[f.name] = mean === invalid ? null : {
+          min: (min + f.offset) / f.scale,
+          max: (max + f.offset) / f.scale,
+          mean: (mean + f.offset) / f.scale,
+          stddev: stddev / f.scale,
+          unit: f.unit
+        };
+      }
+      records.push(rec);
+    }
+  } catch (e) {
+    return { errors: [String(e)] };
+  }
+
+  return { data: { records: records } };
+}
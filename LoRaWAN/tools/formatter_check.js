@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: Apache-2.0
+//
+// Check the TTN payload formatter against payload_tool's decoder (payload.c)
+//
+//   node formatter_check.js formatter.js payload_tool [frames]
+//
+// payload_tool -g prints random frames, some cut short, and payload_tool -J
+// decodes them into the formatter's output shape. Every frame must decode
+// to the same values in both, and frames one decoder rejects must be
+// rejected by the other. The exit status is 1 on any difference.
+
+'use strict';
+
+var fs = require('fs');
+var vm = require('vm');
+var execFileSync = require('child_process').execFileSync;
+
+var formatterPath = process.argv[2];
+var toolPath = process.argv[3];
+var frames = process.argv[4] || '1000';
+
+var formatter = {};
+vm.runInNewContext(fs.readFileSync(formatterPath, 'utf8'), formatter);
+
+// A thousand frames decode to a few megabytes of JSON.
+var options = { encoding: 'utf8', maxBuffer: 64 * 1024 * 1024 };
+var hex = execFileSync(toolPath, ['-g', frames], options);
+var expected = execFileSync(toolPath, ['-J'], Object.assign({ input: hex }, options)).trim().split('\n');
+var lines = hex.trim().split('\n');
+
+// Both decoders divide the same integers by the same scale, so values must
+// match exactly.
+function same(a, b) {
+  if (a === null || b === null || typeof a !== 'object' || typeof b !== 'object') {
+    return a === b;
+  }
+  var keys = Object.keys(a);
+  if (keys.length !== Object.keys(b).length) return false;
+  return keys.every(function (k) { return same(a[k], b[k]); });
+}
+
+var failures = 0;
+var errors = 0;
+var records = 0;
+
+lines.forEach(function (line, n) {
+  var bytes = Buffer.from(line, 'hex');
+  var got = JSON.parse(JSON.stringify(formatter.decodeUplink({ bytes: Array.from(bytes), fPort: 2 })));
+  var want = JSON.parse(expected[n]);
+  var ok;
+
+  if (want.errors || got.errors) {
+    ok = Boolean(want.errors && got.errors);
+    errors++;
+  } else {
+    ok = same(got.data, want.data);
+    records += want.data.records.length;
+  }
+  if (!ok) {
+    console.log('Frame ' + n + ' (' + line + '):');
+    console.log('  formatter    ' + JSON.stringify(got));
+    console.log('  payload_tool ' + JSON.stringify(want));
+    failures++;
+  }
+});
+
+console.log(lines.length + ' frames (' + errors + ' rejected), ' + records + ' records, ' +
+            failures + ' failures');
+process.exit(failures ? 1 : 0);
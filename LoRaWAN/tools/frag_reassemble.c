@@ -0,0 +1,348 @@
+
+/*
+ * Host side reassembler for the fragmented bulk data uplink transport
+ *
+ * Reads fragment payloads as hex, one uplink per line (as shown by the
+ * network server), and prints each reassembled transfer as hex, rebuilding
+ * lost fragments from parity where possible:
+ *
+ *   cc -I../src -DCONFIG_LORAMAC_REGION_AU915 -o frag_reassemble frag_reassemble.c ../src/airtime.c
+ *   ./frag_reassemble < uplinks.txt
+ *
+ * With -b, runs a benchmark instead: transfers are sent over a simulated
+ * link with random loss, with and without parity, and the delivered payload
+ * bytes per second of airtime are reported. Options: -b [bytes] [datarate].
+ * It also loses each fragment of a transfer in turn at every datarate, and
+ * exits with status 1 if parity fails to rebuild any of them. Build with
+ * -DCONFIG_LORAMAC_REGION_xxx to match the firmware region (CMakeLists.txt
+ * uses LORAMAC_REGION, AU915 by default).
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "airtime.h"
+#include "frag.h"
+
+#define MAX_LINE        1024
+#define BENCH_TRIALS    200
+
+struct frag_session {
+	bool active;
+	uint8_t count;
+	uint8_t last_len;
+	uint8_t frag_len;
+	bool have[FRAG_MAX_FRAGMENTS];
+	bool have_parity[FRAG_MAX_FRAGMENTS];
+	uint8_t data[FRAG_MAX_FRAGMENTS][FRAG_MAX_PAYLOAD];
+	uint8_t parity[FRAG_MAX_FRAGMENTS][FRAG_MAX_PAYLOAD];
+};
+
+static struct frag_session sessions[FRAG_SESSION_MASK + 1];
+
+static void session_reset(struct frag_session *s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+static void session_add(struct frag_session *s, const uint8_t *frag, int len)
+{
+	uint8_t index = frag[1];
+	uint8_t count = frag[2];
+	uint8_t payload_len = len - FRAG_HDR_LEN;
+
+	if (!s->active || s->count != count || s->last_len != frag[3]) {
+		// New transfer on this session number.
+		session_reset(s);
+		s->active = true;
+		s->count = count;
+		s->last_len = frag[3];
+	}
+
+	if ((frag[0] & FRAG_TYPE_MASK) == FRAG_TYPE_PARITY) {
+		s->frag_len = payload_len;
+		s->have_parity[index] = true;
+		memcpy(s->parity[index], &frag[FRAG_HDR_LEN], payload_len);
+	} else if (index < count) {
+		if (index != count - 1) {
+			s->frag_len = payload_len;
+		}
+		s->have[index] = true;
+		memcpy(s->data[index], &frag[FRAG_HDR_LEN], payload_len);
+	}
+}
+
+static int session_recover(struct frag_session *s, int group_size)
+{
+	int recovered = 0;
+
+	if (group_size == 0 || s->frag_len == 0) {
+		return 0;
+	}
+
+	for (int g = 0; g * group_size < s->count; g++) {
+		int first = g * group_size;
+		int last = first + group_size < s->count ? first + group_size : s->count;
+		int missing = -1, n_missing = 0;
+
+		for (int i = first; i < last; i++) {
+			if (!s->have[i]) {
+				missing = i;
+				n_missing++;
+			}
+		}
+		if (n_missing != 1 || !s->have_parity[g]) {
+			continue;
+		}
+
+		memcpy(s->data[missing], s->parity[g], s->frag_len);
+		for (int i = first; i < last; i++) {
+			int len = (i == s->count - 1) ? s->last_len : s->frag_len;
+
+			if (i == missing) {
+				continue;
+			}
+			for (int j = 0; j < len; j++)
+				s->data[missing][j] ^= s->data[i][j];
+		}
+		s->have[missing] = true;
+		recovered++;
+	}
+
+	return recovered;
+}
+
+static bool session_complete(const struct frag_session *s)
+{
+	for (int i = 0; i < s->count; i++) {
+		if (!s->have[i]) {
+			return false;
+		}
+	}
+	return s->active;
+}
+
+static size_t session_output(const struct frag_session *s, uint8_t *out)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < s->count; i++) {
+		int this_len = (i == s->count - 1) ? s->last_len : s->frag_len;
+
+		memcpy(&out[len], s->data[i], this_len);
+		len += this_len;
+	}
+	return len;
+}
+
+static int parse_hex(const char *line, uint8_t *buf, int max_len)
+{
+	int len = 0;
+	unsigned int byte;
+
+	while (*line && len < max_len) {
+		while (*line == ' ' || *line == '\t') {
+			line++;
+		}
+		if (sscanf(line, "%2x", &byte) != 1) {
+			break;
+		}
+		buf[len++] = byte;
+		line += 2;
+	}
+	return len;
+}
+
+static int reassemble(void)
+{
+	static uint8_t out[FRAG_MAX_FRAGMENTS * FRAG_MAX_PAYLOAD];
+	char line[MAX_LINE];
+	uint8_t frag[FRAG_MAX_PAYLOAD + FRAG_HDR_LEN];
+	struct frag_session *s;
+	int len;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		len = parse_hex(line, frag, sizeof(frag));
+		if (len <= FRAG_HDR_LEN || frag[2] == 0) {
+			continue;
+		}
+
+		s = &sessions[frag[0] & FRAG_SESSION_MASK];
+		session_add(s, frag, len);
+		session_recover(s, FRAG_PARITY_GROUP);
+
+		if (session_complete(s)) {
+			size_t out_len = session_output(s, out);
+
+			printf("Session %d, %zu bytes:", frag[0] & FRAG_SESSION_MASK, out_len);
+			for (size_t i = 0; i < out_len; i++)
+				printf(" %02x", out[i]);
+			printf("\n");
+			session_reset(s);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Sends one transfer over the simulated link and returns true if it was
+ * reassembled intact. Each frame is lost with loss_percent probability, and
+ * the frame numbered drop (in the order sent, -1 for none) always is.
+ */
+static bool bench_transfer(const uint8_t *data, int bytes, int dr, int group_size,
+			   int loss_percent, int drop, uint64_t *airtime)
+{
+	static uint8_t out[FRAG_MAX_FRAGMENTS * FRAG_MAX_PAYLOAD];
+	uint8_t frag[FRAG_MAX_PAYLOAD + FRAG_HDR_LEN];
+	uint8_t parity[FRAG_MAX_PAYLOAD] = { 0 };
+	struct frag_session *s = &sessions[0];
+	int frag_len = airtime_dr_max_payload(dr) - FRAG_HDR_LEN;
+	int count = (bytes + frag_len - 1) / frag_len;
+	int last_len = bytes - (count - 1) * frag_len;
+	int sent = 0;
+
+	session_reset(s);
+
+	for (int i = 0; i < count; i++) {
+		int this_len = (i == count - 1) ? last_len : frag_len;
+
+		frag[0] = FRAG_TYPE_DATA;
+		frag[1] = i;
+		frag[2] = count;
+		frag[3] = last_len;
+		memcpy(&frag[FRAG_HDR_LEN], &data[i * frag_len], this_len);
+		*airtime += airtime_dr_us(dr, FRAG_HDR_LEN + this_len);
+		if (sent++ != drop && rand() % 100 >= loss_percent) {
+			session_add(s, frag, FRAG_HDR_LEN + this_len);
+		}
+
+		if (group_size == 0) {
+			continue;
+		}
+		for (int j = 0; j < this_len; j++)
+			parity[j] ^= data[i * frag_len + j];
+		if ((i % group_size) == group_size - 1 || i == count - 1) {
+			frag[0] = FRAG_TYPE_PARITY;
+			frag[1] = i / group_size;
+			frag[2] = count;
+			frag[3] = last_len;
+			memcpy(&frag[FRAG_HDR_LEN], parity, frag_len);
+			*airtime += airtime_dr_us(dr, FRAG_HDR_LEN + frag_len);
+			if (sent++ != drop && rand() % 100 >= loss_percent) {
+				session_add(s, frag, FRAG_HDR_LEN + frag_len);
+			}
+			memset(parity, 0, sizeof(parity));
+		}
+	}
+
+	session_recover(s, group_size);
+	return session_complete(s) && session_output(s, out) == (size_t)bytes &&
+	       memcmp(out, data, bytes) == 0;
+}
+
+// Returns the percentage of transfers completed.
+static int bench_run(int bytes, int dr, int group_size, int loss_percent)
+{
+	static uint8_t data[FRAG_MAX_FRAGMENTS * FRAG_MAX_PAYLOAD];
+	uint64_t airtime = 0, delivered = 0;
+	int completed = 0;
+
+	for (int t = 0; t < BENCH_TRIALS; t++) {
+		for (int i = 0; i < bytes; i++)
+			data[i] = rand();
+		if (bench_transfer(data, bytes, dr, group_size, loss_percent, -1, &airtime)) {
+			completed++;
+			delivered += bytes;
+		}
+	}
+
+	printf("  loss %2d%%, %-10s: %3d%% complete, %7.1f bytes per airtime second\n",
+	       loss_percent, group_size ? "parity" : "no parity", completed * 100 / BENCH_TRIALS,
+	       airtime ? (double)delivered * 1000000.0 / airtime : 0.0);
+	return completed * 100 / BENCH_TRIALS;
+}
+
+/*
+ * Loses each frame of a transfer in turn, data and parity, at every
+ * datarate of the region. Parity must rebuild every one of them. Returns
+ * the number of failures.
+ */
+static int bench_single_loss(int bytes)
+{
+	static uint8_t data[FRAG_MAX_FRAGMENTS * FRAG_MAX_PAYLOAD];
+	uint64_t airtime = 0;
+	int failures = 0;
+
+	for (int i = 0; i < bytes; i++)
+		data[i] = rand();
+
+	for (int dr = 0; dr < airtime_dr_count(); dr++) {
+		int frag_len = airtime_dr_max_payload(dr) - FRAG_HDR_LEN;
+		int count = (bytes + frag_len - 1) / frag_len;
+		int frames = count + (count + FRAG_PARITY_GROUP - 1) / FRAG_PARITY_GROUP;
+
+		if (count > FRAG_MAX_FRAGMENTS) {
+			continue;
+		}
+		for (int drop = 0; drop < frames; drop++) {
+			if (!bench_transfer(data, bytes, dr, FRAG_PARITY_GROUP, 0, drop, &airtime)) {
+				printf("FAIL: DR_%d, %d fragments, frame %d lost and not recovered\n",
+				       dr, count, drop);
+				failures++;
+			}
+		}
+	}
+	return failures;
+}
+
+/*
+ * Fails (exit status 1) if parity stops rebuilding a single lost frame,
+ * if a lossless link doesn't deliver every transfer, or if parity completes
+ * fewer transfers than no parity at any loss rate.
+ */
+static int bench(int bytes, int dr)
+{
+	static const int losses[] = { 0, 1, 5, 10, 20 };
+	int frag_len = dr >= 0 ? airtime_dr_max_payload(dr) - FRAG_HDR_LEN : 0;
+	int failures = 0;
+	int plain, coded;
+
+	if (dr < 0 || dr >= airtime_dr_count() || frag_len <= 0 || bytes <= 0 ||
+	    (bytes + frag_len - 1) / frag_len > FRAG_MAX_FRAGMENTS) {
+		fprintf(stderr, "Invalid benchmark parameters\n");
+		return 1;
+	}
+
+	srand(1);
+	printf("Transfer of %d bytes at DR_%d, %d trials\n", bytes, dr, BENCH_TRIALS);
+	for (size_t i = 0; i < sizeof(losses) / sizeof(losses[0]); i++) {
+		plain = bench_run(bytes, dr, 0, losses[i]);
+		coded = bench_run(bytes, dr, FRAG_PARITY_GROUP, losses[i]);
+		if ((losses[i] == 0 && (plain != 100 || coded != 100)) || coded < plain) {
+			printf("FAIL: loss %d%%, parity %d%% complete, no parity %d%%\n", losses[i], coded, plain);
+			failures++;
+		}
+	}
+
+	if (FRAG_PARITY_GROUP != 0) {
+		failures += bench_single_loss(bytes);
+	}
+
+	printf("%s\n", failures ? "FAILED" : "OK");
+	return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		return bench(argc > 2 ? atoi(argv[2]) : 512, argc > 3 ? atoi(argv[3]) : 2);
+	}
+	return reassemble();
+}
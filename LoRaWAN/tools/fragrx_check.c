@@ -0,0 +1,388 @@
+/*
+ * Host side check of the data block receive session and reassembly
+ *
+ * Builds fragrx_session.c as used by the firmware and drives it as
+ * fragrx.c does, with an array standing in for the flash partition:
+ * command parsing, session setup checks, the received bitmap, least
+ * recently used eviction, the timeout, Status and Delete answers, and
+ * padded transfers sent with loss, reordering and repeated rounds:
+ *
+ *   cc -I../src -o fragrx_check fragrx_check.c ../src/fragrx_session.c
+ *   ./fragrx_check
+ *
+ * The exit status is 1 if any check fails.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "fragrx_session.h"
+
+#define PARTITION_SIZE          (64 * 1024)
+
+#define SIM_LOSS_PERCENT        5
+#define SIM_REORDER             8       // Fragments shuffled within this window
+#define SIM_ROUNDS              8       // Server repeats the whole set up to this often
+
+#define CHECK(cond) check(cond, #cond, __LINE__)
+
+static uint8_t flash[PARTITION_SIZE];
+static int failures;
+static int completions;
+
+static void check(bool ok, const char *what, int line)
+{
+	if (!ok) {
+		printf("FAIL line %d: %s\n", line, what);
+		failures++;
+	}
+}
+
+static uint32_t transfer_rand(void)
+{
+	static uint32_t state = 0x1234567;
+
+	// xorshift32, deterministic so runs are comparable
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static uint8_t pattern(uint32_t offset)
+{
+	return (uint8_t)((offset * 7) ^ (offset >> 8));
+}
+
+static void setup_req(uint8_t *req, uint8_t index, uint8_t groups, uint16_t nb_frag,
+		      uint8_t frag_size, uint8_t algo, uint8_t padding)
+{
+	req[0] = (index << 4) | groups;
+	req[1] = nb_frag & 0xFF;
+	req[2] = nb_frag >> 8;
+	req[3] = frag_size;
+	req[4] = algo << 3;
+	req[5] = padding;
+	req[6] = 0x00;
+	req[7] = 0x4D;
+	req[8] = 0x49;
+	req[9] = 0x53;
+}
+
+static bool start(uint16_t nb_frag, uint8_t frag_size, uint8_t padding)
+{
+	struct fragrx_session setup;
+	uint8_t req[FRAGRX_SETUP_REQ_LEN];
+
+	setup_req(req, 0, 0, nb_frag, frag_size, 0, padding);
+	if (fragrx_session_check(req, PARTITION_SIZE, &setup) != 0) {
+		return false;
+	}
+	memset(flash, 0xFF, sizeof(flash));
+	fragrx_session_start(&setup, 0);
+	return true;
+}
+
+static enum fragrx_frag_result send_frag(uint8_t index, uint16_t frag, uint8_t frag_size, int64_t now)
+{
+	uint8_t data[2 + UINT8_MAX];
+
+	data[0] = (frag + 1) & 0xFF;
+	data[1] = (index << 6) | ((frag + 1) >> 8);
+	for (int k = 0; k < frag_size; k++)
+		data[2 + k] = pattern((uint32_t)frag * frag_size + k);
+	return fragrx_session_fragment(data, 2 + frag_size, now);
+}
+
+// Writes completed blocks to the flash array, as fragrx_write_work_handler() does.
+static void write_blocks(void)
+{
+	struct fragrx_write write;
+	uint32_t len;
+
+	while (fragrx_session_next_write(&write)) {
+		len = (write.len + FRAGRX_WRITE_ALIGN - 1) / FRAGRX_WRITE_ALIGN * FRAGRX_WRITE_ALIGN;
+		CHECK(write.offset % FRAGRX_WRITE_ALIGN == 0);
+		CHECK(write.offset + len <= PARTITION_SIZE);
+		CHECK(len <= FRAGRX_BLOCK_SIZE);
+		// Flash can only clear bits, so each byte must be written once.
+		for (uint32_t i = 0; i < len; i++) {
+			CHECK(flash[write.offset + i] == 0xFF);
+			flash[write.offset + i] &= write.buf[i];
+		}
+		if (fragrx_session_written(&write, 0)) {
+			completions++;
+		}
+	}
+}
+
+static void check_commands(void)
+{
+	uint8_t frame[16] = { 0 };
+
+	frame[0] = FRAGRX_CMD_PACKAGE_VERSION;
+	CHECK(fragrx_command_len(frame, 5) == 1);
+	frame[0] = FRAGRX_CMD_SESSION_STATUS;
+	CHECK(fragrx_command_len(frame, 2) == 2);
+	CHECK(fragrx_command_len(frame, 1) == -EINVAL);
+	frame[0] = FRAGRX_CMD_SESSION_SETUP;
+	CHECK(fragrx_command_len(frame, 16) == 11);
+	CHECK(fragrx_command_len(frame, 10) == -EINVAL);
+	frame[0] = FRAGRX_CMD_SESSION_DELETE;
+	CHECK(fragrx_command_len(frame, 2) == 2);
+	frame[0] = FRAGRX_CMD_DATA_FRAGMENT;
+	CHECK(fragrx_command_len(frame, 16) == 16);
+	CHECK(fragrx_command_len(frame, 2) == -EINVAL);
+	frame[0] = 0x42;
+	CHECK(fragrx_command_len(frame, 16) == -ENOTSUP);
+	CHECK(fragrx_command_len(frame, 0) == -EINVAL);
+}
+
+static void check_setup(void)
+{
+	struct fragrx_session setup;
+	uint8_t req[FRAGRX_SETUP_REQ_LEN];
+
+	setup_req(req, 0, 0, 100, 50, 0, 7);
+	CHECK(fragrx_session_check(req, PARTITION_SIZE, &setup) == 0);
+	CHECK(setup.nb_frag == 100 && setup.frag_size == 50 && setup.padding == 7);
+	CHECK(setup.size == 100 * 50 - 7);
+	CHECK(setup.descriptor == 0x53494D00);
+	// 10 fragments of 50 bytes fit, 8 keep writes aligned
+	CHECK(setup.frags_per_block == 8);
+
+	setup_req(req, 0, 0, 100, 50, 1, 0);
+	CHECK(fragrx_session_check(req, PARTITION_SIZE, &setup) == FRAGRX_STATUS_ENCODING);
+
+	setup_req(req, 2, 0, 100, 50, 0, 0);
+	CHECK(fragrx_session_check(req, PARTITION_SIZE, &setup) == ((2 << 6) | FRAGRX_STATUS_INDEX));
+
+	// Multicast fed sessions are refused until McGroupSetup exists
+	setup_req(req, 0, 0x01, 100, 50, 0, 0);
+	CHECK(fragrx_session_check(req, PARTITION_SIZE, &setup) == FRAGRX_STATUS_INDEX);
+
+	setup_req(req, 0, 0, 0, 50, 0, 0);
+	CHECK(fragrx_session_check(req, PARTITION_SIZE, &setup) == FRAGRX_STATUS_MEMORY);
+	setup_req(req, 0, 0, FRAGRX_MAX_FRAGS + 1, 8, 0, 0);
+	CHECK(fragrx_session_check(req, PARTITION_SIZE, &setup) == FRAGRX_STATUS_MEMORY);
+	setup_req(req, 0, 0, 2000, 50, 0, 0);
+	CHECK(fragrx_session_check(req, PARTITION_SIZE, &setup) == FRAGRX_STATUS_MEMORY);
+	setup_req(req, 0, 0, 100, 50, 0, 50);
+	CHECK(fragrx_session_check(req, PARTITION_SIZE, &setup) == FRAGRX_STATUS_MEMORY);
+	setup_req(req, 0, 0, 100, 0, 0, 0);
+	CHECK(fragrx_session_check(req, PARTITION_SIZE, &setup) == FRAGRX_STATUS_MEMORY);
+
+	// No whole number of 242 byte fragments fits a buffer and keeps writes aligned
+	setup_req(req, 0, 0, 10, 242, 0, 0);
+	CHECK(fragrx_session_check(req, PARTITION_SIZE, &setup) == FRAGRX_STATUS_MEMORY);
+}
+
+static void check_fragments(void)
+{
+	const struct fragrx_stats *stats = fragrx_get_stats();
+	const struct fragrx_session *session = fragrx_session_get();
+	uint8_t data[2 + 16];
+
+	CHECK(start(20, 16, 0));
+	CHECK(send_frag(0, 0, 16, 1) == FRAGRX_FRAG_ACCEPTED);
+	CHECK(send_frag(0, 0, 16, 2) == FRAGRX_FRAG_DUPLICATE);
+	CHECK(send_frag(1, 1, 16, 3) == FRAGRX_FRAG_IGNORED);
+	CHECK(send_frag(0, 20, 16, 4) == FRAGRX_FRAG_CODED);
+	CHECK(send_frag(0, 1, 15, 5) == FRAGRX_FRAG_IGNORED);
+
+	// N of 0 isn't a fragment
+	memset(data, 0, sizeof(data));
+	CHECK(fragrx_session_fragment(data, sizeof(data), 6) == FRAGRX_FRAG_IGNORED);
+
+	CHECK(session->received == 1);
+	CHECK(stats->fragments == 3 && stats->duplicates == 1 && stats->coded == 1);
+	CHECK(stats->first_fragment == 1 && stats->last_fragment == 4);
+}
+
+static void check_eviction(void)
+{
+	const struct fragrx_stats *stats = fragrx_get_stats();
+	const struct fragrx_session *session = fragrx_session_get();
+	// 32 fragments of 16 bytes per block
+	uint8_t per_block;
+
+	CHECK(start(32 * 6, 16, 0));
+	per_block = session->frags_per_block;
+	CHECK(per_block == 32);
+
+	// First fragment of blocks 0 to 3 fills every buffer, then block 0 is used again.
+	for (int b = 0; b < FRAGRX_BLOCK_COUNT; b++)
+		CHECK(send_frag(0, b * per_block, 16, b) == FRAGRX_FRAG_ACCEPTED);
+	CHECK(send_frag(0, 1, 16, 10) == FRAGRX_FRAG_ACCEPTED);
+	CHECK(stats->blocks_in_use_max == FRAGRX_BLOCK_COUNT);
+
+	// Block 4 evicts block 1, the least recently used
+	CHECK(send_frag(0, 4 * per_block, 16, 11) == FRAGRX_FRAG_ACCEPTED);
+	CHECK(stats->evicted == 1);
+	CHECK(session->received == FRAGRX_BLOCK_COUNT + 2 - 1);
+
+	// Its fragment is accepted again, block 0's is still held
+	CHECK(send_frag(0, 0, 16, 12) == FRAGRX_FRAG_DUPLICATE);
+	CHECK(send_frag(0, 1 * per_block, 16, 13) == FRAGRX_FRAG_ACCEPTED);
+	CHECK(stats->evicted == 2);
+
+	// Completed blocks keep their buffers until written, and aren't evicted
+	CHECK(start(32 * 6, 16, 0));
+	for (int b = 0; b < FRAGRX_BLOCK_COUNT; b++) {
+		for (int i = 0; i < per_block; i++)
+			CHECK(send_frag(0, b * per_block + i, 16, 0) ==
+			      (i == per_block - 1 ? FRAGRX_FRAG_BLOCK_DONE : FRAGRX_FRAG_ACCEPTED));
+	}
+	CHECK(send_frag(0, 4 * per_block, 16, 0) == FRAGRX_FRAG_DROPPED);
+	CHECK(stats->dropped == 1 && stats->evicted == 0);
+	write_blocks();
+	CHECK(stats->blocks_written == FRAGRX_BLOCK_COUNT);
+	CHECK(send_frag(0, 4 * per_block, 16, 0) == FRAGRX_FRAG_ACCEPTED);
+}
+
+static void check_timeout(void)
+{
+	const struct fragrx_session *session = fragrx_session_get();
+	uint8_t req = 0x01;        // All participants, index 0
+	uint8_t ans[FRAGRX_STATUS_ANS_LEN];
+
+	CHECK(start(40, 16, 0));
+	CHECK(send_frag(0, 0, 16, 1000) == FRAGRX_FRAG_ACCEPTED);
+	CHECK(send_frag(0, 39, 16, 2000) == FRAGRX_FRAG_ACCEPTED);
+
+	CHECK(fragrx_session_timeout(2000 + FRAGRX_SESSION_TIMEOUT_MS - 1) == 0);
+	CHECK(session->active);
+	CHECK(fragrx_session_timeout(2000 + FRAGRX_SESSION_TIMEOUT_MS) == 2);
+	CHECK(!session->active);
+	CHECK(session->received == 0);
+	CHECK(send_frag(0, 1, 16, 3000) == FRAGRX_FRAG_IGNORED);
+
+	// Still defined, so Status answers until it is deleted
+	CHECK(fragrx_session_status(&req, ans) == FRAGRX_STATUS_ANS_LEN);
+	CHECK(ans[3] == 40);
+}
+
+static void check_status_delete(void)
+{
+	uint8_t ans[FRAGRX_STATUS_ANS_LEN];
+	uint8_t req, freed;
+
+	CHECK(start(10, 16, 0));
+	for (int i = 0; i < 6; i++)
+		send_frag(0, i, 16, 0);
+
+	// FragStatusReqParam: bit 0 all participants, bits 1-2 index
+	req = 0x01;
+	CHECK(fragrx_session_status(&req, ans) == FRAGRX_STATUS_ANS_LEN);
+	CHECK(ans[0] == FRAGRX_CMD_SESSION_STATUS);
+	CHECK((ans[1] | (ans[2] << 8)) == 6);
+	CHECK(ans[3] == 4 && ans[4] == 0);
+
+	req = 0x01 | (1 << 1);
+	CHECK(fragrx_session_status(&req, ans) == 0);
+
+	// Only devices still missing fragments answer without the all bit
+	req = 0x00;
+	CHECK(fragrx_session_status(&req, ans) == FRAGRX_STATUS_ANS_LEN);
+	for (int i = 6; i < 10; i++)
+		send_frag(0, i, 16, 0);
+	CHECK(fragrx_session_status(&req, ans) == 0);
+
+	req = 2;
+	CHECK(fragrx_session_delete(&req, ans, &freed) == FRAGRX_DELETE_ANS_LEN);
+	CHECK(ans[0] == FRAGRX_CMD_SESSION_DELETE && ans[1] == (2 | FRAGRX_STATUS_NO_SESSION));
+	CHECK(freed == 0);
+
+	req = 0;
+	CHECK(fragrx_session_delete(&req, ans, &freed) == FRAGRX_DELETE_ANS_LEN);
+	CHECK(ans[1] == 0);
+	CHECK(freed == 1);
+	CHECK(!fragrx_session_get()->defined);
+	CHECK(send_frag(0, 0, 16, 0) == FRAGRX_FRAG_IGNORED);
+
+	req = 0x01;
+	CHECK(fragrx_session_status(&req, ans) == 0);
+	req = 0;
+	CHECK(fragrx_session_delete(&req, ans, &freed) == FRAGRX_DELETE_ANS_LEN);
+	CHECK(ans[1] == FRAGRX_STATUS_NO_SESSION);
+}
+
+static void check_transfer(uint16_t nb_frag, uint8_t frag_size, uint8_t padding)
+{
+	static uint16_t order[FRAGRX_MAX_FRAGS];
+	const struct fragrx_stats *stats = fragrx_get_stats();
+	const struct fragrx_session *session = fragrx_session_get();
+	uint32_t size = (uint32_t)nb_frag * frag_size - padding;
+	uint32_t sent = 0, mismatches = 0;
+	uint16_t tmp;
+	int round, j;
+
+	completions = 0;
+	CHECK(start(nb_frag, frag_size, padding));
+
+	for (round = 0; round < SIM_ROUNDS && session->received < nb_frag; round++) {
+		// Server sends in order, the air and network reorder within a window.
+		for (int i = 0; i < nb_frag; i++)
+			order[i] = i;
+		for (int i = 0; i < nb_frag; i++) {
+			j = i + transfer_rand() % SIM_REORDER;
+			j = j < nb_frag ? j : nb_frag - 1;
+			tmp = order[i];
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+
+		for (int i = 0; i < nb_frag; i++) {
+			if (transfer_rand() % 100 < SIM_LOSS_PERCENT) {
+				continue;
+			}
+			send_frag(0, order[i], frag_size, sent++);
+			// Blocks are written between downlinks, but not after every one.
+			if (transfer_rand() % 4 == 0) {
+				write_blocks();
+			}
+		}
+		write_blocks();
+	}
+
+	for (uint32_t i = 0; i < size; i++)
+		mismatches += flash[i] != pattern(i);
+	// Padding isn't data, so isn't written
+	for (uint32_t i = size; i < (uint32_t)nb_frag * frag_size; i++)
+		mismatches += flash[i] != 0xFF;
+
+	printf("%4d fragments of %3d bytes, padding %2d: %u sent in %d rounds, evicted %u, dropped %u, peak buffers %d, %u bytes differ\n",
+		nb_frag, frag_size, padding, sent, round, stats->evicted, stats->dropped,
+		stats->blocks_in_use_max, mismatches);
+
+	CHECK(session->received == nb_frag);
+	CHECK(completions == 1);
+	CHECK(!session->active);
+	CHECK(stats->bytes_written == size);
+	CHECK(mismatches == 0);
+}
+
+int main(void)
+{
+	check_commands();
+	check_setup();
+	check_fragments();
+	check_eviction();
+	check_timeout();
+	check_status_delete();
+	check_transfer(512, 48, 0);
+	check_transfer(300, 50, 13);
+	check_transfer(1000, 51, 1);
+	check_transfer(7, 200, 100);
+
+	printf("%s\n", failures ? "FAILED" : "OK");
+	return failures ? 1 : 0;
+}
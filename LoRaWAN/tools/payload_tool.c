@@ -0,0 +1,456 @@
+
+/*
+ * Host side tool for the bit-packed uplink payload
+ *
+ * Built from the same schema, payload.c and leap second table as the
+ * firmware (see CMakeLists.txt, which also regenerates formatter.js):
+ *
+ *   cc -I../src -I../../common/src -o payload_tool payload_tool.c ../src/payload.c
+ *
+ *   ./payload_tool < uplinks.txt    Decode payloads given as hex, one per line
+ *   ./payload_tool -j > fmt.js      Print a TTN uplink payload formatter
+ *   ./payload_tool -t [frames]      Round-trip random frames through the
+ *                                   encoder and decoder, exit 1 on mismatch
+ *   ./payload_tool -g [frames]      Print random frames as hex, one per line
+ *   ./payload_tool -J < uplinks.txt Decode to JSON shaped like the formatter's
+ *                                   output (see formatter_check.js)
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "schema.h"
+#include "payload.h"
+#include "clock.h"
+#include "leap_seconds.h"
+
+#define MAX_LINE        1024
+
+#define TOOL_X_LEAP(gps_time, offset) printf("  [%u, %u],\n", gps_time, offset);
+#define TOOL_X_LEAP_ENTRY(gps_time, offset) { gps_time, offset },
+
+static const char *stat_names[PAYLOAD_STAT_COUNT] = { "min", "max", "mean", "stddev" };
+
+static int parse_hex(const char *line, uint8_t *buf, int max_len)
+{
+	int len = 0;
+	unsigned int byte;
+
+	while (*line && len < max_len) {
+		while (*line == ' ' || *line == '\t') {
+			line++;
+		}
+		if (sscanf(line, "%2x", &byte) != 1) {
+			break;
+		}
+		buf[len++] = byte;
+		line += 2;
+	}
+	return len;
+}
+
+static void print_frame(const struct payload_frame *frame)
+{
+	const struct payload_field *f;
+	const struct payload_record *rec;
+	uint32_t offset = 0;
+
+	printf("%d records, base time %u (%s)%s\n", frame->count, frame->base_time,
+	       frame->flags & PAYLOAD_FLAG_GPS_TIME ? "GPS" : "seconds before transmission",
+	       frame->flags & PAYLOAD_FLAG_MEANS_ONLY ? ", means only" : "");
+
+	for (int r = 0; r < frame->count; r++) {
+		rec = &frame->records[r];
+		offset += rec->delta;
+		printf("  +%us", offset);
+		if (!(frame->flags & PAYLOAD_FLAG_MEANS_ONLY)) {
+			printf(" %d samples", rec->samples);
+		}
+		for (int i = 0; i < PAYLOAD_FIELD_COUNT; i++) {
+			f = &payload_fields[i];
+			if (f->extended && !(frame->flags & PAYLOAD_FLAG_EXTENDED)) {
+				continue;
+			}
+			printf(", %s", f->name);
+			if (!(rec->valid & PAYLOAD_FIELD_BIT(i))) {
+				printf(" no reading");
+				continue;
+			}
+			for (int s = 0; s < PAYLOAD_STAT_COUNT; s++) {
+				if ((frame->flags & PAYLOAD_FLAG_MEANS_ONLY) && s != PAYLOAD_MEAN) {
+					continue;
+				}
+				printf(" %s %.2f", stat_names[s], (double)rec->stats[i][s] / f->scale);
+			}
+			printf(" %s", f->unit);
+		}
+		printf("\n");
+	}
+}
+
+static int decode(void)
+{
+	static struct payload_frame frame;
+	char line[MAX_LINE];
+	uint8_t buf[256];
+	int len;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		len = parse_hex(line, buf, sizeof(buf));
+		if (len == 0) {
+			continue;
+		}
+		if (payload_decode(buf, len, &frame) < 0) {
+			printf("Invalid %d byte frame\n", len);
+			continue;
+		}
+		print_frame(&frame);
+	}
+	return 0;
+}
+
+static uint64_t gps_to_unix(uint64_t gps)
+{
+	static const uint32_t table[][2] = { LEAP_SECONDS_TABLE(TOOL_X_LEAP_ENTRY) };
+	uint32_t leap = 0;
+
+	for (size_t i = 0; i < sizeof(table) / sizeof(table[0]) && gps >= table[i][0]; i++) {
+		leap = table[i][1];
+	}
+	return CLOCK_GPS_UNIX_OFFSET + gps - leap;
+}
+
+// Same shape and arithmetic as decodeUplink() in the formatter, so the two
+// can be compared value for value. Offsets are not wrapped at 32 bits, as
+// JavaScript numbers are not.
+static void print_json(const struct payload_frame *frame)
+{
+	const struct payload_field *f;
+	const struct payload_record *rec;
+	bool means_only = frame->flags & PAYLOAD_FLAG_MEANS_ONLY;
+	uint64_t offset = 0;
+	char iso[32];
+	time_t t;
+
+	printf("{\"data\":{\"records\":[");
+	for (int r = 0; r < frame->count; r++) {
+		rec = &frame->records[r];
+		offset += rec->delta;
+		printf("%s{", r ? "," : "");
+		if (frame->flags & PAYLOAD_FLAG_GPS_TIME) {
+			t = gps_to_unix(frame->base_time + offset);
+			strftime(iso, sizeof(iso), "%Y-%m-%dT%H:%M:%S.000Z", gmtime(&t));
+			printf("\"time\":\"%s\"", iso);
+		} else {
+			printf("\"secondsBeforeUplink\":%lld", (long long)frame->base_time - (long long)offset);
+		}
+		if (!means_only) {
+			printf(",\"samples\":%d", rec->samples);
+		}
+		for (int i = 0; i < PAYLOAD_FIELD_COUNT; i++) {
+			f = &payload_fields[i];
+			if (f->extended && !(frame->flags & PAYLOAD_FLAG_EXTENDED)) {
+				continue;
+			}
+			printf(",\"%s\":", f->name);
+			if (!(rec->valid & PAYLOAD_FIELD_BIT(i))) {
+				printf("null");
+			} else if (means_only) {
+				printf("%.17g", (double)rec->stats[i][PAYLOAD_MEAN] / f->scale);
+			} else {
+				printf("{");
+				for (int s = 0; s < PAYLOAD_STAT_COUNT; s++) {
+					printf("\"%s\":%.17g,", stat_names[s], (double)rec->stats[i][s] / f->scale);
+				}
+				printf("\"unit\":\"%s\"}", f->unit);
+			}
+		}
+		printf("}");
+	}
+	printf("]}}\n");
+}
+
+static int decode_json(void)
+{
+	static struct payload_frame frame;
+	char line[MAX_LINE];
+	uint8_t buf[256];
+	int len;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		len = parse_hex(line, buf, sizeof(buf));
+		if (len == 0) {
+			continue;
+		}
+		if (payload_decode(buf, len, &frame) < 0) {
+			printf("{\"errors\":[\"invalid %d byte frame\"]}\n", len);
+			continue;
+		}
+		print_json(&frame);
+	}
+	return 0;
+}
+
+static void print_formatter(void)
+{
+	const struct payload_field *f;
+
+	printf("// Generated by payload_tool -j from LoRaWAN/src/schema.h, do not edit.\n");
+	printf("var FIELDS = [\n");
+	for (int i = 0; i < PAYLOAD_FIELD_COUNT; i++) {
+		f = &payload_fields[i];
+		printf("  { name: \"%s\", unit: \"%s\", scale: %d, offset: %d, bits: %d, stddevBits: %d, extended: %s },\n",
+		       f->name, f->unit, f->scale, f->offset, f->bits, f->stddev_bits, f->extended ? "true" : "false");
+	}
+	printf("];\n\n");
+
+	// Same table as the firmware clock, so GPS timestamps convert the same way.
+	printf("// GPS time each leap second took effect, and GPS - UTC from then on\n");
+	printf("var LEAP_SECONDS = [\n");
+	LEAP_SECONDS_TABLE(TOOL_X_LEAP)
+	printf("];\n\n");
+
+	printf(
+"function gpsToUnix(gps) {\n"
+"  var leap = 0;\n"
+"  for (var i = 0; i < LEAP_SECONDS.length && gps >= LEAP_SECONDS[i][0]; i++) {\n"
+"    leap = LEAP_SECONDS[i][1];\n"
+"  }\n"
+"  return %d + gps - leap;\n"
+"}\n"
+"\n"
+"function decodeUplink(input) {\n"
+"  var bytes = input.bytes;\n"
+"  var pos = %d * 8;\n"
+"\n"
+"  function get(bits) {\n"
+"    var value = 0;\n"
+"    for (var i = 0; i < bits; i++, pos++) {\n"
+"      if ((pos >> 3) >= bytes.length) throw \"truncated frame\";\n"
+"      value = value * 2 + ((bytes[pos >> 3] >> (7 - (pos & 7))) & 1);\n"
+"    }\n"
+"    return value;\n"
+"  }\n"
+"\n"
+"  if (bytes.length < %d) return { errors: [\"frame too short\"] };\n"
+"  var gps = (bytes[0] & 0x%02x) !== 0;\n"
+"  var meansOnly = (bytes[0] & 0x%02x) !== 0;\n"
+"  var extended = (bytes[0] & 0x%02x) !== 0;\n"
+"  var count = bytes[0] & 0x%02x;\n"
+"  var base = (bytes[1] | (bytes[2] << 8) | (bytes[3] << 16) | (bytes[4] << 24)) >>> 0;\n"
+"  var records = [];\n"
+"  var offset = 0;\n"
+"\n"
+"  try {\n"
+"    for (var r = 0; r < count; r++) {\n"
+"      if (r > 0) {\n"
+"        var group, shift = 0;\n"
+"        do {\n"
+"          group = get(8);\n"
+"          offset += (group & 0x7f) * Math.pow(2, shift);\n"
+"          shift += 7;\n"
+"        } while (group & 0x80);\n"
+"      }\n"
+"      var rec = {};\n"
+"      if (gps) {\n"
+"        rec.time = new Date(gpsToUnix(base + offset) * 1000).toISOString();\n"
+"      } else {\n"
+"        rec.secondsBeforeUplink = base - offset;\n"
+"      }\n"
+"      if (!meansOnly) rec.samples = get(%d);\n"
+"      for (var i = 0; i < FIELDS.length; i++) {\n"
+"        var f = FIELDS[i];\n"
+"        if (f.extended && !extended) continue;\n"
+"        // Every bit of a value set marks a field with no reading.\n"
+"        var invalid = Math.pow(2, f.bits) - 1;\n"
+"        if (meansOnly) {\n"
+"          var mean = get(f.bits);\n"
+"          rec[f.name] = mean === invalid ? null : (mean + f.offset) / f.scale;\n"
+"          continue;\n"
+"        }\n"
+"        var min = get(f.bits), max = get(f.bits), mean = get(f.bits), stddev = get(f.stddevBits);\n"
+"        rec[f.name] = mean === invalid ? null : {\n"
+"          min: (min + f.offset) / f.scale,\n"
+"          max: (max + f.offset) / f.scale,\n"
+"          mean: (mean + f.offset) / f.scale,\n"
+"          stddev: stddev / f.scale,\n"
+"          unit: f.unit\n"
+"        };\n"
+"      }\n"
+"      records.push(rec);\n"
+"    }\n"
+"  } catch (e) {\n"
+"    return { errors: [String(e)] };\n"
+"  }\n"
+"\n"
+"  return { data: { records: records } };\n"
+"}\n",
+	       CLOCK_GPS_UNIX_OFFSET, PAYLOAD_HDR_LEN, PAYLOAD_HDR_LEN, PAYLOAD_FLAG_GPS_TIME,
+	       PAYLOAD_FLAG_MEANS_ONLY, PAYLOAD_FLAG_EXTENDED, PAYLOAD_COUNT_MASK, PAYLOAD_SAMPLES_BITS);
+}
+
+static int32_t random_in(int32_t min, int32_t max)
+{
+	return min + rand() % (max - min + 1);
+}
+
+// Encodes random records into buf until max_len is reached, keeping a copy in frame.
+static int random_frame(struct payload_frame *frame, uint8_t *buf, uint8_t max_len)
+{
+	const struct payload_field *f;
+	struct payload_writer w;
+	uint8_t flags = rand() & (PAYLOAD_FLAG_GPS_TIME | PAYLOAD_FLAG_MEANS_ONLY | PAYLOAD_FLAG_EXTENDED);
+
+	memset(frame, 0, sizeof(*frame));
+	payload_start(&w, buf, max_len, flags, rand());
+	for (int r = 0; r < PAYLOAD_COUNT_MASK; r++) {
+		struct payload_record *rec = &frame->records[r];
+
+		rec->delta = r == 0 ? 0 : (rand() % 4 ? (uint32_t)random_in(0, 4000) : (uint32_t)rand());
+		rec->samples = flags & PAYLOAD_FLAG_MEANS_ONLY ? 0 : rand();
+		for (int i = 0; i < PAYLOAD_FIELD_COUNT; i++) {
+			f = &payload_fields[i];
+			// Fields with no reading in about one record in eight
+			if ((f->extended && !(flags & PAYLOAD_FLAG_EXTENDED)) || rand() % 8 == 0) {
+				continue;
+			}
+			rec->valid |= PAYLOAD_FIELD_BIT(i);
+			for (int s = PAYLOAD_MIN; s <= PAYLOAD_MEAN; s++) {
+				if (!(flags & PAYLOAD_FLAG_MEANS_ONLY) || s == PAYLOAD_MEAN) {
+					rec->stats[i][s] = random_in(f->offset, f->offset + PAYLOAD_INVALID(f->bits) - 1);
+				}
+			}
+			if (!(flags & PAYLOAD_FLAG_MEANS_ONLY)) {
+				rec->stats[i][PAYLOAD_STDDEV] = random_in(0, PAYLOAD_INVALID(f->stddev_bits) - 1);
+			}
+		}
+		if (!payload_add(&w, rec)) {
+			break;
+		}
+		frame->count++;
+	}
+	frame->flags = flags;
+	return payload_finish(&w);
+}
+
+// Prints random frames as hex for the formatter comparison, one in ten cut short.
+static int generate(int frames)
+{
+	static struct payload_frame frame;
+	uint8_t buf[255];
+	int len;
+
+	srand(2);
+	for (int n = 0; n < frames; n++) {
+		len = random_frame(&frame, buf, random_in(11, 242));
+		if (rand() % 10 == 0) {
+			len--;
+		}
+		for (int i = 0; i < len; i++) {
+			printf("%02x", buf[i]);
+		}
+		printf("\n");
+	}
+	return 0;
+}
+
+static int test(int frames)
+{
+	static struct payload_frame in, out;
+	struct payload_writer w;
+	const struct payload_field *f;
+	uint8_t buf[255];
+	int len, failures = 0;
+	uint32_t bytes = 0, records = 0;
+
+	srand(1);
+	for (int n = 0; n < frames; n++) {
+		uint8_t max_len = random_in(11, 242);
+
+		len = random_frame(&in, buf, max_len);
+		bytes += len;
+		records += in.count;
+
+		if (len > max_len || payload_decode(buf, len, &out) < 0 || out.count != in.count ||
+		    memcmp(in.records, out.records, in.count * sizeof(in.records[0])) != 0) {
+			printf("Frame %d: mismatch (flags 0x%02x, %d records, %d bytes)\n", n, in.flags, in.count, len);
+			failures++;
+		}
+	}
+
+	// Out of range values saturate rather than wrap, and stay clear of the invalid marker.
+	memset(&in, 0, sizeof(in));
+	for (int i = 0; i < PAYLOAD_FIELD_COUNT; i++) {
+		f = &payload_fields[i];
+		in.records[0].valid |= PAYLOAD_FIELD_BIT(i);
+		in.records[0].stats[i][PAYLOAD_MIN] = f->offset - 1000;
+		in.records[0].stats[i][PAYLOAD_MAX] = f->offset + (1 << f->bits) + 1000;
+		in.records[0].stats[i][PAYLOAD_MEAN] = f->offset + PAYLOAD_INVALID(f->bits);
+		in.records[0].stats[i][PAYLOAD_STDDEV] = (1 << f->stddev_bits) + 1000;
+	}
+	payload_start(&w, buf, sizeof(buf), PAYLOAD_FLAG_EXTENDED, 0);
+	payload_add(&w, &in.records[0]);
+	payload_decode(buf, payload_finish(&w), &out);
+	for (int i = 0; i < PAYLOAD_FIELD_COUNT; i++) {
+		f = &payload_fields[i];
+		if (!(out.records[0].valid & PAYLOAD_FIELD_BIT(i)) ||
+		    out.records[0].stats[i][PAYLOAD_MIN] != f->offset ||
+		    out.records[0].stats[i][PAYLOAD_MAX] != f->offset + (int32_t)PAYLOAD_INVALID(f->bits) - 1 ||
+		    out.records[0].stats[i][PAYLOAD_MEAN] != f->offset + (int32_t)PAYLOAD_INVALID(f->bits) - 1 ||
+		    out.records[0].stats[i][PAYLOAD_STDDEV] != (int32_t)PAYLOAD_INVALID(f->stddev_bits) - 1) {
+			printf("Field %s: out of range values not saturated\n", f->name);
+			failures++;
+		}
+	}
+
+	// Fields with no reading decode as invalid, whatever their statistics held.
+	memset(&in, 0, sizeof(in));
+	in.records[0].valid = PAYLOAD_FIELD_BIT(PAYLOAD_HUMIDITY);
+	for (int i = 0; i < PAYLOAD_FIELD_COUNT; i++) {
+		in.records[0].stats[i][PAYLOAD_MEAN] = 123;
+	}
+	for (int flags = 0; flags <= PAYLOAD_FLAG_MEANS_ONLY; flags += PAYLOAD_FLAG_MEANS_ONLY) {
+		payload_start(&w, buf, sizeof(buf), flags | PAYLOAD_FLAG_EXTENDED, 0);
+		payload_add(&w, &in.records[0]);
+		payload_decode(buf, payload_finish(&w), &out);
+		if (out.records[0].valid != PAYLOAD_FIELD_BIT(PAYLOAD_HUMIDITY) ||
+		    out.records[0].stats[PAYLOAD_HUMIDITY][PAYLOAD_MEAN] != 123 ||
+		    out.records[0].stats[PAYLOAD_TEMPERATURE][PAYLOAD_MEAN] != 0) {
+			printf("Flags 0x%02x: fields with no reading not marked invalid\n", flags);
+			failures++;
+		}
+	}
+
+	printf("Record bits: %d (means only %d), extended %d (means only %d)\n",
+	       PAYLOAD_BASE_STATS_BITS, PAYLOAD_BASE_MEANS_BITS,
+	       PAYLOAD_BASE_STATS_BITS + PAYLOAD_EXT_STATS_BITS,
+	       PAYLOAD_BASE_MEANS_BITS + PAYLOAD_EXT_MEANS_BITS);
+	printf("%d frames, %u records in %u bytes, %d failures\n", frames, records, bytes, failures);
+	return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "-j") == 0) {
+		print_formatter();
+		return 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "-t") == 0) {
+		return test(argc > 2 ? atoi(argv[2]) : 10000);
+	}
+	if (argc > 1 && strcmp(argv[1], "-g") == 0) {
+		return generate(argc > 2 ? atoi(argv[2]) : 1000);
+	}
+	if (argc > 1 && strcmp(argv[1], "-J") == 0) {
+		return decode_json();
+	}
+	return decode();
+}
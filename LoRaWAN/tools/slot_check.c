@@ -0,0 +1,208 @@
+/*
+ * Host side check of the uplink slot calculations
+ *
+ * Builds slot_calc.c as used by the firmware, checks the offset, wait and
+ * jitter arithmetic at the period boundaries, then simulates a fleet that
+ * boots together after a power cut and counts colliding uplinks with a
+ * fixed delay, random jitter and slotting:
+ *
+ *   cc -I../src -o slot_check slot_check.c ../src/slot_calc.c
+ *   ./slot_check
+ *
+ * The exit status is 1 if any check fails, including slotting not
+ * colliding less often than jitter, and jitter less than a fixed delay.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "slot_calc.h"
+
+#define PERIOD_MS               (600 * 1000)
+
+#define FLEET_NODES             100
+#define FLEET_PERIODS           50
+#define FLEET_AIRTIME_MS        400
+#define FLEET_BOOT_SPREAD_MS    3000
+#define FLEET_SYNC_ERROR_MS     1000
+
+#define CHECK(cond) check(cond, #cond, __LINE__)
+
+enum fleet_mode {
+	FLEET_FIXED_DELAY,
+	FLEET_JITTER,
+	FLEET_SLOTTED,
+	FLEET_MODE_COUNT
+};
+
+static const char *const fleet_mode_name[] = { "fixed delay", "random jitter", "slotted" };
+
+static int failures;
+
+static void check(bool ok, const char *what, int line)
+{
+	if (!ok) {
+		printf("FAIL line %d: %s\n", line, what);
+		failures++;
+	}
+}
+
+static uint32_t fleet_rand(void)
+{
+	static uint32_t state = 0xC0FFEE;
+
+	// xorshift32, deterministic so runs are comparable
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static void fleet_eui(uint8_t dev_eui[8], int n)
+{
+	static const uint8_t prefix[6] = { 0x70, 0xB3, 0xD5, 0x7E, 0xD0, 0x00 };
+
+	for (int i = 0; i < 6; i++)
+		dev_eui[i] = prefix[i];
+	dev_eui[6] = n >> 8;
+	dev_eui[7] = n & 0xFF;
+}
+
+static void check_offset(void)
+{
+	uint8_t a[8], b[8];
+
+	fleet_eui(a, 1);
+	fleet_eui(b, 2);
+
+	CHECK(slot_hash_eui(a) == slot_hash_eui(a));
+	CHECK(slot_hash_eui(a) != slot_hash_eui(b));
+	CHECK(slot_offset_ms(slot_hash_eui(a), PERIOD_MS) < PERIOD_MS);
+	CHECK(slot_offset_ms(UINT32_MAX, PERIOD_MS) == UINT32_MAX % PERIOD_MS);
+	CHECK(slot_offset_ms(1234, 0) == 0);
+}
+
+static void check_wait(void)
+{
+	uint64_t epoch = (uint64_t)1000000 * PERIOD_MS;
+
+	// Slot ahead in this period
+	CHECK(slot_wait_ms(100000, PERIOD_MS, epoch) == 100000);
+	CHECK(slot_wait_ms(100000, PERIOD_MS, epoch + 40000) == 60000);
+
+	// Slot already passed, wait into the next period
+	CHECK(slot_wait_ms(100000, PERIOD_MS, epoch + 100001) == PERIOD_MS - 1);
+
+	// Exactly on the slot, or closer than the minimum gap, skips a period
+	CHECK(slot_wait_ms(100000, PERIOD_MS, epoch + 100000) == PERIOD_MS);
+	CHECK(slot_wait_ms(100000, PERIOD_MS, epoch + 100000 - SLOT_MIN_GAP_MS + 1) ==
+	      PERIOD_MS + SLOT_MIN_GAP_MS - 1);
+	CHECK(slot_wait_ms(100000, PERIOD_MS, epoch + 100000 - SLOT_MIN_GAP_MS) == SLOT_MIN_GAP_MS);
+
+	// Slot at the end of the period, time at the start
+	CHECK(slot_wait_ms(PERIOD_MS - 1, PERIOD_MS, epoch) == PERIOD_MS - 1);
+
+	// Always lands on the slot
+	for (uint64_t t = epoch; t < epoch + 2 * PERIOD_MS; t += 7919) {
+		uint32_t wait = slot_wait_ms(123456, PERIOD_MS, t);
+
+		CHECK((t + wait) % PERIOD_MS == 123456);
+		CHECK(wait >= SLOT_MIN_GAP_MS && wait < PERIOD_MS + SLOT_MIN_GAP_MS);
+	}
+}
+
+static void check_jitter(void)
+{
+	uint32_t jitter_ms = PERIOD_MS * SLOT_JITTER_PERCENT / 100;
+	uint32_t wait;
+
+	CHECK(slot_jitter_wait_ms(PERIOD_MS, 0) == PERIOD_MS - jitter_ms);
+	CHECK(slot_jitter_wait_ms(PERIOD_MS, 2 * jitter_ms) == PERIOD_MS + jitter_ms);
+	CHECK(slot_jitter_wait_ms(PERIOD_MS, 2 * jitter_ms + 1) == PERIOD_MS - jitter_ms);
+
+	for (int i = 0; i < 10000; i++) {
+		wait = slot_jitter_wait_ms(PERIOD_MS, fleet_rand());
+		CHECK(wait >= PERIOD_MS - jitter_ms && wait <= PERIOD_MS + jitter_ms);
+	}
+
+	// Long periods don't overflow the percentage
+	CHECK(slot_jitter_wait_ms(UINT32_MAX / 2, 0) == UINT32_MAX / 2 - (uint32_t)((uint64_t)(UINT32_MAX / 2) * SLOT_JITTER_PERCENT / 100));
+}
+
+static uint32_t fleet_collisions(enum fleet_mode mode)
+{
+	static int64_t tx_ms[FLEET_NODES];
+	static uint32_t node_offset[FLEET_NODES];
+	uint32_t collisions = 0, total = 0;
+	uint8_t dev_eui[8];
+
+	for (int n = 0; n < FLEET_NODES; n++) {
+		fleet_eui(dev_eui, n);
+		node_offset[n] = slot_offset_ms(slot_hash_eui(dev_eui), PERIOD_MS);
+		// Power restored, every node boots and joins at about the same time.
+		tx_ms[n] = fleet_rand() % FLEET_BOOT_SPREAD_MS;
+	}
+
+	for (int p = 1; p <= FLEET_PERIODS; p++) {
+		for (int n = 0; n < FLEET_NODES; n++) {
+			int32_t sync_error = (int32_t)(fleet_rand() % (2 * FLEET_SYNC_ERROR_MS + 1)) - FLEET_SYNC_ERROR_MS;
+
+			switch (mode) {
+			case FLEET_FIXED_DELAY:
+				tx_ms[n] += PERIOD_MS;
+				break;
+			case FLEET_JITTER:
+				tx_ms[n] += slot_jitter_wait_ms(PERIOD_MS, fleet_rand());
+				break;
+			default:
+				// Network time is only known to within FLEET_SYNC_ERROR_MS.
+				tx_ms[n] += slot_wait_ms(node_offset[n], PERIOD_MS, tx_ms[n] + sync_error);
+				break;
+			}
+		}
+
+		for (int n = 0; n < FLEET_NODES; n++) {
+			for (int m = 0; m < FLEET_NODES; m++) {
+				if (m != n && llabs(tx_ms[n] - tx_ms[m]) < FLEET_AIRTIME_MS) {
+					collisions++;
+					break;
+				}
+			}
+			total++;
+		}
+	}
+
+	printf("%-14s: %u of %u uplinks collided (%u.%u%%)\n", fleet_mode_name[mode], collisions, total,
+		(collisions * 100) / total, ((collisions * 1000) / total) % 10);
+	return collisions;
+}
+
+static void check_fleet(void)
+{
+	uint32_t collisions[FLEET_MODE_COUNT];
+
+	printf("Fleet: %d nodes, %d periods of %ds, %dms airtime\n",
+		FLEET_NODES, FLEET_PERIODS, PERIOD_MS / 1000, FLEET_AIRTIME_MS);
+	for (int mode = 0; mode < FLEET_MODE_COUNT; mode++)
+		collisions[mode] = fleet_collisions(mode);
+
+	CHECK(collisions[FLEET_JITTER] < collisions[FLEET_FIXED_DELAY]);
+	CHECK(collisions[FLEET_SLOTTED] < collisions[FLEET_JITTER]);
+}
+
+int main(void)
+{
+	check_offset();
+	check_wait();
+	check_jitter();
+	check_fleet();
+
+	printf("%s\n", failures ? "FAILED" : "OK");
+	return failures ? 1 : 0;
+}
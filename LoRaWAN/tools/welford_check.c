@@ -0,0 +1,107 @@
+
+/*
+ * Host side check of the fixed point aggregation statistics
+ *
+ * Feeds each trace file (one reading per line in schema units, # starts a
+ * comment) through welford.c as built for the firmware, and compares the
+ * mean and standard deviation with a double precision calculation:
+ *
+ *   cc -I../src -o welford_check welford_check.c ../src/welford.c -lm
+ *   ./welford_check traces/[a-z]*.txt
+ *
+ * A result is reported as failing when it is off by more than half a count
+ * (plus WELFORD_CHECK_SLACK for the truncation in the running sums), and
+ * the exit status is 1 if any trace fails.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "welford.h"
+
+#define MAX_LINE                128
+#define MAX_SAMPLES             UINT16_MAX
+#define WELFORD_CHECK_SLACK     0.01
+
+static int32_t samples[MAX_SAMPLES];
+
+static bool check_trace(const char *path)
+{
+	char line[MAX_LINE];
+	struct welford w;
+	int32_t stats[AGG_STAT_COUNT];
+	double sum = 0, sq = 0, mean, stddev, mean_err, stddev_err;
+	int32_t min, max;
+	size_t n = 0;
+	bool ok;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return false;
+	}
+
+	welford_reset(&w);
+	while (fgets(line, sizeof(line), f) && n < MAX_SAMPLES) {
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+		samples[n] = strtol(line, NULL, 10);
+		welford_add(&w, samples[n]);
+		n++;
+	}
+	fclose(f);
+
+	if (n == 0) {
+		printf("%s: no readings\n", path);
+		return false;
+	}
+
+	// Two pass reference
+	min = max = samples[0];
+	for (size_t i = 0; i < n; i++) {
+		sum += samples[i];
+		min = samples[i] < min ? samples[i] : min;
+		max = samples[i] > max ? samples[i] : max;
+	}
+	mean = sum / n;
+	for (size_t i = 0; i < n; i++) {
+		sq += (samples[i] - mean) * (samples[i] - mean);
+	}
+	stddev = n > 1 ? sqrt(sq / (n - 1)) : 0;
+
+	welford_summarise(&w, stats);
+	mean_err = fabs(stats[AGG_MEAN] - mean);
+	stddev_err = fabs(stats[AGG_STDDEV] - stddev);
+	ok = stats[AGG_MIN] == min && stats[AGG_MAX] == max &&
+	     mean_err <= 0.5 + WELFORD_CHECK_SLACK && stddev_err <= 0.5 + WELFORD_CHECK_SLACK;
+
+	printf("%s: %zu readings, mean %d (%.3f, off %.3f), stddev %d (%.3f, off %.3f), min %d max %d %s\n",
+		path, n, stats[AGG_MEAN], mean, mean_err, stats[AGG_STDDEV], stddev, stddev_err,
+		stats[AGG_MIN], stats[AGG_MAX], ok ? "ok" : "FAIL");
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	bool ok = true;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s trace...\n", argv[0]);
+		return 2;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		ok &= check_trace(argv[i]);
+	}
+	return ok ? 0 : 1;
+}
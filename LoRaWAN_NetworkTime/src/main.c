@@ -15,11 +15,29 @@
 #include <zephyr/drivers/i2c.h>
 #include <time.h>
 #include "lorawan.h"
+#include "clock.h"
+#include "workq.h"
 
 #define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(main);
 
+#define JOIN_RETRY_DELAY        K_MSEC(5000)
+#define TIME_PRINT_PERIOD       K_SECONDS(5)
+
+K_THREAD_STACK_DEFINE(app_workq_stack, APP_WORKQ_STACK_SIZE);
+struct k_work_q app_workq;
+
+static struct k_work init_work;
+static struct k_work_delayable join_work;
+static struct k_work_delayable time_work;
+
+static struct lorawan_join_config join_cfg;
+static uint8_t dev_eui[] = LORAWAN_DEV_EUI;
+static uint8_t join_eui[] = LORAWAN_JOIN_EUI;
+static uint8_t app_key[] = LORAWAN_APP_KEY;
+static int join_attempts;
+
 static void dl_callback(uint8_t port, bool data_pending, int16_t rssi, int8_t snr, uint8_t len, const uint8_t *data)
 {
 	LOG_INF("Port %d, Pending %d, RSSI %ddB, SNR %ddBm", port, data_pending, rssi, snr);
@@ -28,6 +46,11 @@ static void dl_callback(uint8_t port, bool data_pending, int16_t rssi, int8_t sn
 	}
 }
 
+static struct lorawan_downlink_cb downlink_cb = {
+	.port = LW_RECV_PORT_ANY,
+	.cb = dl_callback
+};
+
 static void lorwan_datarate_changed(enum lorawan_datarate dr)
 {
 	uint8_t unused, max_size;
@@ -36,85 +59,67 @@ static void lorwan_datarate_changed(enum lorawan_datarate dr)
 	LOG_INF("New Datarate: DR_%d, Max Payload %d", dr, max_size);
 }
 
-int main(void)
+static void time_work_handler(struct k_work *work)
 {
-	const struct device *lora_dev;
-
-	struct lorawan_join_config join_cfg;
-	uint16_t dev_nonce = 0;
-
-	uint8_t dev_eui[] = LORAWAN_DEV_EUI;
-	uint8_t join_eui[] = LORAWAN_JOIN_EUI;
-	uint8_t app_key[] = LORAWAN_APP_KEY;
-
-	uint32_t gps_time;
+	uint64_t gps_us, unix_us;
 	time_t unix_time;
 	struct tm timeinfo;
-	char buf[32];
-	
+	char buf[48];
 	int ret;
 
-	LOG_INF("Zephyr LoRaWAN Network Time Server Example, Board: %s", CONFIG_BOARD);
+	/*
+	 * Once time synchronisation has occurred, the clock service extrapolates
+	 * GPS Time from the uptime counter, corrected for drift, without querying
+	 * the LoRaWAN stack. GPS Time is the number of seconds since Jan 6th 1980
+	 * ignoring leap seconds; clock_get_unix_us() applies the leap second table.
+	 */
 
-	lora_dev = DEVICE_DT_GET(DT_ALIAS(lora0));
-	if (!device_is_ready(lora_dev)) {
-		LOG_ERR("%s: device not ready.", lora_dev->name);
-		return(-1);
+	ret = clock_get_gps_us(&gps_us);
+	if (ret != 0) { 
+		LOG_WRN("Waiting for network time");
+	} else {
+		clock_get_unix_us(&unix_us);
+		unix_time = unix_us / USEC_PER_SEC;
+		gmtime_r(&unix_time, &timeinfo);
+		strftime(buf, sizeof(buf), "%A %B %d %Y %I:%M:%S", &timeinfo);
+		LOG_INF("GPS Time (Seconds since Jan 6th 1980) = %"PRIu64".%06"PRIu64", UTC Time: %s.%03"PRIu64" %s, drift %dppb",
+			gps_us / USEC_PER_SEC, gps_us % USEC_PER_SEC, buf,
+			(unix_us % USEC_PER_SEC) / USEC_PER_MSEC, timeinfo.tm_hour < 12 ? "AM" : "PM",
+			clock_get_drift_ppb());
 	}
 
-	LOG_INF("Starting LoRaWAN stack.");
-	ret = lorawan_start();
-	if (ret < 0) {
-		LOG_ERR("lorawan_start failed: %d", ret);
-		return(-1);
-	}
-
-	// Enable callbacks
-	struct lorawan_downlink_cb downlink_cb = {
-		.port = LW_RECV_PORT_ANY,
-		.cb = dl_callback
-	};
+	k_work_reschedule_for_queue(&app_workq, &time_work, TIME_PRINT_PERIOD);
+}
 
-	lorawan_register_downlink_callback(&downlink_cb);
-	lorawan_register_dr_changed_callback(lorwan_datarate_changed);
+static void join_work_handler(struct k_work *work)
+{
+	int ret;
 
-	join_cfg.mode = LORAWAN_ACT_OTAA;
-	join_cfg.dev_eui = dev_eui;
-	join_cfg.otaa.join_eui = join_eui;
-	join_cfg.otaa.app_key = app_key;
-	join_cfg.otaa.nwk_key = app_key;
-	join_cfg.otaa.dev_nonce = dev_nonce;
-
-	int i = 1;
-
-	do {
-		LOG_INF("Joining network using OTAA, dev nonce %d, attempt %d", join_cfg.otaa.dev_nonce, i++);
-		ret = lorawan_join(&join_cfg);
-		if (ret < 0) {
-			if ((ret =-ETIMEDOUT)) {
-				LOG_WRN("Timed-out waiting for response.");
-			} else {
-				LOG_ERR("Join failed (%d)", ret);
-			}
+	LOG_INF("Joining network using OTAA, dev nonce %d, attempt %d", join_cfg.otaa.dev_nonce, ++join_attempts);
+	ret = lorawan_join(&join_cfg);
+	if (ret < 0) {
+		if (ret == -ETIMEDOUT) {
+			LOG_WRN("Timed-out waiting for response.");
 		} else {
-			LOG_INF("Join successful.");
+			LOG_ERR("Join failed (%d)", ret);
 		}
+	} else {
+		LOG_INF("Join successful.");
+	}
 
-		// Increment DevNonce as per LoRaWAN 1.0.4 Spec.
-		dev_nonce++;
-		join_cfg.otaa.dev_nonce = dev_nonce;
-
-		if (ret < 0) {
-			// If failed, wait before re-trying.
-			k_sleep(K_MSEC(5000));
-		}
+	// Increment DevNonce as per LoRaWAN 1.0.4 Spec.
+	join_cfg.otaa.dev_nonce++;
 
-	} while (ret != 0);
+	if (ret < 0) {
+		// If failed, wait before re-trying.
+		k_work_reschedule_for_queue(&app_workq, &join_work, JOIN_RETRY_DELAY);
+		return;
+	}
 
 #ifdef CONFIG_LORAWAN_APP_CLOCK_SYNC
 
 	/*
-	 * lorawan_clock_sync_run() registers a callback on port 202 (LoRaWAN Clock Sync Port) 
+	 * lorawan_clock_sync_run() registers a callback on port 202 (LoRaWAN Clock Sync Port)
 	 * and starts a delayable work function to request the time periodically. By default,
 	 * this is every 86400 seconds (24 hours), but can be changed using 
 	 * CONFIG_LORAWAN_APP_CLOCK_SYNC_PERIODICITY
@@ -126,37 +131,69 @@ int main(void)
 	 * <inf> main: Payload:
 	 *			   01 77 7b 5b 52 00                                |.w{[R.
 	 * <dbg> lorawan_clock_sync: clock_sync_package_callback: AppTimeAns time_correction 1381727095 (token 0)
+	 *
+	 * clock_init() calls lorawan_clock_sync_run() and records each answer. It
+	 * measures the drift of our crystal between syncs and sends extra requests
+	 * when drift is high, so the period can be shorter than
+	 * CONFIG_LORAWAN_APP_CLOCK_SYNC_PERIODICITY.
 	 */
 
-	lorawan_clock_sync_run();
+	clock_init();
 
 #endif
 
-	while (1) {
+	k_work_reschedule_for_queue(&app_workq, &time_work, K_NO_WAIT);
+}
 
-		/*
-		 * Once time synchronisation has occurred, lorawan_clock_sync_get() can 
-		 * be called to populate an uint32_t variable with GPS Time. This is the 
-		 * number of seconds since Jan 6th 1980 ignoring leap seconds.
-		 */
+static void init_work_handler(struct k_work *work)
+{
+	const struct device *lora_dev;
+	int ret;
 
-		ret = lorawan_clock_sync_get(&gps_time);
-		if (ret != 0) { 
-			LOG_ERR("lorawan_clock_sync_get returned %d", ret);
-		} else {
-			/* 
-			 * The difference in time between UNIX (epoch Jan 1st 1970) and
-			 * GPS (epoch Jan 6th 1980) is 315964800 seconds. This is a bit
-			 * of a fudge as it doesn't take into account leap seconds and 
-			 * hence is out by roughly 18 seconds. 
-			 *
-			 */
-			unix_time = gps_time - 315964800;
-			localtime_r(&unix_time, &timeinfo);
-			strftime(buf, sizeof(buf), "%A %B %d %Y %I:%M:%S %p %Z", &timeinfo);
-			LOG_INF("GPS Time (Seconds since Jan 6th 1980) = %"PRIu32", UTC Time: %s", gps_time, buf);
-		}
+	lora_dev = DEVICE_DT_GET(DT_ALIAS(lora0));
+	if (!device_is_ready(lora_dev)) {
+		LOG_ERR("%s: device not ready.", lora_dev->name);
+		return;
+	}
 
-		k_sleep(K_SECONDS(5));
+	LOG_INF("Starting LoRaWAN stack.");
+	ret = lorawan_start();
+	if (ret < 0) {
+		LOG_ERR("lorawan_start failed: %d", ret);
+		return;
 	}
+
+	// Enable callbacks
+	lorawan_register_downlink_callback(&downlink_cb);
+	lorawan_register_dr_changed_callback(lorwan_datarate_changed);
+
+	join_cfg.mode = LORAWAN_ACT_OTAA;
+	join_cfg.dev_eui = dev_eui;
+	join_cfg.otaa.join_eui = join_eui;
+	join_cfg.otaa.app_key = app_key;
+	join_cfg.otaa.nwk_key = app_key;
+	join_cfg.otaa.dev_nonce = 0;
+
+	k_work_reschedule_for_queue(&app_workq, &join_work, K_NO_WAIT);
+}
+
+int main(void)
+{
+	const struct k_work_queue_config cfg = {
+		.name = "app_workq",
+	};
+
+	LOG_INF("Zephyr LoRaWAN Network Time Server Example, Board: %s", CONFIG_BOARD);
+
+	k_work_init(&init_work, init_work_handler);
+	k_work_init_delayable(&join_work, join_work_handler);
+	k_work_init_delayable(&time_work, time_work_handler);
+
+	k_work_queue_start(&app_workq, app_workq_stack, K_THREAD_STACK_SIZEOF(app_workq_stack),
+			   APP_WORKQ_PRIORITY, &cfg);
+
+	// Everything from here on runs as work items, so the main thread can exit.
+	k_work_submit_to_queue(&app_workq, &init_work);
+
+	return 0;
 }
@@ -0,0 +1,18 @@
+
+/*
+ * Application work queue
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Joining, clock sync and printing the time (gmtime and strftime) run on
+ * this queue. Sized within the stack budget in prj.conf; this is an
+ * estimate, check it against the high-water mark from a debug.conf build.
+ */
+#define APP_WORKQ_STACK_SIZE    1536
+#define APP_WORKQ_PRIORITY      K_PRIO_PREEMPT(7)
+
+extern struct k_work_q app_workq;
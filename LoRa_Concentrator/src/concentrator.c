@@ -0,0 +1,333 @@
+
+/*
+ * LoRa P2P Concentrator - deduplication, aggregation and per-source statistics
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "concentrator.h"
+
+#define CONC_BIT(n)             (1UL << (n))
+#define CONC_MIN(a, b)          (((a) < (b)) ? (a) : (b))
+#define CONC_CLAMP(v, lo, hi)   (((v) < (lo)) ? (lo) : (((v) > (hi)) ? (hi) : (v)))
+
+_Static_assert(CONC_STATS_HDR_LEN == sizeof(struct conc_totals) + 1, "Statistics header out of step with conc_totals");
+
+static struct conc_source sources[CONC_MAX_SOURCES];
+static struct conc_batch batch;
+static struct conc_totals totals;
+
+static void conc_put_le16(uint16_t val, uint8_t *dst)
+{
+	dst[0] = val & 0xFF;
+	dst[1] = val >> 8;
+}
+
+static void conc_put_le32(uint32_t val, uint8_t *dst)
+{
+	conc_put_le16(val & 0xFFFF, &dst[0]);
+	conc_put_le16(val >> 16, &dst[2]);
+}
+
+static uint16_t conc_get_le16(const uint8_t *src)
+{
+	return src[0] | (src[1] << 8);
+}
+
+void conc_init(uint16_t batch_limit)
+{
+	memset(sources, 0, sizeof(sources));
+	memset(&totals, 0, sizeof(totals));
+	memset(&batch, 0, sizeof(batch));
+	conc_set_batch_limit(batch_limit);
+}
+
+void conc_set_batch_limit(uint16_t batch_limit)
+{
+	// Limit follows the upstream payload size, which can change with datarate.
+	batch.limit = CONC_CLAMP(batch_limit, CONC_BATCH_HDR_LEN + CONC_ENTRY_HDR_LEN, CONC_BATCH_MAX);
+}
+
+static struct conc_source *conc_find_source(uint16_t id)
+{
+	struct conc_source *oldest = NULL;
+
+	for (int i = 0; i < CONC_MAX_SOURCES; i++) {
+		if (sources[i].used && sources[i].id == id) {
+			return &sources[i];
+		}
+	}
+
+	for (int i = 0; i < CONC_MAX_SOURCES; i++) {
+		if (!sources[i].used) {
+			return &sources[i];
+		}
+		if (oldest == NULL || sources[i].last_seen < oldest->last_seen) {
+			oldest = &sources[i];
+		}
+	}
+
+	// Table full, recycle the source we haven't heard from for the longest.
+	totals.evicted++;
+	memset(oldest, 0, sizeof(*oldest));
+	return oldest;
+}
+
+/*
+ * Sliding window replay check, in the style of IPsec anti-replay. Returns
+ * true if the sequence number has already been seen. Does not update state.
+ */
+static bool conc_is_duplicate(const struct conc_source *src, uint8_t seq)
+{
+	int8_t diff;
+
+	if (!src->used) {
+		return false;
+	}
+
+	diff = (int8_t)(uint8_t)(src->last_seq - seq);
+	if (diff < 0 || diff >= CONC_SEQ_WINDOW) {
+		// Newer than anything seen, or too old to track
+		return false;
+	}
+
+	return (src->window & CONC_BIT(diff)) != 0;
+}
+
+static void conc_mark_seen(struct conc_source *src, uint16_t id, uint8_t seq)
+{
+	int8_t diff;
+
+	if (!src->used) {
+		src->used = true;
+		src->id = id;
+		src->last_seq = seq;
+		src->window = CONC_BIT(0);
+		return;
+	}
+
+	diff = (int8_t)(uint8_t)(seq - src->last_seq);
+	if (diff > 0) {
+		// Newer frame, anything skipped over is counted as lost.
+		src->window = (diff >= CONC_SEQ_WINDOW) ? 0 : (src->window << diff);
+		src->window |= CONC_BIT(0);
+		src->last_seq = seq;
+		src->lost += diff - 1;
+	} else if (-diff < CONC_SEQ_WINDOW) {
+		// Late arrival of a frame previously counted as lost.
+		src->window |= CONC_BIT(-diff);
+		if (src->lost > 0) {
+			src->lost--;
+		}
+	} else {
+		// Too far behind, assume the node has rebooted.
+		src->last_seq = seq;
+		src->window = CONC_BIT(0);
+	}
+}
+
+int conc_process(const struct p2p_frame *frame, int64_t now)
+{
+	struct conc_source *src;
+	uint16_t id;
+	uint8_t seq, data_len;
+	uint8_t *entry;
+
+	if (frame->size < CONC_NODE_HDR_LEN || frame->size > CONC_MAX_FRAME ||
+	    frame->data[0] != CONC_NODE_MAGIC) {
+		totals.invalid++;
+		return -EINVAL;
+	}
+
+	id = conc_get_le16(&frame->data[1]);
+	seq = frame->data[3];
+	data_len = frame->size - CONC_NODE_HDR_LEN;
+
+	src = conc_find_source(id);
+	if (conc_is_duplicate(src, seq)) {
+		src->duplicates++;
+		totals.duplicates++;
+		return CONC_DUPLICATE;
+	}
+
+	// Caller must flush the batch and try again.
+	if ((batch.count ? batch.len : CONC_BATCH_HDR_LEN) + CONC_ENTRY_HDR_LEN + data_len > batch.limit) {
+		if (batch.count == 0) {
+			totals.dropped++;
+			return -EMSGSIZE;
+		}
+		return -ENOSPC;
+	}
+
+	if (batch.count == 0) {
+		batch.buf[0] = batch.seq;
+		batch.len = CONC_BATCH_HDR_LEN;
+	}
+
+	entry = &batch.buf[batch.len];
+	conc_put_le16(id, &entry[0]);
+	entry[2] = seq;
+	entry[3] = (uint8_t)(int8_t)CONC_CLAMP(frame->rssi, INT8_MIN, INT8_MAX);
+	entry[4] = data_len;
+	memcpy(&entry[CONC_ENTRY_HDR_LEN], &frame->data[CONC_NODE_HDR_LEN], data_len);
+	batch.len += CONC_ENTRY_HDR_LEN + data_len;
+	batch.count++;
+	batch.buf[1] = batch.count;
+
+	conc_mark_seen(src, id, seq);
+	src->rx++;
+	src->last_rssi = frame->rssi;
+	src->last_snr = frame->snr;
+	src->rssi_sum += frame->rssi;
+	src->last_seen = now;
+
+	totals.frames_in++;
+	totals.bytes_in += frame->size;
+
+	return CONC_ACCEPTED;
+}
+
+bool conc_batch_pending(void)
+{
+	return batch.count != 0;
+}
+
+const struct conc_batch *conc_batch_get(void)
+{
+	return &batch;
+}
+
+/*
+ * Copies the leading entries of the batch that fit within the batch limit
+ * into buf (CONC_BATCH_MAX bytes) as a batch of their own. Returns its length
+ * and the number of entries in count, or 0 if the first entry alone doesn't
+ * fit. Only needed when the limit has dropped since the batch was built.
+ */
+uint16_t conc_batch_split(uint8_t *buf, uint8_t *count)
+{
+	uint16_t len = CONC_BATCH_HDR_LEN;
+	uint16_t entry_len;
+
+	*count = 0;
+	while (*count < batch.count) {
+		entry_len = CONC_ENTRY_HDR_LEN + batch.buf[len + 4];
+		if (len + entry_len > batch.limit) {
+			break;
+		}
+		len += entry_len;
+		(*count)++;
+	}
+
+	if (*count == 0) {
+		return 0;
+	}
+
+	memcpy(buf, batch.buf, len);
+	buf[1] = *count;
+	return len;
+}
+
+/*
+ * Removes the leading count entries of the batch once forwarded as a batch
+ * of len bytes, or discards them as too large if len is 0. The rest of the
+ * batch takes the next sequence number.
+ */
+void conc_batch_consume(uint8_t count, uint16_t len)
+{
+	uint16_t offset = CONC_BATCH_HDR_LEN;
+
+	count = CONC_MIN(count, batch.count);
+	for (int i = 0; i < count; i++)
+		offset += CONC_ENTRY_HDR_LEN + batch.buf[offset + 4];
+
+	if (len != 0) {
+		totals.batches_out++;
+		totals.bytes_out += len;
+	} else {
+		totals.dropped += count;
+	}
+
+	memmove(&batch.buf[CONC_BATCH_HDR_LEN], &batch.buf[offset], batch.len - offset);
+	batch.len -= offset - CONC_BATCH_HDR_LEN;
+	batch.count -= count;
+	batch.seq++;
+	batch.buf[0] = batch.seq;
+	batch.buf[1] = batch.count;
+	if (batch.count == 0) {
+		batch.len = 0;
+	}
+}
+
+void conc_batch_reset(bool forwarded)
+{
+	if (batch.count != 0) {
+		if (forwarded) {
+			totals.batches_out++;
+			totals.bytes_out += batch.len;
+		} else {
+			totals.batches_failed++;
+		}
+	}
+	batch.count = 0;
+	batch.len = 0;
+	batch.seq++;
+}
+
+const struct conc_totals *conc_get_totals(void)
+{
+	return &totals;
+}
+
+const struct conc_source *conc_get_sources(void)
+{
+	return sources;
+}
+
+uint16_t conc_stats_encode(uint8_t *buf, uint16_t max_len)
+{
+	const uint32_t total[] = {
+		totals.frames_in, totals.bytes_in, totals.duplicates, totals.invalid,
+		totals.dropped, totals.batches_out, totals.bytes_out, totals.batches_failed,
+		totals.evicted
+	};
+	uint16_t len = CONC_STATS_HDR_LEN;
+	uint8_t count = 0;
+
+	if (max_len < CONC_STATS_HDR_LEN) {
+		return 0;
+	}
+
+	for (int i = 0; i < (int)(sizeof(total) / sizeof(total[0])); i++)
+		conc_put_le32(total[i], &buf[i * sizeof(uint32_t)]);
+
+	for (int i = 0; i < CONC_MAX_SOURCES; i++) {
+		struct conc_source *src = &sources[i];
+		uint8_t *entry = &buf[len];
+
+		if (!src->used || src->rx == 0) {
+			continue;
+		}
+		if (len + CONC_STATS_ENTRY_LEN > max_len) {
+			break;
+		}
+
+		conc_put_le16(src->id, &entry[0]);
+		conc_put_le32(src->rx, &entry[2]);
+		conc_put_le16(CONC_MIN(src->duplicates, UINT16_MAX), &entry[6]);
+		conc_put_le16(CONC_MIN(src->lost, UINT16_MAX), &entry[8]);
+		entry[10] = (uint8_t)(int8_t)CONC_CLAMP(src->rssi_sum / (int32_t)src->rx, INT8_MIN, INT8_MAX);
+		entry[11] = (uint8_t)src->last_snr;
+		len += CONC_STATS_ENTRY_LEN;
+		count++;
+	}
+
+	buf[CONC_STATS_HDR_LEN - 1] = count;
+	return len;
+}
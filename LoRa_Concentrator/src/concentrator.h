@@ -0,0 +1,118 @@
+
+/*
+ * LoRa P2P Concentrator - deduplication, aggregation and per-source statistics
+ *
+ * concentrator.c has no Zephyr dependencies, so host tools can build it too.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Sensor node P2P frame:
+ *
+ *   [0]     CONC_NODE_MAGIC
+ *   [1..2]  Source node ID (little endian)
+ *   [3]     Sequence number (wraps at 255)
+ *   [4..]   Sensor data (up to CONC_MAX_DATA bytes)
+ *
+ * Upstream batch:
+ *
+ *   [0]     Batch sequence number
+ *   [1]     Number of entries
+ *   Entries of:
+ *   [0..1]  Source node ID (little endian)
+ *   [2]     Sequence number
+ *   [3]     RSSI (dBm, clamped to int8)
+ *   [4]     Data length
+ *   [5..]   Sensor data
+ *
+ * If the batch limit drops below the length of a batch already built (the
+ * LoRaWAN datarate fell), it is forwarded as several batches, each with its
+ * own sequence number.
+ *
+ * Statistics report (serial uplink only):
+ *
+ *   [0..35] Totals, in struct conc_totals order (LE32)
+ *   [36]    Number of sources
+ *   Sources of:
+ *   [0..1]  Source node ID (little endian)
+ *   [2..5]  Frames received (LE32)
+ *   [6..7]  Duplicates (LE16, saturates)
+ *   [8..9]  Lost (LE16, saturates)
+ *   [10]    Average RSSI (dBm, clamped to int8)
+ *   [11]    Last SNR (dB)
+ */
+
+#define CONC_NODE_MAGIC         0xA5
+#define CONC_NODE_HDR_LEN       4
+#define CONC_MAX_DATA           32
+#define CONC_MAX_FRAME          (CONC_NODE_HDR_LEN + CONC_MAX_DATA)
+
+#define CONC_BATCH_HDR_LEN      2
+#define CONC_ENTRY_HDR_LEN      5
+#define CONC_BATCH_MAX          222
+
+#define CONC_MAX_SOURCES        32
+#define CONC_SEQ_WINDOW         32
+
+#define CONC_STATS_HDR_LEN      37
+#define CONC_STATS_ENTRY_LEN    12
+#define CONC_STATS_MAX          (CONC_STATS_HDR_LEN + CONC_MAX_SOURCES * CONC_STATS_ENTRY_LEN)
+
+#define CONC_ACCEPTED           0
+#define CONC_DUPLICATE          1
+
+struct p2p_frame {
+	uint8_t data[CONC_MAX_FRAME];
+	uint16_t size;          // As received, frames over CONC_MAX_FRAME are invalid
+	int16_t rssi;
+	int8_t snr;
+};
+
+struct conc_source {
+	bool used;
+	uint16_t id;
+	uint8_t last_seq;
+	uint32_t window;        // Bit n set if (last_seq - n) has been seen
+	uint32_t rx;
+	uint32_t duplicates;
+	uint32_t lost;
+	int16_t last_rssi;
+	int8_t last_snr;
+	int32_t rssi_sum;
+	int64_t last_seen;      // Uptime (ms)
+};
+
+struct conc_batch {
+	uint8_t buf[CONC_BATCH_MAX];
+	uint16_t len;
+	uint16_t limit;
+	uint8_t count;
+	uint8_t seq;
+};
+
+struct conc_totals {
+	uint32_t frames_in;
+	uint32_t bytes_in;
+	uint32_t duplicates;
+	uint32_t invalid;
+	uint32_t dropped;       // Too large for an upstream batch
+	uint32_t batches_out;
+	uint32_t bytes_out;
+	uint32_t batches_failed;    // Not forwarded after retries
+	uint32_t evicted;       // Sources recycled from a full table
+};
+
+void conc_init(uint16_t batch_limit);
+void conc_set_batch_limit(uint16_t batch_limit);
+int conc_process(const struct p2p_frame *frame, int64_t now);
+bool conc_batch_pending(void);
+const struct conc_batch *conc_batch_get(void);
+uint16_t conc_batch_split(uint8_t *buf, uint8_t *count);
+void conc_batch_consume(uint8_t count, uint16_t len);
+void conc_batch_reset(bool forwarded);
+const struct conc_totals *conc_get_totals(void);
+const struct conc_source *conc_get_sources(void);
+uint16_t conc_stats_encode(uint8_t *buf, uint16_t max_len);
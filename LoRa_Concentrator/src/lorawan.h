@@ -0,0 +1,9 @@
+/*
+ * LoRaWAN sample application
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#define LORAWAN_DEV_EUI         { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }    // MSB Format!
+#define LORAWAN_JOIN_EUI        { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }    // MSB Format!
+#define LORAWAN_APP_KEY         { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }
\ No newline at end of file
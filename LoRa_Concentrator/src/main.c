@@ -0,0 +1,309 @@
+
+/*
+ * LoRa Point to Point Concentrator
+ *
+ * Listens on the P2P channel for frames from battery powered sensor nodes,
+ * deduplicates them and forwards compact batches upstream, either over
+ * LoRaWAN or a framed serial link.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ * Copyright (c) 2019 Manivannan Sadhasivam
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/lora.h>
+
+#include "concentrator.h"
+#include "uplink.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(main);
+
+#define TRANSMIT 1
+#define RECEIVE 0
+
+// Maximum time a received frame waits before its batch is forwarded.
+#define FLUSH_PERIOD K_SECONDS(60)
+#define STATS_PERIOD_MS (15 * MSEC_PER_SEC * 60)
+
+// A batch that couldn't be forwarded (e.g. LoRaWAN stack busy) is kept and
+// retried, then dropped after FORWARD_RETRIES attempts.
+#define FORWARD_RETRY_PERIOD K_SECONDS(10)
+#define FORWARD_RETRIES 5
+
+#define RX_QUEUE_DEPTH 16
+
+K_MSGQ_DEFINE(rx_msgq, sizeof(struct p2p_frame), RX_QUEUE_DEPTH, 4);
+
+static uint32_t rx_overflows;
+static uint32_t batch_overflows;
+static uint8_t forward_attempts;
+
+void lora_recv_callback(const struct device *dev, uint8_t *data, uint16_t size, int16_t rssi, int8_t snr)
+{
+	struct p2p_frame frame;
+
+	// When lora_recv_async is cancelled, may be called with 0 bytes.
+	if (size == 0) {
+		return;
+	}
+
+	// Oversize frames are passed on with their real size, to be counted as invalid.
+	frame.size = size;
+	frame.rssi = rssi;
+	frame.snr = snr;
+	memcpy(frame.data, data, MIN(size, CONC_MAX_FRAME));
+
+	// Radio callback context, never block here.
+	if (k_msgq_put(&rx_msgq, &frame, K_NO_WAIT) != 0) {
+		rx_overflows++;
+	}
+}
+
+int lora_configure(const struct device *dev, bool transmit)
+{
+	int ret;
+	struct lora_modem_config config;
+
+	config.frequency = 916800000;
+	config.bandwidth = BW_125_KHZ;
+	config.datarate = SF_10;
+	config.preamble_len = 8;
+	config.coding_rate = CR_4_5;
+	config.tx_power = 4;
+	config.iq_inverted = false;
+	config.public_network = false;
+	config.tx = transmit;
+
+	ret = lora_config(dev, &config);
+	if (ret < 0) {
+		LOG_ERR("LoRa device configuration failed");
+		return false;
+	}
+
+	return(true);
+}
+
+/*
+ * Sends the batch, split into several if the upstream payload limit has
+ * dropped below its length since it was built. Returns 0 once all of it
+ * has been sent.
+ */
+static int send_batch(void)
+{
+	static uint8_t piece[CONC_BATCH_MAX];
+	const struct conc_batch *batch = conc_batch_get();
+	uint16_t len;
+	uint8_t count;
+	int ret;
+
+	conc_set_batch_limit(uplink_max_payload());
+
+	while (batch->len > batch->limit) {
+		len = conc_batch_split(piece, &count);
+		if (len == 0) {
+			LOG_WRN("Dropping frame from batch %d, too large for %d byte payload",
+				batch->seq, batch->limit);
+			conc_batch_consume(1, 0);
+			continue;
+		}
+
+		ret = uplink_send(UPLINK_TYPE_BATCH, piece, len);
+		if (ret < 0) {
+			return ret;
+		}
+		LOG_INF("Forwarded batch %d: %d frames, %d bytes (split)", piece[0], count, len);
+		conc_batch_consume(count, len);
+		forward_attempts = 0;
+	}
+
+	if (!conc_batch_pending()) {
+		return 0;
+	}
+
+	ret = uplink_send(UPLINK_TYPE_BATCH, batch->buf, batch->len);
+	if (ret == 0) {
+		LOG_INF("Forwarded batch %d: %d frames, %d bytes", batch->seq, batch->count, batch->len);
+		conc_batch_reset(true);
+	}
+	return ret;
+}
+
+static void forward_batch(const struct device *dev_lora)
+{
+	const struct conc_batch *batch = conc_batch_get();
+	int ret;
+
+	if (!conc_batch_pending()) {
+		return;
+	}
+
+#ifdef CONFIG_LORAWAN
+	// The radio is shared, stop listening while the LoRaWAN uplink is sent.
+	ret = lora_recv_async(dev_lora, NULL);
+	if (ret < 0) {
+		LOG_ERR("LoRa recv_async failed %d", ret);
+	}
+#endif
+
+	ret = send_batch();
+	forward_attempts++;
+
+	if (ret == 0) {
+		forward_attempts = 0;
+	} else if (forward_attempts < FORWARD_RETRIES) {
+		LOG_WRN("Failed to forward batch %d (%d), retrying", batch->seq, ret);
+	} else {
+		LOG_ERR("Failed to forward batch %d (%d), dropping %d frames", batch->seq, ret, batch->count);
+		conc_batch_reset(false);
+		forward_attempts = 0;
+	}
+
+#ifdef CONFIG_LORAWAN
+	lora_configure(dev_lora, RECEIVE);
+	if (lora_recv_async(dev_lora, lora_recv_callback) < 0) {
+		LOG_ERR("LoRa recv_async failed");
+	}
+#endif
+}
+
+static int64_t next_flush(void)
+{
+	// A batch still pending after forward_batch() is waiting for a retry.
+	k_timeout_t period = conc_batch_pending() ? FORWARD_RETRY_PERIOD : FLUSH_PERIOD;
+
+	return k_uptime_get() + k_ticks_to_ms_ceil64(period.ticks);
+}
+
+static void forward_stats(void)
+{
+	static uint8_t buf[CONC_STATS_MAX];
+	uint16_t len;
+	int ret;
+
+	len = conc_stats_encode(buf, sizeof(buf));
+	ret = uplink_send(UPLINK_TYPE_STATS, buf, len);
+	if (ret < 0) {
+		LOG_WRN("Failed to forward statistics (%d)", ret);
+	}
+}
+
+static void print_stats(void)
+{
+	const struct conc_totals *totals = conc_get_totals();
+	const struct conc_source *sources = conc_get_sources();
+	int64_t now = k_uptime_get();
+
+	LOG_INF("Frames %u (%u bytes), duplicates %u, invalid %u, dropped %u, batches %u (%u bytes), failed %u, evicted %u",
+		totals->frames_in, totals->bytes_in, totals->duplicates, totals->invalid,
+		totals->dropped, totals->batches_out, totals->bytes_out, totals->batches_failed,
+		totals->evicted);
+
+	for (int i = 0; i < CONC_MAX_SOURCES; i++) {
+		const struct conc_source *src = &sources[i];
+
+		if (!src->used || src->rx == 0) {
+			continue;
+		}
+		LOG_INF("  ID 0x%04X: rx %u, dup %u, lost %u, RSSI %ddBm (avg %d), SNR %ddB, last seen %llds ago",
+			src->id, src->rx, src->duplicates, src->lost, src->last_rssi,
+			src->rssi_sum / (int32_t)src->rx, src->last_snr,
+			(now - src->last_seen) / MSEC_PER_SEC);
+	}
+}
+
+int main(void)
+{
+	const struct device *dev_lora;
+	struct p2p_frame frame;
+	int64_t flush_at = 0;
+	int64_t last_stats;
+	k_timeout_t timeout;
+	int ret;
+
+	LOG_INF("LoRa Point to Point Concentrator, Board: %s", CONFIG_BOARD);
+
+	dev_lora = DEVICE_DT_GET(DT_ALIAS(lora0));
+	if (!device_is_ready(dev_lora)) {
+		LOG_ERR("%s: device not ready.", dev_lora->name);
+		return(-1);
+	}
+
+	ret = uplink_init();
+	if (ret < 0) {
+		return(-1);
+	}
+
+	conc_init(uplink_max_payload());
+
+	if (lora_configure(dev_lora, RECEIVE)) {
+		LOG_INF("LoRa Device Configured");
+	} else {
+		return(-1);
+	}
+
+	// Start LoRa radio listening
+	ret = lora_recv_async(dev_lora, lora_recv_callback);
+	if (ret < 0) {
+		LOG_ERR("LoRa recv_async failed %d", ret);
+		return(-1);
+	}
+
+	last_stats = k_uptime_get();
+
+	while (1) {
+
+		// Wake up in time to forward a part filled batch.
+		if (conc_batch_pending()) {
+			timeout = K_MSEC(MAX(flush_at - k_uptime_get(), 0));
+		} else {
+			timeout = K_MSEC(STATS_PERIOD_MS);
+		}
+
+		if (k_msgq_get(&rx_msgq, &frame, timeout) == 0) {
+
+			if (!conc_batch_pending()) {
+				flush_at = next_flush();
+			}
+
+			ret = conc_process(&frame, k_uptime_get());
+			if (ret == -ENOSPC) {
+				// Batch is full, forward it and start a new one.
+				forward_batch(dev_lora);
+				flush_at = next_flush();
+				ret = conc_process(&frame, k_uptime_get());
+			}
+
+			if (ret == -ENOSPC) {
+				// Still holding a batch that couldn't be forwarded.
+				batch_overflows++;
+			} else if (ret == -EINVAL) {
+				LOG_DBG("Ignoring %d byte frame, RSSI %ddBm", frame.size, frame.rssi);
+			} else if (ret == -EMSGSIZE) {
+				LOG_WRN("Frame of %d bytes too large for upstream batch", frame.size);
+			}
+
+		} else if (conc_batch_pending()) {
+			forward_batch(dev_lora);
+			flush_at = next_flush();
+		}
+
+		if (k_uptime_get() - last_stats >= STATS_PERIOD_MS) {
+			last_stats = k_uptime_get();
+			if (rx_overflows) {
+				LOG_WRN("Receive queue overflowed %u times", rx_overflows);
+			}
+			if (batch_overflows) {
+				LOG_WRN("%u frames dropped waiting to forward a batch", batch_overflows);
+			}
+			print_stats();
+			forward_stats();
+		}
+	}
+}
@@ -0,0 +1,238 @@
+
+/*
+ * LoRa P2P Concentrator - upstream forwarding of batches
+ *
+ * Copyright (c) 2023 Craig Peacock
+ * Copyright (c) 2020 Manivannan Sadhasivam <mani@kernel.org>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+
+#ifdef CONFIG_LORAWAN
+#include <zephyr/drivers/flash.h>
+#include <zephyr/fs/nvs.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <zephyr/storage/flash_map.h>
+#include "lorawan.h"
+#endif
+
+#include "concentrator.h"
+#include "uplink.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(uplink);
+
+#ifdef CONFIG_LORAWAN
+
+// DevNonce is kept in NVS (as in the LoRaWAN example), as a join server
+// rejects a DevNonce it has already seen.
+#define NVS_PARTITION           storage_partition
+#define NVS_DEVNONCE_ID         0
+
+static struct nvs_fs fs;
+
+static int uplink_nvs_init(void)
+{
+	struct flash_pages_info info;
+	int ret;
+
+	fs.flash_device = FIXED_PARTITION_DEVICE(NVS_PARTITION);
+	if (!device_is_ready(fs.flash_device)) {
+		LOG_ERR("Flash device %s is not ready", fs.flash_device->name);
+		return -ENODEV;
+	}
+	fs.offset = FIXED_PARTITION_OFFSET(NVS_PARTITION);
+	ret = flash_get_page_info_by_offs(fs.flash_device, fs.offset, &info);
+	if (ret < 0) {
+		LOG_ERR("Unable to get page info (%d)", ret);
+		return ret;
+	}
+	fs.sector_size = info.size;
+	fs.sector_count = 3U;
+
+	ret = nvs_mount(&fs);
+	if (ret < 0) {
+		LOG_ERR("NVS mount failed (%d)", ret);
+	}
+	return ret;
+}
+
+static void lorwan_datarate_changed(enum lorawan_datarate dr)
+{
+	uint8_t unused, max_size;
+
+	lorawan_get_payload_sizes(&unused, &max_size);
+	LOG_INF("New Datarate: DR_%d, Max Payload %d", dr, max_size);
+	conc_set_batch_limit(max_size);
+}
+
+int uplink_init(void)
+{
+	struct lorawan_join_config join_cfg;
+	uint16_t dev_nonce = 0;
+	uint8_t dev_eui[] = LORAWAN_DEV_EUI;
+	uint8_t join_eui[] = LORAWAN_JOIN_EUI;
+	uint8_t app_key[] = LORAWAN_APP_KEY;
+	ssize_t bytes_written;
+	int ret;
+	int i = 1;
+
+	ret = uplink_nvs_init();
+	if (ret < 0) {
+		return ret;
+	}
+	if (nvs_read(&fs, NVS_DEVNONCE_ID, &dev_nonce, sizeof(dev_nonce)) <= 0) {
+		LOG_INF("No DevNonce saved, starting from 0");
+		dev_nonce = 0;
+	}
+
+	LOG_INF("Starting LoRaWAN stack.");
+	ret = lorawan_start();
+	if (ret < 0) {
+		LOG_ERR("lorawan_start failed: %d", ret);
+		return ret;
+	}
+
+	lorawan_register_dr_changed_callback(lorwan_datarate_changed);
+
+	join_cfg.mode = LORAWAN_ACT_OTAA;
+	join_cfg.dev_eui = dev_eui;
+	join_cfg.otaa.join_eui = join_eui;
+	join_cfg.otaa.app_key = app_key;
+	join_cfg.otaa.nwk_key = app_key;
+	join_cfg.otaa.dev_nonce = dev_nonce;
+
+	do {
+		LOG_INF("Joining network using OTAA, dev nonce %d, attempt %d", join_cfg.otaa.dev_nonce, i++);
+		ret = lorawan_join(&join_cfg);
+		if (ret < 0) {
+			if (ret == -ETIMEDOUT) {
+				LOG_WRN("Timed-out waiting for response.");
+			} else {
+				LOG_ERR("Join failed (%d)", ret);
+			}
+			k_sleep(K_MSEC(5000));
+		} else {
+			LOG_INF("Join successful.");
+		}
+
+		// Increment DevNonce as per LoRaWAN 1.0.4 Spec.
+		dev_nonce++;
+		join_cfg.otaa.dev_nonce = dev_nonce;
+		// Save value away in Non-Volatile Storage.
+		bytes_written = nvs_write(&fs, NVS_DEVNONCE_ID, &dev_nonce, sizeof(dev_nonce));
+		if (bytes_written < 0) {
+			LOG_ERR("NVS: Failed to write id %d (%d)", NVS_DEVNONCE_ID, bytes_written);
+		}
+
+	} while (ret != 0);
+
+	return 0;
+}
+
+uint16_t uplink_max_payload(void)
+{
+	uint8_t unused, max_size;
+
+	lorawan_get_payload_sizes(&unused, &max_size);
+	return max_size;
+}
+
+int uplink_send(uint8_t type, const uint8_t *data, uint16_t len)
+{
+	int ret;
+
+	if (type != UPLINK_TYPE_BATCH) {
+		// Statistics are only reported on the serial link.
+		return 0;
+	}
+
+	// lorawan_send() would send an empty frame and return -EAGAIN, so a
+	// retry at the same datarate can never succeed.
+	if (len > uplink_max_payload()) {
+		LOG_ERR("%d byte batch too large for %d byte payload", len, uplink_max_payload());
+		return -EMSGSIZE;
+	}
+
+	ret = lorawan_send(UPLINK_LORAWAN_PORT, (uint8_t *)data, len, LORAWAN_MSG_UNCONFIRMED);
+	if (ret < 0) {
+		LOG_ERR("lorawan_send failed: %d", ret);
+	}
+	return ret;
+}
+
+#else
+
+#if DT_NODE_EXISTS(DT_ALIAS(uplinkuart))
+#define UPLINK_UART_NODE DT_ALIAS(uplinkuart)
+#else
+// Log and printk output on the console UART would corrupt the frames, so it
+// can only carry the uplink when the console is moved elsewhere (e.g. RTT).
+#if defined(CONFIG_UART_CONSOLE) || defined(CONFIG_LOG_BACKEND_UART)
+#error "No uplinkuart alias, and the console UART is in use for logging"
+#endif
+#define UPLINK_UART_NODE DT_CHOSEN(zephyr_console)
+#endif
+
+static const struct device *uart_dev = DEVICE_DT_GET(UPLINK_UART_NODE);
+
+int uplink_init(void)
+{
+	if (!device_is_ready(uart_dev)) {
+		LOG_ERR("%s: device not ready.", uart_dev->name);
+		return -ENODEV;
+	}
+
+	LOG_INF("Forwarding batches on %s", uart_dev->name);
+	return 0;
+}
+
+uint16_t uplink_max_payload(void)
+{
+	return CONC_BATCH_MAX;
+}
+
+static void uplink_put_escaped(uint8_t c)
+{
+	if (c == UPLINK_FRAME_FLAG || c == UPLINK_FRAME_ESC) {
+		uart_poll_out(uart_dev, UPLINK_FRAME_ESC);
+		c ^= UPLINK_FRAME_ESC_XOR;
+	}
+	uart_poll_out(uart_dev, c);
+}
+
+int uplink_send(uint8_t type, const uint8_t *data, uint16_t len)
+{
+	uint8_t hdr[3];
+	uint8_t crc_le[2];
+	uint16_t crc;
+
+	hdr[0] = type;
+	sys_put_le16(len, &hdr[1]);
+
+	crc = crc16_ccitt(0xFFFF, hdr, sizeof(hdr));
+	crc = crc16_ccitt(crc, data, len);
+	sys_put_le16(crc, crc_le);
+
+	uart_poll_out(uart_dev, UPLINK_FRAME_FLAG);
+	for (int i = 0; i < sizeof(hdr); i++)
+		uplink_put_escaped(hdr[i]);
+	for (int i = 0; i < len; i++)
+		uplink_put_escaped(data[i]);
+	for (int i = 0; i < sizeof(crc_le); i++)
+		uplink_put_escaped(crc_le[i]);
+	uart_poll_out(uart_dev, UPLINK_FRAME_FLAG);
+
+	return 0;
+}
+
+#endif
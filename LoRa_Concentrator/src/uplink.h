@@ -0,0 +1,33 @@
+
+/*
+ * LoRa P2P Concentrator - upstream forwarding of batches
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * With CONFIG_LORAWAN, batches are sent as LoRaWAN uplinks on UPLINK_LORAWAN_PORT.
+ * Otherwise they are written to the uplink UART (alias uplinkuart, or the console
+ * UART if not defined and logging is on RTT) using HDLC style framing:
+ *
+ *   0x7E | type | length (LE16) | payload | CRC16-CCITT (LE16) | 0x7E
+ *
+ * with 0x7E and 0x7D in the body escaped as 0x7D, (byte ^ 0x20). Batches are
+ * UPLINK_TYPE_BATCH, and statistics reports (see concentrator.h) are sent as
+ * UPLINK_TYPE_STATS every 15 minutes on the serial link only.
+ */
+
+#define UPLINK_LORAWAN_PORT     3
+
+#define UPLINK_FRAME_FLAG       0x7E
+#define UPLINK_FRAME_ESC        0x7D
+#define UPLINK_FRAME_ESC_XOR    0x20
+
+#define UPLINK_TYPE_BATCH       0x01
+#define UPLINK_TYPE_STATS       0x02
+
+int uplink_init(void);
+uint16_t uplink_max_payload(void);
+int uplink_send(uint8_t type, const uint8_t *data, uint16_t len);
@@ -0,0 +1,303 @@
+
+/*
+ * Disciplined local clock built on LoRaWAN Application Layer Clock Sync
+ *
+ * Each time the network answers a clock sync request, the GPS time and the
+ * local uptime are recorded. Timestamps are then served by extrapolating from
+ * the last sync point using the uptime counter, corrected for the crystal drift
+ * measured between syncs, so no call into the LoRaWAN stack is needed.
+ *
+ * Drift is measured over the whole baseline since the first sync. Clock sync
+ * only has a resolution of one second, so the estimate improves as 1/baseline;
+ * that uncertainty is included when choosing the next re-sync period.
+ *
+ * The package is started once, and keeps requesting the time every
+ * CONFIG_LORAWAN_APP_CLOCK_SYNC_PERIODICITY. When drift needs a shorter
+ * period, we send AppTimeReq ourselves with the package's current token, so
+ * the package still applies the answer.
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+#include "clock.h"
+#include "leap_seconds.h"
+#include "workq.h"
+
+#define LOG_LEVEL CONFIG_LOG_DBG_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(clock);
+
+#define PPB 1000000000LL
+
+// Clock sync package commands and AppTimeReq parameters
+#define CLOCK_CMD_PACKAGE_VERSION   0x00
+#define CLOCK_CMD_APP_TIME          0x01
+#define CLOCK_CMD_PERIODICITY       0x02
+#define CLOCK_CMD_FORCE_RESYNC      0x03
+#define CLOCK_APP_TIME_LEN          6
+#define CLOCK_APP_TIME_ANS_LEN      5
+#define CLOCK_TOKEN_MASK            0x0F
+#define CLOCK_ANS_REQUIRED          BIT(4)
+
+// GPS-UTC offset from each leap second on, see leap_seconds.h
+#define CLOCK_X_LEAP(gps_time, offset) { gps_time, offset },
+
+static const struct {
+	uint32_t gps_time;
+	uint8_t offset;
+} leap_seconds[] = {
+	LEAP_SECONDS_TABLE(CLOCK_X_LEAP)
+};
+
+struct clock_sync_point {
+	int64_t ticks;          // Uptime ticks at sync
+	uint64_t gps_us;        // GPS time at sync
+};
+
+static struct {
+	struct k_spinlock lock;
+	bool synced;
+	struct clock_sync_point anchor;         // First sync of this drift baseline
+	struct clock_sync_point last;           // Most recent sync
+	int32_t drift_ppb;                      // Local clock error, positive if running slow
+	uint32_t syncs;
+	uint32_t resync_period;                 // Seconds
+	uint8_t token;                          // Package's next AppTimeReq token
+} clk;
+
+static struct k_work_delayable sync_work;
+static struct k_work_delayable resync_work;
+
+uint8_t clock_leap_seconds(uint32_t gps_time)
+{
+	for (int i = ARRAY_SIZE(leap_seconds) - 1; i >= 0; i--) {
+		if (gps_time >= leap_seconds[i].gps_time) {
+			return leap_seconds[i].offset;
+		}
+	}
+	return 0;
+}
+
+uint32_t clock_gps_to_unix(uint32_t gps_time)
+{
+	return gps_time + CLOCK_GPS_UNIX_OFFSET - clock_leap_seconds(gps_time);
+}
+
+static uint64_t clock_extrapolate(const struct clock_sync_point *from, int64_t ticks, int32_t drift_ppb)
+{
+	int64_t elapsed_us = k_ticks_to_us_floor64(ticks - from->ticks);
+
+	return from->gps_us + elapsed_us + (elapsed_us * drift_ppb) / PPB;
+}
+
+static uint32_t clock_next_period(void)
+{
+	int64_t baseline_us;
+	int64_t uncertainty_ppb;
+	int64_t error_ppb;
+
+	if (clk.syncs < 2) {
+		return CLOCK_RESYNC_MIN;
+	}
+
+	// One second of quantisation error spread over the baseline
+	baseline_us = k_ticks_to_us_floor64(clk.last.ticks - clk.anchor.ticks);
+	uncertainty_ppb = (USEC_PER_SEC * PPB) / MAX(baseline_us, 1);
+	error_ppb = llabs(clk.drift_ppb) + uncertainty_ppb;
+
+	// Time for the worst case error to reach CLOCK_MAX_ERROR_MS
+	return CLAMP((CLOCK_MAX_ERROR_MS * (PPB / MSEC_PER_SEC)) / error_ppb,
+		     CLOCK_RESYNC_MIN, CLOCK_RESYNC_MAX);
+}
+
+static void clock_sync_work_handler(struct k_work *work)
+{
+	struct clock_sync_point now;
+	uint32_t gps_time;
+	int64_t uptime_ms;
+	int64_t step_ms = 0;
+	int ret;
+
+	/*
+	 * lorawan_clock_sync_get() returns whole seconds of k_uptime plus the network
+	 * offset, so the sub-second part of our uptime carries over unchanged.
+	 */
+	now.ticks = k_uptime_ticks();
+	ret = lorawan_clock_sync_get(&gps_time);
+	if (ret != 0) {
+		LOG_ERR("lorawan_clock_sync_get returned %d", ret);
+		return;
+	}
+	uptime_ms = k_ticks_to_ms_floor64(now.ticks);
+	now.gps_us = ((uint64_t)gps_time * MSEC_PER_SEC + (uptime_ms % MSEC_PER_SEC)) * USEC_PER_MSEC;
+
+	k_spinlock_key_t key = k_spin_lock(&clk.lock);
+
+	if (clk.synced) {
+		step_ms = ((int64_t)now.gps_us - (int64_t)clock_extrapolate(&clk.last, now.ticks, clk.drift_ppb)) / USEC_PER_MSEC;
+	}
+
+	if (!clk.synced || llabs(step_ms) > CLOCK_STEP_LIMIT_MS) {
+		// First sync, or time jumped (e.g. stack restarted), start a new baseline.
+		clk.anchor = now;
+		clk.drift_ppb = 0;
+		clk.syncs = 1;
+	} else {
+		int64_t local_us = k_ticks_to_us_floor64(now.ticks - clk.anchor.ticks);
+		int64_t network_us = now.gps_us - clk.anchor.gps_us;
+
+		if (local_us > 0) {
+			clk.drift_ppb = ((network_us - local_us) * (PPB / USEC_PER_SEC)) / (local_us / USEC_PER_SEC + 1);
+		}
+		clk.syncs++;
+	}
+
+	clk.last = now;
+	clk.synced = true;
+	clk.resync_period = clock_next_period();
+
+	k_spin_unlock(&clk.lock, key);
+
+	LOG_INF("Synced to GPS time %u (step %lldms), drift %dppb, next sync in %us",
+		gps_time, step_ms, clk.drift_ppb, clk.resync_period);
+
+	k_work_reschedule_for_queue(&app_workq, &resync_work, K_SECONDS(clk.resync_period));
+}
+
+static void clock_resync_work_handler(struct k_work *work)
+{
+	uint8_t req[CLOCK_APP_TIME_LEN];
+	uint32_t device_time;
+	int ret;
+
+	/*
+	 * Device time as the package sends it: uptime plus its current offset,
+	 * which is just uptime before the first answer.
+	 */
+	if (lorawan_clock_sync_get(&device_time) != 0) {
+		device_time = k_uptime_get() / MSEC_PER_SEC;
+	}
+
+	req[0] = CLOCK_CMD_APP_TIME;
+	sys_put_le32(device_time, &req[1]);
+	req[5] = CLOCK_ANS_REQUIRED | clk.token;
+
+	ret = lorawan_send(CLOCK_SYNC_PORT, req, sizeof(req), LORAWAN_MSG_UNCONFIRMED);
+	if (ret < 0) {
+		LOG_WRN("AppTimeReq failed (%d)", ret);
+	}
+
+	// Retry if the answer doesn't arrive (reset on successful sync).
+	k_work_reschedule_for_queue(&app_workq, &resync_work, K_SECONDS(CLOCK_RESYNC_MIN));
+}
+
+static void clock_dl_callback(uint8_t port, bool data_pending, int16_t rssi, int8_t snr, uint8_t len, const uint8_t *data)
+{
+	uint8_t pos = 0;
+
+	// Follow the package's token, which advances on each answer it accepts.
+	while (pos < len) {
+		switch (data[pos++]) {
+		case CLOCK_CMD_APP_TIME:
+			if (len - pos < CLOCK_APP_TIME_ANS_LEN) {
+				return;
+			}
+			if ((data[pos + 4] & CLOCK_TOKEN_MASK) == clk.token) {
+				clk.token = (clk.token + 1) & CLOCK_TOKEN_MASK;
+				// Let the package apply the correction before we sample it.
+				k_work_reschedule_for_queue(&app_workq, &sync_work, K_MSEC(10));
+			}
+			pos += CLOCK_APP_TIME_ANS_LEN;
+			break;
+		case CLOCK_CMD_PERIODICITY:
+		case CLOCK_CMD_FORCE_RESYNC:
+			pos++;
+			break;
+		case CLOCK_CMD_PACKAGE_VERSION:
+			break;
+		default:
+			return;
+		}
+	}
+}
+
+static struct lorawan_downlink_cb clock_downlink_cb = {
+	.port = CLOCK_SYNC_PORT,
+	.cb = clock_dl_callback
+};
+
+int clock_init(void)
+{
+	k_work_init_delayable(&sync_work, clock_sync_work_handler);
+	k_work_init_delayable(&resync_work, clock_resync_work_handler);
+
+	clk.resync_period = CLOCK_RESYNC_MIN;
+	lorawan_register_downlink_callback(&clock_downlink_cb);
+
+	/*
+	 * Registers the package's own port 202 callback and periodic request, and
+	 * sends the first AppTimeReq. Only call it once: registering the callback
+	 * again would corrupt the stack's downlink callback list.
+	 */
+	lorawan_clock_sync_run();
+
+	// Ask again ourselves if the first answer doesn't arrive.
+	k_work_reschedule_for_queue(&app_workq, &resync_work, K_SECONDS(CLOCK_RESYNC_MIN));
+	return 0;
+}
+
+bool clock_is_synced(void)
+{
+	return clk.synced;
+}
+
+int clock_get_gps_us(uint64_t *gps_us)
+{
+	int64_t ticks = k_uptime_ticks();
+	k_spinlock_key_t key = k_spin_lock(&clk.lock);
+
+	if (!clk.synced) {
+		k_spin_unlock(&clk.lock, key);
+		return -EAGAIN;
+	}
+
+	*gps_us = clock_extrapolate(&clk.last, ticks, clk.drift_ppb);
+	k_spin_unlock(&clk.lock, key);
+	return 0;
+}
+
+int clock_get_unix_us(uint64_t *unix_us)
+{
+	uint64_t gps_us;
+	uint32_t gps_time;
+	int ret;
+
+	ret = clock_get_gps_us(&gps_us);
+	if (ret != 0) {
+		return ret;
+	}
+
+	gps_time = gps_us / USEC_PER_SEC;
+	*unix_us = gps_us + (uint64_t)(CLOCK_GPS_UNIX_OFFSET - clock_leap_seconds(gps_time)) * USEC_PER_SEC;
+	return 0;
+}
+
+int32_t clock_get_drift_ppb(void)
+{
+	return clk.drift_ppb;
+}
+
+uint32_t clock_get_resync_period(void)
+{
+	return clk.resync_period;
+}
@@ -0,0 +1,35 @@
+
+/*
+ * Disciplined local clock built on LoRaWAN Application Layer Clock Sync
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Difference between UNIX (Jan 1st 1970) and GPS (Jan 6th 1980) epochs, excluding leap seconds
+#define CLOCK_GPS_UNIX_OFFSET       315964800
+
+// Port used by the LoRaWAN Application Layer Clock Synchronization package
+#define CLOCK_SYNC_PORT             202
+
+// Error we are prepared to accumulate between syncs (clock sync resolution is 1 second)
+#define CLOCK_MAX_ERROR_MS          1000
+
+// Bounds on the adaptive re-sync period (seconds). At the maximum, the clock sync
+// package's own requests (every CONFIG_LORAWAN_APP_CLOCK_SYNC_PERIODICITY +/-30s)
+// arrive first and ours is only a fallback.
+#define CLOCK_RESYNC_MIN            3600
+#define CLOCK_RESYNC_MAX            (CONFIG_LORAWAN_APP_CLOCK_SYNC_PERIODICITY + 60)
+
+// Steps larger than this between prediction and a new sync restart drift estimation
+#define CLOCK_STEP_LIMIT_MS         10000
+
+int clock_init(void);
+bool clock_is_synced(void);
+int clock_get_gps_us(uint64_t *gps_us);
+int clock_get_unix_us(uint64_t *unix_us);
+uint32_t clock_gps_to_unix(uint32_t gps_time);
+uint8_t clock_leap_seconds(uint32_t gps_time);
+int32_t clock_get_drift_ppb(void);
+uint32_t clock_get_resync_period(void);
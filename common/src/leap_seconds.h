@@ -0,0 +1,36 @@
+
+/*
+ * Leap seconds
+ *
+ * Copyright (c) 2023 Craig Peacock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * GPS time (seconds) at which each leap second took effect, and the resulting
+ * GPS-UTC offset. Shared by clock.c and the payload formatter generated by
+ * LoRaWAN/tools/payload_tool.c. Update when IERS Bulletin C announces a new
+ * leap second, then regenerate the formatter.
+ *
+ * X(gps_time, offset)
+ */
+#define LEAP_SECONDS_TABLE(X) \
+	X(  46828801,  1)     /* 1981-07-01 */ \
+	X(  78364802,  2)     /* 1982-07-01 */ \
+	X( 109900803,  3)     /* 1983-07-01 */ \
+	X( 173059204,  4)     /* 1985-07-01 */ \
+	X( 252028805,  5)     /* 1988-01-01 */ \
+	X( 315187206,  6)     /* 1990-01-01 */ \
+	X( 346723207,  7)     /* 1991-01-01 */ \
+	X( 393984008,  8)     /* 1992-07-01 */ \
+	X( 425520009,  9)     /* 1993-07-01 */ \
+	X( 457056010, 10)     /* 1994-07-01 */ \
+	X( 504489611, 11)     /* 1996-01-01 */ \
+	X( 551750412, 12)     /* 1997-07-01 */ \
+	X( 599184013, 13)     /* 1999-01-01 */ \
+	X( 820108814, 14)     /* 2006-01-01 */ \
+	X( 914803215, 15)     /* 2009-01-01 */ \
+	X(1025136016, 16)     /* 2012-07-01 */ \
+	X(1119744017, 17)     /* 2015-07-01 */ \
+	X(1167264018, 18)     /* 2017-01-01 */